@@ -0,0 +1,998 @@
+#include "extlzma.h"
+
+#ifdef HAVE_PTHREAD_H
+#   include <pthread.h>
+#   include <signal.h>
+#endif
+
+#ifdef HAVE_UNISTD_H
+#   include <unistd.h>
+#endif
+
+/*
+ * xz の整合値 (check) を計算するための共通処理と、
+ * それを Digest::Instance 互換のオブジェクトとして提供する LZMA::Utils::CRC32 /
+ * LZMA::Utils::CRC64 / LZMA::Utils::SHA256 クラス、
+ * 伸張したデータの整合値を別のスレッドで確認する LZMA::Utils::CheckPipe クラス。
+ *
+ * liblzma は SHA-256 の関数を公開していないため、ここで実装している。
+ */
+
+/* SECTION: SHA-256 (FIPS 180-4) */
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROTR32(X, N) (((X) >> (N)) | ((X) << (32 - (N))))
+
+static void
+sha256_transform(uint32_t h[8], const uint8_t *block)
+{
+    uint32_t w[64];
+
+    for (int i = 0; i < 16; i ++) {
+        w[i] = ((uint32_t)block[i * 4] << 24) | ((uint32_t)block[i * 4 + 1] << 16) |
+               ((uint32_t)block[i * 4 + 2] << 8) | (uint32_t)block[i * 4 + 3];
+    }
+
+    for (int i = 16; i < 64; i ++) {
+        uint32_t s0 = ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3];
+    uint32_t e = h[4], f = h[5], g = h[6], hh = h[7];
+
+    for (int i = 0; i < 64; i ++) {
+        uint32_t s1 = ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25);
+        uint32_t ch = (e & f) ^ (~e & g);
+        uint32_t t1 = hh + s1 + ch + sha256_k[i] + w[i];
+        uint32_t s0 = ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22);
+        uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t t2 = s0 + maj;
+
+        hh = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+    h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+}
+
+#undef ROTR32
+
+static void
+sha256_init(struct extlzma_sha256 *p)
+{
+    static const uint32_t init[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+
+    memcpy(p->h, init, sizeof(init));
+    p->size = 0;
+}
+
+static void
+sha256_update(struct extlzma_sha256 *p, const uint8_t *ptr, size_t size)
+{
+    size_t fill = p->size & 63;
+    p->size += size;
+
+    if (fill > 0) {
+        size_t n = 64 - fill;
+        if (n > size) { n = size; }
+        memcpy(p->buf + fill, ptr, n);
+        ptr += n;
+        size -= n;
+        if (fill + n < 64) { return; }
+        sha256_transform(p->h, p->buf);
+    }
+
+    for (; size >= 64; ptr += 64, size -= 64) {
+        sha256_transform(p->h, ptr);
+    }
+
+    if (size > 0) { memcpy(p->buf, ptr, size); }
+}
+
+static void
+sha256_finish(struct extlzma_sha256 *p, uint8_t out[32])
+{
+    uint64_t bits = p->size * 8;
+    uint8_t pad[72] = { 0x80 };
+    size_t padsize = ((p->size & 63) < 56 ? 56 : 120) - (p->size & 63);
+
+    for (int i = 0; i < 8; i ++) {
+        pad[padsize + i] = (uint8_t)(bits >> (56 - i * 8));
+    }
+    sha256_update(p, pad, padsize + 8);
+
+    for (int i = 0; i < 8; i ++) {
+        out[i * 4]     = (uint8_t)(p->h[i] >> 24);
+        out[i * 4 + 1] = (uint8_t)(p->h[i] >> 16);
+        out[i * 4 + 2] = (uint8_t)(p->h[i] >> 8);
+        out[i * 4 + 3] = (uint8_t)(p->h[i]);
+    }
+}
+
+/* SECTION: 整合値の共通処理 */
+
+int
+extlzma_check_init(struct extlzma_check *check, lzma_check type, uint64_t init)
+{
+    check->type = type;
+
+    switch (type) {
+    case LZMA_CHECK_NONE:
+        return 0;
+    case LZMA_CHECK_CRC32:
+    case LZMA_CHECK_CRC64:
+        check->state.crc = init;
+        return 0;
+    case LZMA_CHECK_SHA256:
+        sha256_init(&check->state.sha256);
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+void
+extlzma_check_update(struct extlzma_check *check, const uint8_t *ptr, size_t size)
+{
+    switch (check->type) {
+    case LZMA_CHECK_CRC32:
+        check->state.crc = lzma_crc32(ptr, size, (uint32_t)check->state.crc);
+        break;
+    case LZMA_CHECK_CRC64:
+        check->state.crc = lzma_crc64(ptr, size, check->state.crc);
+        break;
+    case LZMA_CHECK_SHA256:
+        sha256_update(&check->state.sha256, ptr, size);
+        break;
+    default:
+        break;
+    }
+}
+
+/*
+ * xz ファイルフォーマットに格納される形 (CRC はリトルエンディアン) で整合値を書き出す。
+ *
+ * check の状態は破棄される (SHA-256 の場合)。
+ */
+size_t
+extlzma_check_finish(struct extlzma_check *check, uint8_t out[EXTLZMA_CHECK_SIZE_MAX])
+{
+    switch (check->type) {
+    case LZMA_CHECK_CRC32:
+        for (int i = 0; i < 4; i ++) { out[i] = (uint8_t)(check->state.crc >> (i * 8)); }
+        return 4;
+    case LZMA_CHECK_CRC64:
+        for (int i = 0; i < 8; i ++) { out[i] = (uint8_t)(check->state.crc >> (i * 8)); }
+        return 8;
+    case LZMA_CHECK_SHA256:
+        sha256_finish(&check->state.sha256, out);
+        return 32;
+    default:
+        return 0;
+    }
+}
+
+/* SECTION: LZMA::Utils::CRC32 / CRC64 / SHA256 */
+
+static VALUE cCRC32;
+static VALUE cCRC64;
+static VALUE cSHA256;
+
+struct digest
+{
+    struct extlzma_check check;
+    uint64_t init;
+    int busy;               // GVL を解放して update している間
+};
+
+static size_t
+digest_memsize(const void *p)
+{
+    return sizeof(struct digest);
+}
+
+static const rb_data_type_t digest_type = {
+    "extlzma.digest",
+    { NULL, RUBY_TYPED_DEFAULT_FREE, digest_memsize, },
+    NULL, NULL, RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+static inline struct digest *
+getdigest(VALUE obj)
+{
+    return rb_check_typeddata(obj, &digest_type);
+}
+
+/*
+ * update が GVL を解放している間は、他のスレッドから状態を変更・参照させない。
+ */
+static inline struct digest *
+getdigest_idle(VALUE obj)
+{
+    struct digest *p = getdigest(obj);
+    if (p->busy) {
+        rb_raise(rb_eRuntimeError, "digest in use by another thread");
+    }
+    return p;
+}
+
+static inline lzma_check
+digest_class_type(VALUE klass)
+{
+    if (RTEST(rb_class_inherited_p(klass, cCRC32))) { return LZMA_CHECK_CRC32; }
+    if (RTEST(rb_class_inherited_p(klass, cCRC64))) { return LZMA_CHECK_CRC64; }
+    return LZMA_CHECK_SHA256;
+}
+
+static VALUE
+digest_alloc(VALUE klass)
+{
+    struct digest *p;
+    VALUE obj = TypedData_Make_Struct(klass, struct digest, &digest_type, p);
+    p->init = 0;
+    p->busy = 0;
+    extlzma_check_init(&p->check, digest_class_type(klass), 0);
+    return obj;
+}
+
+/*
+ * call-seq:
+ *  initialize(init = 0)
+ *
+ * [init]   CRC の初期値を与えます (LZMA::Utils::SHA256 では与えることが出来ません)。
+ */
+static VALUE
+digest_init(int argc, VALUE argv[], VALUE self)
+{
+    struct digest *p = getdigest_idle(self);
+
+    if (p->check.type == LZMA_CHECK_SHA256) {
+        rb_check_arity(argc, 0, 0);
+    } else {
+        rb_check_arity(argc, 0, 1);
+        p->init = (argc > 0 && !NIL_P(argv[0]) ? NUM2ULL(rb_to_int(argv[0])) : 0);
+        if (p->check.type == LZMA_CHECK_CRC32) { p->init &= 0xffffffffUL; }
+    }
+
+    extlzma_check_init(&p->check, p->check.type, p->init);
+
+    return self;
+}
+
+static VALUE
+digest_init_copy(VALUE self, VALUE orig)
+{
+    if (self == orig) { return self; }
+    rb_obj_init_copy(self, orig);
+    struct digest *p = getdigest_idle(self);
+    memcpy(p, getdigest_idle(orig), sizeof(struct digest));
+    return self;
+}
+
+static void *
+digest_update_nogvl(va_list *vp)
+{
+    struct extlzma_check *check = va_arg(*vp, struct extlzma_check *);
+    const uint8_t *ptr = va_arg(*vp, const uint8_t *);
+    size_t size = va_arg(*vp, size_t);
+    extlzma_check_update(check, ptr, size);
+    return NULL;
+}
+
+struct digest_update
+{
+    VALUE self;
+    VALUE src;
+};
+
+static VALUE
+digest_update_body(VALUE pp)
+{
+    struct digest_update *u = (struct digest_update *)pp;
+    struct digest *p = getdigest(u->self);
+    const uint8_t *ptr = (const uint8_t *)RSTRING_PTR(u->src);
+    size_t size = RSTRING_LEN(u->src);
+
+    aux_thread_call_with_policy(EXTLZMA_GVL_CRC, size, 0,
+                                digest_update_nogvl, &p->check, ptr, size);
+
+    return Qnil;
+}
+
+static VALUE
+digest_update_leave(VALUE self)
+{
+    getdigest(self)->busy = 0;
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *  update(string) -> self
+ *  self << string -> self
+ *
+ * 整合値を更新します。
+ *
+ * GVL を解放するかどうかは LZMA::GVL の方針 (+:crc+) に従います。
+ * 処理している間に他のスレッドから同じオブジェクトの update / reset / digest などを呼ぶと、
+ * RuntimeError 例外が発生します。
+ */
+static VALUE
+digest_update(VALUE self, VALUE src)
+{
+    struct digest *p = getdigest_idle(self);
+    rb_check_type(src, RUBY_T_STRING);
+
+    /*
+     * GVL を解放している間に他のスレッドが文字列を変更しても影響を受けないように、
+     * 凍結した複写 (内容は共有される) の領域を参照する。
+     */
+    struct digest_update u = { self, rb_str_new_frozen(src) };
+
+    p->busy = 1;
+    rb_ensure(digest_update_body, (VALUE)&u, digest_update_leave, self);
+
+    RB_GC_GUARD(u.src);
+
+    return self;
+}
+
+/*
+ * call-seq:
+ *  reset -> self
+ *
+ * 初期状態に戻します。
+ */
+static VALUE
+digest_reset(VALUE self)
+{
+    struct digest *p = getdigest_idle(self);
+    extlzma_check_init(&p->check, p->check.type, p->init);
+    return self;
+}
+
+/*
+ * call-seq:
+ *  finish -> binary string
+ *
+ * Digest::Instance#digest などから呼ばれ、整合値をバイナリ文字列で返します。
+ *
+ * CRC はビッグエンディアンとなります。
+ */
+static VALUE
+digest_finish(VALUE self)
+{
+    struct digest *p = getdigest_idle(self);
+    uint8_t buf[EXTLZMA_CHECK_SIZE_MAX];
+
+    switch (p->check.type) {
+    case LZMA_CHECK_CRC32:
+        for (int i = 0; i < 4; i ++) { buf[i] = (uint8_t)(p->check.state.crc >> (24 - i * 8)); }
+        return rb_str_new((const char *)buf, 4);
+    case LZMA_CHECK_CRC64:
+        for (int i = 0; i < 8; i ++) { buf[i] = (uint8_t)(p->check.state.crc >> (56 - i * 8)); }
+        return rb_str_new((const char *)buf, 8);
+    default:
+        {
+            struct extlzma_check tmp = p->check;
+            size_t size = extlzma_check_finish(&tmp, buf);
+            return rb_str_new((const char *)buf, size);
+        }
+    }
+}
+
+static VALUE
+digest_length(VALUE self)
+{
+    switch (getdigest(self)->check.type) {
+    case LZMA_CHECK_CRC32:  return INT2FIX(4);
+    case LZMA_CHECK_CRC64:  return INT2FIX(8);
+    default:                return INT2FIX(32);
+    }
+}
+
+static VALUE
+digest_block_length(VALUE self)
+{
+    return INT2FIX(getdigest(self)->check.type == LZMA_CHECK_SHA256 ? 64 : 1);
+}
+
+/*
+ * call-seq:
+ *  state -> integer
+ *
+ * 現在の CRC 値を整数値で返します。
+ */
+static VALUE
+digest_state(VALUE self)
+{
+    struct digest *p = getdigest_idle(self);
+    if (p->check.type == LZMA_CHECK_CRC32) {
+        return UINT2NUM((uint32_t)p->check.state.crc);
+    } else {
+        return ULL2NUM(p->check.state.crc);
+    }
+}
+
+/*
+ * call-seq:
+ *  init -> integer
+ *
+ * CRC の初期値を返します。
+ */
+static VALUE
+digest_get_init(VALUE self)
+{
+    return ULL2NUM(getdigest(self)->init);
+}
+
+/* SECTION: LZMA::Utils::CheckPipe */
+
+/*
+ * 伸張したデータをブロックごとに受け取り、専用のネイティブスレッドで整合値を計算して、
+ * ストリームに格納されている値と比較する。
+ *
+ * データは呼び出し側の文字列を参照せずに複写して待ち行列に繋ぐ
+ * (GC で文字列が回収されても作業スレッドが参照し続けることのないようにするため)。
+ * 待ち行列に溜まっているバイト数が max_pending を超える場合、update は作業スレッドが追いつくのを待つ。
+ *
+ * pthread が利用できない環境では、呼び出したスレッドでそのまま計算する。
+ */
+
+static VALUE cCheckPipe;
+
+enum {
+    CHECKPIPE_BEGIN,
+    CHECKPIPE_DATA,
+    CHECKPIPE_END,
+};
+
+struct checkpipe_item
+{
+    struct checkpipe_item *next;
+    int kind;
+    lzma_check type;        // CHECKPIPE_BEGIN
+    long id;                // CHECKPIPE_END
+    size_t size;
+    uint8_t data[];         // CHECKPIPE_DATA では伸張したデータ、CHECKPIPE_END では格納されている整合値
+};
+
+struct checkpipe
+{
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_t lock;
+    pthread_cond_t arrive;      // 作業スレッドが項目を待つ
+    pthread_cond_t drain;       // 呼び出し側が待ち行列の減少を待つ
+    pthread_t thread;
+    int started;
+    pid_t owner;                // 作業スレッドを生成したプロセス
+#endif
+    struct checkpipe_item *head, *tail;
+    size_t pending;
+    size_t max_pending;
+    int stop;
+    int interrupt;
+    long failed;            // 最初に一致しなかったブロックの id。-1 であれば不一致なし
+    uint64_t blocks;
+    uint64_t bytes;
+    struct extlzma_check check;
+};
+
+/*
+ * 一つの項目を処理する。作業スレッドで (または pthread のない環境では呼び出したスレッドで) 呼ばれる。
+ */
+static void
+checkpipe_process(struct checkpipe *p, const struct checkpipe_item *item)
+{
+    switch (item->kind) {
+    case CHECKPIPE_BEGIN:
+        extlzma_check_init(&p->check, item->type, 0);
+        break;
+    case CHECKPIPE_DATA:
+        extlzma_check_update(&p->check, item->data, item->size);
+        __atomic_fetch_add(&p->bytes, item->size, __ATOMIC_RELAXED);
+        break;
+    case CHECKPIPE_END:
+        {
+            uint8_t out[EXTLZMA_CHECK_SIZE_MAX];
+            size_t size = extlzma_check_finish(&p->check, out);
+            if (size != item->size || memcmp(out, item->data, size) != 0) {
+                __atomic_store_n(&p->failed, item->id, __ATOMIC_RELEASE);
+            }
+            extlzma_check_init(&p->check, LZMA_CHECK_NONE, 0);
+            __atomic_fetch_add(&p->blocks, 1, __ATOMIC_RELAXED);
+        }
+        break;
+    }
+}
+
+#ifdef HAVE_PTHREAD_H
+/*
+ * fork した子プロセスには作業スレッドが存在せず、lock もそのスレッドが保持したままのことがある。
+ * そのため子プロセスでは join も待ち合わせも行わず、CheckPipe を用いることも出来ない。
+ */
+static inline int
+checkpipe_forked_p(const struct checkpipe *p)
+{
+    return (p->started && p->owner != getpid());
+}
+
+static void *
+checkpipe_worker(void *pp)
+{
+    struct checkpipe *p = pp;
+
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        while (!p->head && !p->stop) {
+            pthread_cond_wait(&p->arrive, &p->lock);
+        }
+        if (!p->head) { break; }
+
+        struct checkpipe_item *item = p->head;
+        pthread_mutex_unlock(&p->lock);
+
+        // 不一致が見つかった後は計算を省く
+        if (__atomic_load_n(&p->failed, __ATOMIC_ACQUIRE) < 0 && !p->stop) { checkpipe_process(p, item); }
+
+        pthread_mutex_lock(&p->lock);
+        p->head = item->next;
+        if (!p->head) { p->tail = NULL; }
+        if (item->kind == CHECKPIPE_DATA) { p->pending -= item->size; }
+        pthread_cond_broadcast(&p->drain);
+        pthread_mutex_unlock(&p->lock);
+        free(item);
+        pthread_mutex_lock(&p->lock);
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    return NULL;
+}
+
+static void
+checkpipe_stop(struct checkpipe *p)
+{
+    if (!p->started) { return; }
+    if (checkpipe_forked_p(p)) {
+        p->started = 0;
+        return;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    p->stop = 1;
+    pthread_cond_broadcast(&p->arrive);
+    pthread_mutex_unlock(&p->lock);
+    pthread_join(p->thread, NULL);
+    p->started = 0;
+}
+#endif
+
+static void
+checkpipe_free(void *pp)
+{
+    struct checkpipe *p = pp;
+
+#ifdef HAVE_PTHREAD_H
+    if (checkpipe_forked_p(p)) {
+        /*
+         * 待ち行列は親プロセスの作業スレッドが書き換えている途中だったかもしれないため、
+         * 辿らずに (項目は解放せずに) 本体のみを解放する。
+         */
+        xfree(p);
+        return;
+    }
+
+    checkpipe_stop(p);
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->arrive);
+    pthread_cond_destroy(&p->drain);
+#endif
+
+    while (p->head) {
+        struct checkpipe_item *item = p->head;
+        p->head = item->next;
+        free(item);
+    }
+
+    xfree(p);
+}
+
+static size_t
+checkpipe_memsize(const void *pp)
+{
+    const struct checkpipe *p = pp;
+    return sizeof(*p) + p->pending;
+}
+
+static const rb_data_type_t checkpipe_type = {
+    "extlzma.checkpipe",
+    { NULL, checkpipe_free, checkpipe_memsize, },
+    NULL, NULL, 0,
+};
+
+static inline struct checkpipe *
+getcheckpipe(VALUE obj)
+{
+    return rb_check_typeddata(obj, &checkpipe_type);
+}
+
+static VALUE
+checkpipe_alloc(VALUE klass)
+{
+    struct checkpipe *p;
+    VALUE obj = TypedData_Make_Struct(klass, struct checkpipe, &checkpipe_type, p);
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->arrive, NULL);
+    pthread_cond_init(&p->drain, NULL);
+#endif
+    p->failed = -1;
+    p->stop = 1;    // initialize されるまでは受け付けない
+    extlzma_check_init(&p->check, LZMA_CHECK_NONE, 0);
+    return obj;
+}
+
+/*
+ * call-seq:
+ *  initialize(max_pending = 8 MiB)
+ *
+ * 整合値を計算する作業スレッドを生成します。
+ *
+ * [max_pending]
+ *      まだ整合値の計算に用いられていないデータの最大バイト数です。
+ */
+static VALUE
+checkpipe_init(int argc, VALUE argv[], VALUE self)
+{
+    struct checkpipe *p = getcheckpipe(self);
+    rb_check_arity(argc, 0, 1);
+    p->max_pending = (argc > 0 && !NIL_P(argv[0]) ? NUM2SIZET(argv[0]) : 8 << 20);
+
+#ifdef HAVE_PTHREAD_H
+    if (p->started) { rb_raise(rb_eRuntimeError, "already initialized - %+" PRIsVALUE, self); }
+
+    sigset_t all, saved;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &saved);
+    p->stop = 0;
+    p->owner = getpid();
+    int err = pthread_create(&p->thread, NULL, checkpipe_worker, p);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    if (err != 0) {
+        p->stop = 1;
+        rb_syserr_fail(err, "pthread_create");
+    }
+    p->started = 1;
+#else
+    p->stop = 0;
+#endif
+
+    return self;
+}
+
+#ifdef HAVE_PTHREAD_H
+struct checkpipe_wait
+{
+    struct checkpipe *pipe;
+    size_t limit;       // pending がこれ以下になるまで待つ (0 であれば待ち行列が空になるまで)
+};
+
+static void *
+checkpipe_wait_nogvl(void *pp)
+{
+    struct checkpipe_wait *w = pp;
+    struct checkpipe *p = w->pipe;
+
+    pthread_mutex_lock(&p->lock);
+    while (!p->interrupt && (w->limit > 0 ? p->pending > w->limit : p->head != NULL)) {
+        pthread_cond_wait(&p->drain, &p->lock);
+    }
+    p->interrupt = 0;
+    pthread_mutex_unlock(&p->lock);
+
+    return NULL;
+}
+
+static void
+checkpipe_wait_cancel(void *pp)
+{
+    struct checkpipe *p = ((struct checkpipe_wait *)pp)->pipe;
+
+    pthread_mutex_lock(&p->lock);
+    p->interrupt = 1;
+    pthread_cond_broadcast(&p->drain);
+    pthread_mutex_unlock(&p->lock);
+}
+
+static int
+checkpipe_ready_p(struct checkpipe *p, size_t limit)
+{
+    pthread_mutex_lock(&p->lock);
+    int ready = (limit > 0 ? p->pending <= limit : p->head == NULL);
+    pthread_mutex_unlock(&p->lock);
+    return ready;
+}
+
+static void
+checkpipe_wait(struct checkpipe *p, size_t limit)
+{
+    struct checkpipe_wait w = { p, limit };
+
+    if (checkpipe_forked_p(p)) { rb_raise(rb_eIOError, "check pipe used after fork"); }
+
+    while (!checkpipe_ready_p(p, limit)) {
+        rb_thread_call_without_gvl(checkpipe_wait_nogvl, &w, checkpipe_wait_cancel, &w);
+        rb_thread_check_ints();
+    }
+}
+#endif
+
+static void
+checkpipe_push(struct checkpipe *p, struct checkpipe_item *item)
+{
+    item->next = NULL;
+
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_lock(&p->lock);
+    if (p->tail) { p->tail->next = item; } else { p->head = item; }
+    p->tail = item;
+    if (item->kind == CHECKPIPE_DATA) { p->pending += item->size; }
+    pthread_cond_signal(&p->arrive);
+    pthread_mutex_unlock(&p->lock);
+#else
+    if (p->failed < 0) { checkpipe_process(p, item); }
+    free(item);
+#endif
+}
+
+static struct checkpipe_item *
+checkpipe_item_new(struct checkpipe *p, int kind, const void *data, size_t size)
+{
+    if (p->stop) { rb_raise(rb_eIOError, "closed check pipe"); }
+#ifdef HAVE_PTHREAD_H
+    if (checkpipe_forked_p(p)) { rb_raise(rb_eIOError, "check pipe used after fork"); }
+#endif
+
+    struct checkpipe_item *item = malloc(sizeof(*item) + size);
+    if (!item) { rb_raise(rb_eNoMemError, "failed to allocate check pipe item"); }
+    memset(item, 0, sizeof(*item));
+    item->kind = kind;
+    item->size = size;
+    if (size > 0) { memcpy(item->data, data, size); }
+    return item;
+}
+
+/*
+ * call-seq:
+ *  begin_block(check) -> self
+ *
+ * 新たなブロックの整合値の計算を始めます。check は LZMA::CHECK_CRC64 などの整合値の種類です。
+ */
+static VALUE
+checkpipe_begin_block(VALUE self, VALUE check)
+{
+    struct checkpipe *p = getcheckpipe(self);
+    lzma_check type = (lzma_check)NUM2INT(check);
+    if (!lzma_check_is_supported(type)) {
+        rb_raise(rb_eArgError, "unsupported check - %d", (int)type);
+    }
+
+    struct checkpipe_item *item = checkpipe_item_new(p, CHECKPIPE_BEGIN, NULL, 0);
+    item->type = type;
+    checkpipe_push(p, item);
+
+    return self;
+}
+
+/*
+ * call-seq:
+ *  update(string) -> self
+ *  self << string -> self
+ *
+ * ブロックの伸張したデータを与えます。
+ *
+ * 待ち行列に溜まっているデータが max_pending を超える場合は、作業スレッドの処理が進むまで (GVL を解放して) 待ちます。
+ */
+static VALUE
+checkpipe_update(VALUE self, VALUE src)
+{
+    struct checkpipe *p = getcheckpipe(self);
+    rb_check_type(src, RUBY_T_STRING);
+    if (RSTRING_LEN(src) == 0) { return self; }
+
+#ifdef HAVE_PTHREAD_H
+    if (p->max_pending > (size_t)RSTRING_LEN(src)) {
+        checkpipe_wait(p, p->max_pending - RSTRING_LEN(src));
+    } else {
+        checkpipe_wait(p, 0);
+    }
+#endif
+
+    checkpipe_push(p, checkpipe_item_new(p, CHECKPIPE_DATA, RSTRING_PTR(src), RSTRING_LEN(src)));
+
+    return self;
+}
+
+/*
+ * call-seq:
+ *  end_block(stored, id) -> self
+ *
+ * ブロックの終わりを伝え、計算した整合値とストリームに格納されている整合値 stored (バイナリ文字列) を比較させます。
+ *
+ * 一致しなかった場合は、id (整数値) が LZMA::Utils::CheckPipe#failure などで返されます。
+ */
+static VALUE
+checkpipe_end_block(VALUE self, VALUE stored, VALUE id)
+{
+    struct checkpipe *p = getcheckpipe(self);
+    rb_check_type(stored, RUBY_T_STRING);
+    if (RSTRING_LEN(stored) > EXTLZMA_CHECK_SIZE_MAX) {
+        rb_raise(rb_eArgError, "stored check too long (%ld for 0..%d)", (long)RSTRING_LEN(stored), EXTLZMA_CHECK_SIZE_MAX);
+    }
+
+    struct checkpipe_item *item = checkpipe_item_new(p, CHECKPIPE_END, RSTRING_PTR(stored), RSTRING_LEN(stored));
+    item->id = NUM2LONG(id);
+    checkpipe_push(p, item);
+
+    return self;
+}
+
+/*
+ * call-seq:
+ *  failure -> id or nil
+ *
+ * これまでに確認を終えたブロックのうち、整合値が一致しなかった最初のブロックの id を返します。待ちません。
+ */
+static VALUE
+checkpipe_failure(VALUE self)
+{
+    long failed = __atomic_load_n(&getcheckpipe(self)->failed, __ATOMIC_ACQUIRE);
+    return (failed < 0 ? Qnil : LONG2NUM(failed));
+}
+
+/*
+ * call-seq:
+ *  wait -> id or nil
+ *
+ * 与えたすべてのブロックの確認が終わるまで (GVL を解放して) 待ち、
+ * 整合値が一致しなかった最初のブロックの id を返します。
+ */
+static VALUE
+checkpipe_wait_m(VALUE self)
+{
+#ifdef HAVE_PTHREAD_H
+    checkpipe_wait(getcheckpipe(self), 0);
+#endif
+    return checkpipe_failure(self);
+}
+
+/*
+ * call-seq:
+ *  close -> nil
+ *
+ * 作業スレッドを終了します。確認を終えていないデータは破棄されます。
+ *
+ * fork した子プロセスでは (作業スレッドが存在しないため) 以降は用いられないようにするのみです。
+ */
+static VALUE
+checkpipe_close(VALUE self)
+{
+    struct checkpipe *p = getcheckpipe(self);
+#ifdef HAVE_PTHREAD_H
+    checkpipe_stop(p);
+#endif
+    p->stop = 1;
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *  stats -> { blocks: integer, bytes: integer, pending: integer }
+ *
+ * 確認を終えたブロックの数、計算に用いたバイト数、待ち行列に溜まっているバイト数を返します。
+ */
+static VALUE
+checkpipe_stats(VALUE self)
+{
+    struct checkpipe *p = getcheckpipe(self);
+    VALUE hash = rb_hash_new();
+    rb_hash_aset(hash, ID2SYM(rb_intern("blocks")), ULL2NUM(__atomic_load_n(&p->blocks, __ATOMIC_RELAXED)));
+    rb_hash_aset(hash, ID2SYM(rb_intern("bytes")), ULL2NUM(__atomic_load_n(&p->bytes, __ATOMIC_RELAXED)));
+    rb_hash_aset(hash, ID2SYM(rb_intern("pending")), SIZET2NUM(__atomic_load_n(&p->pending, __ATOMIC_RELAXED)));
+    return hash;
+}
+
+/*
+ * call-seq:
+ *  LZMA::Utils.check_size(check) -> integer
+ *
+ * 整合値の種類 check (LZMA::CHECK_CRC64 など) がストリームに格納される際のバイト数を返します。
+ */
+static VALUE
+utils_check_size(VALUE mod, VALUE check)
+{
+    uint32_t size = lzma_check_size((lzma_check)NUM2INT(check));
+    if (size == UINT32_MAX) { rb_raise(rb_eArgError, "wrong check - %d", NUM2INT(check)); }
+    return UINT2NUM(size);
+}
+
+void
+extlzma_init_Check(void)
+{
+    /*
+     * Document-class: LZMA::Utils::CRC32
+     *
+     * CRC32 を Digest のように生成できるようになります。
+     */
+    cCRC32 = rb_define_class_under(extlzma_mUtils, "CRC32", rb_cObject);
+
+    /*
+     * Document-class: LZMA::Utils::CRC64
+     *
+     * CRC64 を Digest のように生成できるようになります。
+     */
+    cCRC64 = rb_define_class_under(extlzma_mUtils, "CRC64", rb_cObject);
+
+    /*
+     * Document-class: LZMA::Utils::SHA256
+     *
+     * xz の整合値と同じ処理で SHA-256 を Digest のように生成できるようになります。
+     */
+    cSHA256 = rb_define_class_under(extlzma_mUtils, "SHA256", rb_cObject);
+
+    VALUE classes[] = { cCRC32, cCRC64, cSHA256 };
+    for (size_t i = 0; i < ELEMENTOF(classes); i ++) {
+        VALUE klass = classes[i];
+        rb_define_alloc_func(klass, digest_alloc);
+        rb_define_method(klass, "initialize", RUBY_METHOD_FUNC(digest_init), -1);
+        rb_define_method(klass, "initialize_copy", RUBY_METHOD_FUNC(digest_init_copy), 1);
+        rb_define_method(klass, "update", RUBY_METHOD_FUNC(digest_update), 1);
+        rb_define_method(klass, "<<", RUBY_METHOD_FUNC(digest_update), 1);
+        rb_define_method(klass, "reset", RUBY_METHOD_FUNC(digest_reset), 0);
+        rb_define_private_method(klass, "finish", RUBY_METHOD_FUNC(digest_finish), 0);
+        rb_define_method(klass, "digest_length", RUBY_METHOD_FUNC(digest_length), 0);
+        rb_define_method(klass, "block_length", RUBY_METHOD_FUNC(digest_block_length), 0);
+    }
+
+    rb_define_method(cCRC32, "state", RUBY_METHOD_FUNC(digest_state), 0);
+    rb_define_method(cCRC32, "init", RUBY_METHOD_FUNC(digest_get_init), 0);
+    rb_define_method(cCRC64, "state", RUBY_METHOD_FUNC(digest_state), 0);
+    rb_define_method(cCRC64, "init", RUBY_METHOD_FUNC(digest_get_init), 0);
+
+    /*
+     * Document-class: LZMA::Utils::CheckPipe
+     *
+     * 伸張したデータの整合値を、専用のネイティブスレッドで計算して確認します。
+     *
+     * LZMA.decode の +offload_check:+ が用います。
+     */
+    cCheckPipe = rb_define_class_under(extlzma_mUtils, "CheckPipe", rb_cObject);
+    rb_define_alloc_func(cCheckPipe, checkpipe_alloc);
+    rb_define_method(cCheckPipe, "initialize", RUBY_METHOD_FUNC(checkpipe_init), -1);
+    rb_define_method(cCheckPipe, "begin_block", RUBY_METHOD_FUNC(checkpipe_begin_block), 1);
+    rb_define_method(cCheckPipe, "update", RUBY_METHOD_FUNC(checkpipe_update), 1);
+    rb_define_method(cCheckPipe, "<<", RUBY_METHOD_FUNC(checkpipe_update), 1);
+    rb_define_method(cCheckPipe, "end_block", RUBY_METHOD_FUNC(checkpipe_end_block), 2);
+    rb_define_method(cCheckPipe, "failure", RUBY_METHOD_FUNC(checkpipe_failure), 0);
+    rb_define_method(cCheckPipe, "wait", RUBY_METHOD_FUNC(checkpipe_wait_m), 0);
+    rb_define_method(cCheckPipe, "close", RUBY_METHOD_FUNC(checkpipe_close), 0);
+    rb_define_method(cCheckPipe, "stats", RUBY_METHOD_FUNC(checkpipe_stats), 0);
+
+    rb_define_method(extlzma_mUtils, "check_size", RUBY_METHOD_FUNC(utils_check_size), 1);
+}
@@ -48,6 +48,14 @@ extlzma_init_Constants(void)
     DEFINE_CONSTANT(CHECK_CRC64,        UINT2NUM(LZMA_CHECK_CRC64));
     DEFINE_CONSTANT(CHECK_SHA256,       UINT2NUM(LZMA_CHECK_SHA256));
 
+    DEFINE_CONSTANT(TELL_NO_CHECK,          UINT2NUM(LZMA_TELL_NO_CHECK));
+    DEFINE_CONSTANT(TELL_UNSUPPORTED_CHECK, UINT2NUM(LZMA_TELL_UNSUPPORTED_CHECK));
+    DEFINE_CONSTANT(TELL_ANY_CHECK,         UINT2NUM(LZMA_TELL_ANY_CHECK));
+    DEFINE_CONSTANT(CONCATENATED,           UINT2NUM(LZMA_CONCATENATED));
+#ifdef LZMA_IGNORE_CHECK
+    DEFINE_CONSTANT(IGNORE_CHECK,           UINT2NUM(LZMA_IGNORE_CHECK));
+#endif
+
     DEFINE_CONSTANT(RUN,                UINT2NUM(LZMA_RUN));
     DEFINE_CONSTANT(FULL_FLUSH,         UINT2NUM(LZMA_FULL_FLUSH));
     DEFINE_CONSTANT(SYNC_FLUSH,         UINT2NUM(LZMA_SYNC_FLUSH));
@@ -18,6 +18,7 @@ VALUE extlzma_eBufError;
 VALUE extlzma_eProgError;
 VALUE extlzma_eFilterTooLong;
 VALUE extlzma_eBadPreset;
+VALUE extlzma_eOutputLimitError;
 
 static inline VALUE
 lookup_exception(lzma_ret status)
@@ -55,6 +56,19 @@ extlzma_init_Exceptions(void)
     rb_define_class_under(extlzma_mExceptions, "FilterTooLong", extlzma_eBasicException);
     rb_define_class_under(extlzma_mExceptions, "BadPreset", extlzma_eBasicException);
 
+    /*
+     * Document-class: LZMA::Exceptions::OutputLimitError
+     *
+     * LZMA::Stream#max_output= や LZMA::Stream#max_ratio= で設定した出力の制限を超えた場合に発生します。
+     *
+     * +limit+ は超えた制限の種類 (+:max_output+ または +:max_ratio+) を、
+     * +input_offset+ と +output_offset+ は制限を超えた時点での入力と出力の位置を返します。
+     */
+    extlzma_eOutputLimitError = rb_define_class_under(extlzma_mExceptions, "OutputLimitError", extlzma_eBasicException);
+    rb_define_attr(extlzma_eOutputLimitError, "limit", 1, 0);
+    rb_define_attr(extlzma_eOutputLimitError, "input_offset", 1, 0);
+    rb_define_attr(extlzma_eOutputLimitError, "output_offset", 1, 0);
+
 #define DEFINE_EXCEPTION(CLASS, STATUS)                                           \
     {                                                                             \
         extlzma_e ## CLASS =                                                      \
@@ -0,0 +1,161 @@
+#include "extlzma.h"
+#include <math.h>
+
+/*
+ * 圧縮率の簡易な見積もり。
+ *
+ * 入力から標本をいくつかの区間に分けて取り出し、次の二つから圧縮後の大きさの比を見積もる。
+ *
+ *  - バイトの出現頻度から求めた 0 次のエントロピー (リテラルとして符号化される場合のビット数)
+ *  - 4 バイトのハッシュによる一致の探索で、過去の位置と一致したバイトの割合
+ *
+ * 頻度の計数は 4 つの表に分けて行う。同じ表への連続した書き込みによる依存を避けるためで、
+ * コンパイラの自動ベクトル化が効きやすくなる。
+ */
+
+enum {
+    ESTIMATE_SAMPLE_DEFAULT = 64 * 1024,    // 64 KiB
+    ESTIMATE_SAMPLE_MIN = 1024,
+    ESTIMATE_PARTS = 16,
+    ESTIMATE_HASH_BITS = 12,
+    ESTIMATE_MATCH_MIN = 4,
+};
+
+// 一致したバイトを符号化するときの、元の大きさに対するおおよその比
+#define ESTIMATE_MATCH_COST 0.05
+
+static ID id_sample;
+
+static void
+estimate_histogram(const uint8_t *p, size_t size, uint32_t hist[256])
+{
+    uint32_t h[4][256] = { { 0 } };
+    size_t i = 0;
+
+    for (; i + 4 <= size; i += 4) {
+        h[0][p[i + 0]] ++;
+        h[1][p[i + 1]] ++;
+        h[2][p[i + 2]] ++;
+        h[3][p[i + 3]] ++;
+    }
+    for (; i < size; i ++) {
+        h[0][p[i]] ++;
+    }
+
+    for (int n = 0; n < 256; n ++) {
+        hist[n] += h[0][n] + h[1][n] + h[2][n] + h[3][n];
+    }
+}
+
+static inline uint32_t
+estimate_hash(const uint8_t *p)
+{
+    uint32_t v = (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+    return (v * 2654435761u) >> (32 - ESTIMATE_HASH_BITS);
+}
+
+/*
+ * 区間内で過去の位置と ESTIMATE_MATCH_MIN バイト以上一致したバイトの数を返す。
+ */
+static size_t
+estimate_matches(const uint8_t *p, size_t size)
+{
+    uint32_t table[1 << ESTIMATE_HASH_BITS];
+    size_t matched = 0;
+
+    if (size < ESTIMATE_MATCH_MIN * 2) { return 0; }
+
+    memset(table, 0xff, sizeof(table));
+
+    for (size_t i = 0; i + ESTIMATE_MATCH_MIN <= size; ) {
+        uint32_t h = estimate_hash(p + i);
+        uint32_t prev = table[h];
+        table[h] = (uint32_t)i;
+
+        if (prev != UINT32_MAX && memcmp(p + prev, p + i, ESTIMATE_MATCH_MIN) == 0) {
+            size_t len = ESTIMATE_MATCH_MIN;
+            while (i + len < size && p[prev + len] == p[i + len]) { len ++; }
+            matched += len;
+            i += len;
+        } else {
+            i ++;
+        }
+    }
+
+    return matched;
+}
+
+double
+extlzma_estimate_ratio(const uint8_t *ptr, size_t size, size_t sample)
+{
+    uint32_t hist[256] = { 0 };
+    size_t total = 0, matched = 0;
+
+    if (size == 0) { return 1.0; }
+    if (sample < ESTIMATE_SAMPLE_MIN) { sample = ESTIMATE_SAMPLE_MIN; }
+
+    if (size <= sample) {
+        estimate_histogram(ptr, size, hist);
+        matched = estimate_matches(ptr, size);
+        total = size;
+    } else {
+        size_t part = sample / ESTIMATE_PARTS;
+        size_t stride = (size - part) / (ESTIMATE_PARTS - 1);
+        for (int i = 0; i < ESTIMATE_PARTS; i ++) {
+            const uint8_t *p = ptr + stride * i;
+            estimate_histogram(p, part, hist);
+            matched += estimate_matches(p, part);
+            total += part;
+        }
+    }
+
+    double entropy = 0;
+    for (int n = 0; n < 256; n ++) {
+        if (hist[n] > 0) {
+            double q = (double)hist[n] / (double)total;
+            entropy -= q * log2(q);
+        }
+    }
+
+    double m = (double)matched / (double)total;
+    double ratio = (1.0 - m) * (entropy / 8.0) + m * ESTIMATE_MATCH_COST;
+
+    return (ratio > 1.0 ? 1.0 : ratio);
+}
+
+/*
+ * call-seq:
+ *  LZMA::Utils.estimate_ratio(string, sample: 65536) -> float
+ *
+ * string を圧縮した場合の、元の大きさに対する圧縮後の大きさの比を簡易に見積もります。
+ *
+ * 0.0 に近いほどよく圧縮でき、1.0 に近いほど圧縮できない (すでに圧縮されたデータや乱数など) と見込まれます。
+ *
+ * 実際に圧縮することはなく、処理時間は文字列の大きさによらずほぼ一定です。
+ *
+ * [sample]
+ *      見積もりに用いるバイト数です。string がこれより大きい場合は、いくつかの区間に分けて均等に取り出します。
+ */
+static VALUE
+utils_estimate_ratio(int argc, VALUE argv[], VALUE self)
+{
+    VALUE str, opts;
+    rb_scan_args(argc, argv, "1:", &str, &opts);
+    rb_check_type(str, RUBY_T_STRING);
+
+    size_t sample = ESTIMATE_SAMPLE_DEFAULT;
+    if (!NIL_P(opts)) {
+        VALUE v = rb_hash_lookup(opts, ID2SYM(id_sample));
+        if (!NIL_P(v)) { sample = NUM2SIZET(v); }
+    }
+
+    return DBL2NUM(extlzma_estimate_ratio((const uint8_t *)RSTRING_PTR(str), RSTRING_LEN(str), sample));
+}
+
+void
+extlzma_init_Estimate(void)
+{
+    id_sample = rb_intern("sample");
+
+    rb_define_method(extlzma_mUtils, "estimate_ratio", RUBY_METHOD_FUNC(utils_estimate_ratio), -1);
+}
@@ -11,6 +11,25 @@ unless needlist.empty?
   abort "#$0: dependency files are not found (#{needlist.join(" ")})."
 end
 
+have_header "pthread.h" and have_library "pthread"
+have_header "unistd.h"
+have_header "sys/resource.h"
+have_header "sys/syscall.h"
+have_header "sys/uio.h" and have_func "writev", "sys/uio.h"
+have_func "rb_io_descriptor", "ruby/io.h"
+have_func "lzma_cputhreads", "lzma.h"
+have_func "lzma_stream_encoder_mt", "lzma.h"
+have_func "lzma_stream_decoder_mt", "lzma.h"
+
+if enable_config("usdt", false)
+  # SystemTap/DTrace 互換の静的トレースポイントを埋め込む (ext/probes.md を参照)
+  if have_header "sys/sdt.h"
+    $defs << "-DEXTLZMA_USDT"
+  else
+    warn "#$0: sys/sdt.h is not found; USDT probes are disabled."
+  end
+end
+
 staticlink = arg_config("--liblzma-static-link", false)
 
 if staticlink
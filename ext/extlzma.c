@@ -23,6 +23,8 @@ ID extlzma_id_none;
 ID extlzma_id_crc32;
 ID extlzma_id_crc64;
 ID extlzma_id_sha256;
+ID extlzma_id_crc;
+ID extlzma_id_code;
 
 static VALUE
 libver_major(VALUE obj)
@@ -83,15 +85,23 @@ Init_extlzma(void)
     extlzma_id_crc32    = rb_intern("crc32");
     extlzma_id_crc64    = rb_intern("crc64");
     extlzma_id_sha256   = rb_intern("sha256");
+    extlzma_id_crc      = rb_intern("crc");
+    extlzma_id_code     = rb_intern("code");
 
     extlzma_mLZMA = rb_define_module("LZMA");
     rb_define_const(extlzma_mLZMA, "LZMA", extlzma_mLZMA);
 
+    extlzma_init_ThreadPool();
+    extlzma_init_GVL();
     extlzma_init_Utils();
+    extlzma_init_Check();
+    extlzma_init_Estimate();
+    extlzma_init_Rsyncable();
     extlzma_init_Constants();
     extlzma_init_Exceptions();
     extlzma_init_Filter();
     extlzma_init_Stream();
     extlzma_init_Index();
+    extlzma_init_Tuner();
     extlzma_init_LIBVER();
 }
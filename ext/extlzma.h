@@ -2,6 +2,7 @@
 #define EXTLZMA_H 1
 
 #include <stdarg.h>
+#include <time.h>
 #include <lzma.h>
 #include <ruby.h>
 #include <ruby/thread.h>
@@ -17,6 +18,29 @@
 
 #define ELEMENTOF(VECT) (sizeof(VECT) / sizeof((VECT)[0]))
 
+/*
+ * USDT (SystemTap/DTrace 互換の静的トレースポイント)。
+ *
+ * extconf.rb に --enable-usdt を与えると EXTLZMA_USDT が定義され、<sys/sdt.h> のプローブとなる。
+ * 定義されない場合は何もしない (引数も評価しない)。プローブの一覧は ext/probes.md にある。
+ */
+#ifdef EXTLZMA_USDT
+#   include <sys/sdt.h>
+#   define EXTLZMA_PROBE(NAME) DTRACE_PROBE(extlzma, NAME)
+#   define EXTLZMA_PROBE1(NAME, A1) DTRACE_PROBE1(extlzma, NAME, A1)
+#   define EXTLZMA_PROBE2(NAME, A1, A2) DTRACE_PROBE2(extlzma, NAME, A1, A2)
+#   define EXTLZMA_PROBE3(NAME, A1, A2, A3) DTRACE_PROBE3(extlzma, NAME, A1, A2, A3)
+#   define EXTLZMA_PROBE4(NAME, A1, A2, A3, A4) DTRACE_PROBE4(extlzma, NAME, A1, A2, A3, A4)
+#   define EXTLZMA_PROBE5(NAME, A1, A2, A3, A4, A5) DTRACE_PROBE5(extlzma, NAME, A1, A2, A3, A4, A5)
+#else
+#   define EXTLZMA_PROBE(NAME) ((void)0)
+#   define EXTLZMA_PROBE1(NAME, A1) ((void)0)
+#   define EXTLZMA_PROBE2(NAME, A1, A2) ((void)0)
+#   define EXTLZMA_PROBE3(NAME, A1, A2, A3) ((void)0)
+#   define EXTLZMA_PROBE4(NAME, A1, A2, A3, A4) ((void)0)
+#   define EXTLZMA_PROBE5(NAME, A1, A2, A3, A4, A5) ((void)0)
+#endif
+
 #define AUX_FUNCALL(RECV, METHOD, ...)                  \
     ({                                                  \
         VALUE args__aux_funcall__[] = { __VA_ARGS__ };  \
@@ -29,6 +53,7 @@ extern VALUE extlzma_mLZMA;
 extern VALUE extlzma_cFilter;
 extern VALUE extlzma_cStream;
 extern VALUE extlzma_mExceptions;
+extern VALUE extlzma_mUtils;
 
 extern VALUE extlzma_eBasicException;
 extern VALUE extlzma_eStreamEnd;
@@ -44,6 +69,7 @@ extern VALUE extlzma_eBufError;
 extern VALUE extlzma_eProgError;
 extern VALUE extlzma_eFilterTooLong;
 extern VALUE extlzma_eBadPreset;
+extern VALUE extlzma_eOutputLimitError;
 
 extern ID extlzma_id_dictsize;
 extern ID extlzma_id_predict;
@@ -59,14 +85,77 @@ extern ID extlzma_id_none;
 extern ID extlzma_id_crc32;
 extern ID extlzma_id_crc64;
 extern ID extlzma_id_sha256;
+extern ID extlzma_id_crc;
+extern ID extlzma_id_code;
 
 extern void extlzma_init_Stream(void);
 extern void extlzma_init_Utils(void);
+extern void extlzma_init_Check(void);
 extern void extlzma_init_Constants(void);
 extern void extlzma_init_Exceptions(void);
 extern void extlzma_init_Filter(void);
 extern void extlzma_init_Index(void);
+extern void extlzma_init_GVL(void);
+extern void extlzma_init_Estimate(void);
+extern void extlzma_init_Tuner(void);
+extern void extlzma_init_Rsyncable(void);
+extern void extlzma_init_ThreadPool(void);
 extern VALUE extlzma_lookup_error(lzma_ret status);
+extern void extlzma_filter_clamp_dictsize(lzma_filter filterpack[LZMA_FILTERS_MAX + 1], lzma_options_lzma optpack[LZMA_FILTERS_MAX], uint64_t size_hint);
+
+enum {
+    EXTLZMA_THREADS_MAX = 256,
+};
+
+typedef void extlzma_parallel_f(void *arg, size_t index);
+
+extern int extlzma_cpu_threads(void);
+extern int extlzma_parallel_run(size_t num, int threads, extlzma_parallel_f *func, void *arg);
+
+enum {
+    EXTLZMA_CHECK_SIZE_MAX = 32,
+};
+
+struct extlzma_sha256
+{
+    uint32_t h[8];
+    uint64_t size;
+    uint8_t buf[64];
+};
+
+struct extlzma_check
+{
+    lzma_check type;
+    union {
+        uint64_t crc;
+        struct extlzma_sha256 sha256;
+    } state;
+};
+
+extern int extlzma_check_init(struct extlzma_check *check, lzma_check type, uint64_t init);
+extern void extlzma_check_update(struct extlzma_check *check, const uint8_t *ptr, size_t size);
+extern size_t extlzma_check_finish(struct extlzma_check *check, uint8_t out[EXTLZMA_CHECK_SIZE_MAX]);
+
+extern uint64_t extlzma_crc32_combine(uint64_t crc1, uint64_t crc2, uint64_t len2);
+extern uint64_t extlzma_crc64_combine(uint64_t crc1, uint64_t crc2, uint64_t len2);
+
+extern double extlzma_estimate_ratio(const uint8_t *ptr, size_t size, size_t sample);
+
+/*
+ * rsyncable の区切りを決めるための状態。
+ */
+struct extlzma_rsync
+{
+    uint64_t hash;
+    uint64_t since;     // 直前の区切りからのバイト数
+    uint64_t min;
+    uint64_t max;
+    int shift;
+    lzma_action flush;  // 区切りで用いる action (LZMA_FULL_FLUSH または LZMA_FULL_BARRIER)
+};
+
+extern void extlzma_rsync_setup(struct extlzma_rsync *r, uint64_t average, lzma_action flush);
+extern size_t extlzma_rsync_scan(struct extlzma_rsync *r, const uint8_t *ptr, size_t size, int *cut);
 
 static inline int
 aux_lzma_isfailed(lzma_ret status)
@@ -173,4 +262,188 @@ aux_thread_call_without_gvl(aux_call_blocking_f *func, ...)
     return p;
 }
 
+/*
+ * GVL を解放するかどうかの方針。
+ *
+ * 処理量 (バイト数) の見積もりが閾値未満であれば GVL を保持したまま処理を行い、
+ * 閾値以上であれば GVL を解放する。
+ *
+ * adaptive が真の場合は、実際の処理時間から 1 バイトあたりの処理時間を学習し、
+ * target_ns 程度で終わる処理量を閾値 (learned) とする。
+ */
+
+enum extlzma_gvl_path
+{
+    EXTLZMA_GVL_CRC,
+    EXTLZMA_GVL_CODE,
+    EXTLZMA_GVL_PATH_MAX,
+};
+
+enum {
+    EXTLZMA_GVL_LEARNED_MIN = 256,
+    EXTLZMA_GVL_LEARNED_MAX = 16 << 20, // 16 MiB
+    EXTLZMA_GVL_SAMPLE_MIN = 4096, // これより小さい処理は呼び出しごとの固定費が支配的となるため学習しない
+};
+
+struct extlzma_gvl_policy
+{
+    size_t threshold;
+    size_t learned;
+    int adaptive;
+    uint64_t target_ns;
+    uint64_t ps_per_byte;   // 学習した 1 バイトあたりの処理時間 (ピコ秒)
+
+    uint64_t held_calls;
+    uint64_t held_bytes;
+    uint64_t released_calls;
+    uint64_t released_bytes;
+};
+
+extern struct extlzma_gvl_policy extlzma_gvl_policies[EXTLZMA_GVL_PATH_MAX];
+
+static inline uint64_t
+aux_clock_ns(void)
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#else
+    return 0;
+#endif
+}
+
+static inline int
+extlzma_gvl_release_p(enum extlzma_gvl_path path, size_t work)
+{
+    const struct extlzma_gvl_policy *p = &extlzma_gvl_policies[path];
+    return work >= (p->adaptive ? p->learned : p->threshold);
+}
+
+/*
+ * aux_thread_call_with_policy などが GVL を保持したまま func を呼び出すかどうかを返す。
+ *
+ * GVL を保持する場合は ubf が設定されず割り込めないため、呼び出し側は処理量を見積もりの範囲に収める必要がある。
+ */
+static inline int
+extlzma_gvl_hold_p(enum extlzma_gvl_path path, size_t work, int force_release)
+{
+    return !(force_release || extlzma_gvl_release_p(path, work));
+}
+
+static inline void
+extlzma_gvl_learn(enum extlzma_gvl_path path, size_t work, uint64_t ns)
+{
+    struct extlzma_gvl_policy *p = &extlzma_gvl_policies[path];
+
+    if (!p->adaptive || work < EXTLZMA_GVL_SAMPLE_MIN || ns == 0) { return; }
+
+    uint64_t sample = ns * 1000 / work;
+    if (p->ps_per_byte == 0) {
+        p->ps_per_byte = sample;
+    } else {
+        p->ps_per_byte = p->ps_per_byte - (p->ps_per_byte >> 3) + (sample >> 3);
+    }
+
+    uint64_t learned = p->target_ns * 1000 / (p->ps_per_byte ? p->ps_per_byte : 1);
+    if (learned < EXTLZMA_GVL_LEARNED_MIN) { learned = EXTLZMA_GVL_LEARNED_MIN; }
+    if (learned > EXTLZMA_GVL_LEARNED_MAX) { learned = EXTLZMA_GVL_LEARNED_MAX; }
+    p->learned = (size_t)learned;
+}
+
+struct aux_thread_call_timed
+{
+    aux_call_blocking_f *func;
+    va_list va;
+    uint64_t ns;
+};
+
+static inline void *
+aux_thread_call_timed_main(void *p)
+{
+    struct aux_thread_call_timed *ap = p;
+    uint64_t start = aux_clock_ns();
+    void *ret = ap->func(&ap->va);
+    ap->ns = aux_clock_ns() - start;
+    return ret;
+}
+
+static inline void *
+aux_thread_call_with_policy_va(enum extlzma_gvl_path path, size_t work, int force_release,
+                               rb_unblock_function_t *ubf, void *ubfarg,
+                               aux_call_blocking_f *func, va_list va)
+{
+    struct extlzma_gvl_policy *policy = &extlzma_gvl_policies[path];
+    struct aux_thread_call_timed arg = { func };
+    va_copy(arg.va, va);
+
+    void *p;
+    if (!extlzma_gvl_hold_p(path, work, force_release)) {
+#ifdef EXTLZMA_USDT
+        uint64_t released = aux_clock_ns();
+#endif
+        EXTLZMA_PROBE2(gvl__release, (int)path, work);
+        if (ubf == RUBY_UBF_PROCESS) {
+            p = rb_thread_call_without_gvl(aux_thread_call_timed_main,
+                                           (void *)&arg, ubf, ubfarg);
+        } else {
+            // 割り込みがあっても戻った直後に例外を発生させず、呼び出し側で後始末をできるようにする
+            p = rb_thread_call_without_gvl2(aux_thread_call_timed_main,
+                                            (void *)&arg, ubf, ubfarg);
+        }
+        // GVL の再取得を待った時間を含めた、解放していた時間と処理時間
+        EXTLZMA_PROBE4(gvl__reacquire, (int)path, work, aux_clock_ns() - released, arg.ns);
+        policy->released_calls ++;
+        policy->released_bytes += work;
+    } else {
+        p = aux_thread_call_timed_main(&arg);
+        policy->held_calls ++;
+        policy->held_bytes += work;
+    }
+    va_end(arg.va);
+
+    if (!force_release) { extlzma_gvl_learn(path, work, arg.ns); }
+
+    return p;
+}
+
+/*
+ * work に処理量の見積もりを与え、方針に従って GVL を解放するかどうかを決めてから func を呼び出す。
+ *
+ * force_release が真の場合は見積もりに関わらず GVL を解放する
+ * (初回の lzma_code のように、見積もりに現れない処理が行われる場合)。
+ */
+static inline void *
+aux_thread_call_with_policy(enum extlzma_gvl_path path, size_t work, int force_release,
+                            aux_call_blocking_f *func, ...)
+{
+    va_list va;
+    va_start(va, func);
+    void *p = aux_thread_call_with_policy_va(path, work, force_release,
+                                             RUBY_UBF_PROCESS, NULL, func, va);
+    va_end(va);
+
+    return p;
+}
+
+/*
+ * aux_thread_call_with_policy と同じだが、GVL を解放した場合の割り込み関数 (ubf) を指定できる。
+ *
+ * 割り込みは呼び出し側で rb_thread_check_ints() などによって処理する必要がある。
+ * また割り込みが先に発生した場合は func が呼ばれずに戻る。
+ */
+static inline void *
+aux_thread_call_with_policy_ubf(enum extlzma_gvl_path path, size_t work, int force_release,
+                                rb_unblock_function_t *ubf, void *ubfarg,
+                                aux_call_blocking_f *func, ...)
+{
+    va_list va;
+    va_start(va, func);
+    void *p = aux_thread_call_with_policy_va(path, work, force_release,
+                                             ubf, ubfarg, func, va);
+    va_end(va);
+
+    return p;
+}
+
 #endif /* EXTLZMA_H */
@@ -5,6 +5,7 @@ static VALUE cBasicLZMA;
 static VALUE cLZMA1;
 static VALUE cLZMA2;
 static VALUE cDelta;
+static VALUE cBCJ;
 
 static void *
 setup_lzma_preset(size_t preset)
@@ -361,6 +362,25 @@ delta_alloc(VALUE klass)
     return filter_alloc(cDelta, LZMA_FILTER_DELTA);
 }
 
+#define BCJ_ALLOC(NAME, ID)                  \
+    static VALUE                             \
+    bcj_ ## NAME ## _alloc(VALUE klass)      \
+    {                                        \
+        return filter_alloc(klass, ID);      \
+    }                                        \
+
+BCJ_ALLOC(x86, LZMA_FILTER_X86)
+BCJ_ALLOC(powerpc, LZMA_FILTER_POWERPC)
+BCJ_ALLOC(ia64, LZMA_FILTER_IA64)
+BCJ_ALLOC(arm, LZMA_FILTER_ARM)
+BCJ_ALLOC(armthumb, LZMA_FILTER_ARMTHUMB)
+BCJ_ALLOC(sparc, LZMA_FILTER_SPARC)
+#ifdef LZMA_FILTER_ARM64
+BCJ_ALLOC(arm64, LZMA_FILTER_ARM64)
+#endif
+
+#undef BCJ_ALLOC
+
 /*
  * call-seq:
  *  initialize(dist = LZMA::DELTA_DIST_MIN)
@@ -495,6 +515,26 @@ extlzma_init_Filter(void)
     rb_define_alloc_func(cDelta, delta_alloc);
     rb_define_method(cDelta, "initialize", delta_init, -1);
 
+    /*
+     * Document-class: LZMA::Filter::BCJ
+     *
+     * 実行可能ファイルの分岐命令の相対アドレスを絶対アドレスに変換し、圧縮効率を高めるフィルタです。
+     *
+     * 対象とする命令セットごとに X86 / PowerPC / IA64 / ARM / ARMThumb / SPARC (liblzma が対応していれば ARM64)
+     * の派生クラスを用います。LZMA::Filter::LZMA2 などと組み合わせ、その前に置く必要があります。
+     */
+    cBCJ = rb_define_class_under(extlzma_cFilter, "BCJ", extlzma_cFilter);
+    rb_undef_alloc_func(cBCJ);
+    rb_define_alloc_func(rb_define_class_under(cBCJ, "X86", cBCJ), bcj_x86_alloc);
+    rb_define_alloc_func(rb_define_class_under(cBCJ, "PowerPC", cBCJ), bcj_powerpc_alloc);
+    rb_define_alloc_func(rb_define_class_under(cBCJ, "IA64", cBCJ), bcj_ia64_alloc);
+    rb_define_alloc_func(rb_define_class_under(cBCJ, "ARM", cBCJ), bcj_arm_alloc);
+    rb_define_alloc_func(rb_define_class_under(cBCJ, "ARMThumb", cBCJ), bcj_armthumb_alloc);
+    rb_define_alloc_func(rb_define_class_under(cBCJ, "SPARC", cBCJ), bcj_sparc_alloc);
+#ifdef LZMA_FILTER_ARM64
+    rb_define_alloc_func(rb_define_class_under(cBCJ, "ARM64", cBCJ), bcj_arm64_alloc);
+#endif
+
     rb_define_method(cBasicLZMA, "dictsize",    ext_get_dictsize, 0);
     rb_define_method(cBasicLZMA, "dictsize=",   ext_set_dictsize, 1);
     rb_define_method(cBasicLZMA, "predict",     ext_get_predict, 0);
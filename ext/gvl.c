@@ -0,0 +1,172 @@
+#include "extlzma.h"
+
+// SECTION: LZMA::GVL
+
+struct extlzma_gvl_policy extlzma_gvl_policies[EXTLZMA_GVL_PATH_MAX] = {
+    [EXTLZMA_GVL_CRC] = {
+        .threshold = 32 * 1024,
+        .learned = 32 * 1024,
+        .adaptive = 1,
+        .target_ns = 20 * 1000,
+    },
+    [EXTLZMA_GVL_CODE] = {
+        .threshold = 4 * 1024,
+        .learned = 4 * 1024,
+        .adaptive = 1,
+        .target_ns = 50 * 1000,
+    },
+};
+
+static VALUE mGVL;
+static ID id_threshold;
+static ID id_adaptive;
+static ID id_target_ns;
+
+static struct extlzma_gvl_policy *
+getpolicy(VALUE path)
+{
+    if (path == ID2SYM(extlzma_id_crc)) {
+        return &extlzma_gvl_policies[EXTLZMA_GVL_CRC];
+    } else if (path == ID2SYM(extlzma_id_code)) {
+        return &extlzma_gvl_policies[EXTLZMA_GVL_CODE];
+    } else {
+        rb_raise(rb_eArgError,
+                 "wrong path - %+" PRIsVALUE " (expect :crc or :code)", path);
+    }
+}
+
+static VALUE
+policy_to_hash(const struct extlzma_gvl_policy *p)
+{
+    VALUE hash = rb_hash_new();
+    rb_hash_aset(hash, ID2SYM(id_threshold), SIZET2NUM(p->threshold));
+    rb_hash_aset(hash, ID2SYM(rb_intern("learned_threshold")), SIZET2NUM(p->learned));
+    rb_hash_aset(hash, ID2SYM(id_adaptive), p->adaptive ? Qtrue : Qfalse);
+    rb_hash_aset(hash, ID2SYM(id_target_ns), ULL2NUM(p->target_ns));
+    rb_hash_aset(hash, ID2SYM(rb_intern("held_calls")), ULL2NUM(p->held_calls));
+    rb_hash_aset(hash, ID2SYM(rb_intern("held_bytes")), ULL2NUM(p->held_bytes));
+    rb_hash_aset(hash, ID2SYM(rb_intern("released_calls")), ULL2NUM(p->released_calls));
+    rb_hash_aset(hash, ID2SYM(rb_intern("released_bytes")), ULL2NUM(p->released_bytes));
+    return hash;
+}
+
+/*
+ * call-seq:
+ *  LZMA::GVL.threshold(path) -> integer
+ *
+ * 現在有効な閾値をバイト数で返します。この値以上の処理量が見込まれる場合に GVL が解放されます。
+ *
+ * [path]   +:crc+ (CRC の計算) または +:code+ (LZMA::Stream#code) を与えます。
+ */
+static VALUE
+gvl_s_threshold(VALUE mod, VALUE path)
+{
+    const struct extlzma_gvl_policy *p = getpolicy(path);
+    return SIZET2NUM(p->adaptive ? p->learned : p->threshold);
+}
+
+/*
+ * call-seq:
+ *  LZMA::GVL.configure(path, threshold: nil, adaptive: nil, target_ns: nil) -> nil
+ *
+ * GVL を解放する方針を変更します。+nil+ を与えた項目は変更されません。
+ *
+ * [threshold]
+ *      固定の閾値をバイト数で与えます。0 を与えると常に GVL を解放します。
+ *
+ *      adaptive が有効な場合は学習の初期値となります。
+ * [adaptive]
+ *      真を与えると、実際の処理時間から閾値を学習するようになります。
+ * [target_ns]
+ *      adaptive が有効な場合、GVL を保持したまま処理してもよい時間をナノ秒で与えます。
+ */
+static VALUE
+gvl_s_configure(int argc, VALUE argv[], VALUE mod)
+{
+    VALUE path, opts;
+    rb_scan_args(argc, argv, "1:", &path, &opts);
+    struct extlzma_gvl_policy *p = getpolicy(path);
+
+    if (NIL_P(opts)) { return Qnil; }
+
+    VALUE threshold = rb_hash_lookup(opts, ID2SYM(id_threshold));
+    VALUE adaptive = rb_hash_lookup2(opts, ID2SYM(id_adaptive), Qundef);
+    VALUE target_ns = rb_hash_lookup(opts, ID2SYM(id_target_ns));
+
+    if (!NIL_P(threshold)) {
+        p->threshold = p->learned = NUM2SIZET(threshold);
+        p->ps_per_byte = 0;
+    }
+    if (adaptive != Qundef && !NIL_P(adaptive)) {
+        p->adaptive = RTEST(adaptive);
+        p->learned = p->threshold;
+        p->ps_per_byte = 0;
+    }
+    if (!NIL_P(target_ns)) {
+        p->target_ns = NUM2ULL(target_ns);
+    }
+
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *  LZMA::GVL.stats -> { crc: { ... }, code: { ... } }
+ *  LZMA::GVL.stats(path) -> { ... }
+ *
+ * 方針と、GVL を保持したまま/解放して処理した回数およびバイト数を返します。
+ */
+static VALUE
+gvl_s_stats(int argc, VALUE argv[], VALUE mod)
+{
+    rb_check_arity(argc, 0, 1);
+
+    if (argc > 0) {
+        return policy_to_hash(getpolicy(argv[0]));
+    }
+
+    VALUE hash = rb_hash_new();
+    rb_hash_aset(hash, ID2SYM(extlzma_id_crc), policy_to_hash(&extlzma_gvl_policies[EXTLZMA_GVL_CRC]));
+    rb_hash_aset(hash, ID2SYM(extlzma_id_code), policy_to_hash(&extlzma_gvl_policies[EXTLZMA_GVL_CODE]));
+    return hash;
+}
+
+/*
+ * call-seq:
+ *  LZMA::GVL.reset_stats -> nil
+ *
+ * 計数を 0 に戻します。
+ */
+static VALUE
+gvl_s_reset_stats(VALUE mod)
+{
+    for (int i = 0; i < EXTLZMA_GVL_PATH_MAX; i ++) {
+        struct extlzma_gvl_policy *p = &extlzma_gvl_policies[i];
+        p->held_calls = p->held_bytes = 0;
+        p->released_calls = p->released_bytes = 0;
+    }
+
+    return Qnil;
+}
+
+void
+extlzma_init_GVL(void)
+{
+    id_threshold = rb_intern("threshold");
+    id_adaptive = rb_intern("adaptive");
+    id_target_ns = rb_intern("target_ns");
+
+    /*
+     * Document-module: LZMA::GVL
+     *
+     * CRC の計算や LZMA::Stream#code の際に GVL を解放するかどうかの方針を扱います。
+     *
+     * 小さな処理で GVL を解放すると、解放と再取得にかかる時間の方が長くなるため、
+     * 処理量が閾値未満の場合は GVL を保持したまま処理を行います。
+     */
+    mGVL = rb_define_module_under(extlzma_mLZMA, "GVL");
+    rb_define_singleton_method(mGVL, "threshold", RUBY_METHOD_FUNC(gvl_s_threshold), 1);
+    rb_define_singleton_method(mGVL, "configure", RUBY_METHOD_FUNC(gvl_s_configure), -1);
+    rb_define_singleton_method(mGVL, "stats", RUBY_METHOD_FUNC(gvl_s_stats), -1);
+    rb_define_singleton_method(mGVL, "reset_stats", RUBY_METHOD_FUNC(gvl_s_reset_stats), 0);
+}
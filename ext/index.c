@@ -57,6 +57,235 @@ ext_index_memused(VALUE index)
     return ULL2NUM(lzma_index_memused(ext_index_ref(index)));
 }
 
+static VALUE
+ext_index_wrap(lzma_index *index)
+{
+    return Data_Wrap_Struct(cIndex, NULL, ext_index_free, index);
+}
+
+static const uint8_t *
+ext_index_flags_str(VALUE str)
+{
+    rb_check_type(str, RUBY_T_STRING);
+    if (RSTRING_LEN(str) != LZMA_STREAM_HEADER_SIZE) {
+        rb_raise(rb_eArgError,
+                 "wrong stream header/footer size (%ld for %d)",
+                 (long)RSTRING_LEN(str), LZMA_STREAM_HEADER_SIZE);
+    }
+    return (const uint8_t *)RSTRING_PTR(str);
+}
+
+/*
+ * call-seq:
+ *  LZMA::Index.decode_header(string) -> check
+ *
+ * xz ストリームのヘッダ (12 バイト) を解析し、整合値の種類を返します。
+ *
+ * ヘッダが壊れている場合は例外が発生します。
+ */
+static VALUE
+ext_index_s_decode_header(VALUE mod, VALUE header)
+{
+    lzma_stream_flags flags;
+    AUX_LZMA_TEST(lzma_stream_header_decode(&flags, ext_index_flags_str(header)));
+    return UINT2NUM(flags.check);
+}
+
+/*
+ * call-seq:
+ *  LZMA::Index.decode_footer(string) -> [backward_size, check]
+ *
+ * xz ストリームのフッタ (12 バイト) を解析し、インデックスの大きさと整合値の種類を返します。
+ *
+ * フッタが壊れている場合は例外が発生します。
+ */
+static VALUE
+ext_index_s_decode_footer(VALUE mod, VALUE footer)
+{
+    lzma_stream_flags flags;
+    AUX_LZMA_TEST(lzma_stream_footer_decode(&flags, ext_index_flags_str(footer)));
+    return rb_assoc_new(ULL2NUM(flags.backward_size), UINT2NUM(flags.check));
+}
+
+/*
+ * call-seq:
+ *  LZMA::Index.decode(string, footer = nil, padding = 0, memlimit = nil) -> index
+ *
+ * xz ストリームのインデックスを解析して LZMA::Index を返します。
+ *
+ * [string]
+ *      インデックスのバイト列です (フッタの直前にあり、大きさはフッタの backward_size です)。
+ * [footer]
+ *      同じストリームのフッタを与えると、整合値の種類を記録し、インデックスの大きさが一致するかを確認します。
+ * [padding]
+ *      ストリームの後ろにある、ストリームパディングのバイト数です。
+ * [memlimit]
+ *      解析に用いる作業メモリ量の最大値です。
+ */
+static VALUE
+ext_index_s_decode(int argc, VALUE argv[], VALUE mod)
+{
+    VALUE str, footer, padding, vmemlimit;
+    rb_scan_args(argc, argv, "13", &str, &footer, &padding, &vmemlimit);
+    rb_check_type(str, RUBY_T_STRING);
+
+    lzma_stream_flags flags;
+    if (!NIL_P(footer)) {
+        AUX_LZMA_TEST(lzma_stream_footer_decode(&flags, ext_index_flags_str(footer)));
+        if (flags.backward_size != (lzma_vli)RSTRING_LEN(str)) {
+            rb_raise(rb_eArgError,
+                     "index size mismatch (footer says %" PRIu64 ", but given %ld)",
+                     (uint64_t)flags.backward_size, (long)RSTRING_LEN(str));
+        }
+    }
+
+    uint64_t memlimit = NIL_P(vmemlimit) ? UINT64_MAX : NUM2ULL(vmemlimit);
+    lzma_index *index = NULL;
+    size_t pos = 0;
+    AUX_LZMA_TEST(lzma_index_buffer_decode(&index, &memlimit, NULL,
+                (const uint8_t *)RSTRING_PTR(str), &pos, RSTRING_LEN(str)));
+    VALUE obj = ext_index_wrap(index);
+
+    if (pos != (size_t)RSTRING_LEN(str)) {
+        rb_raise(extlzma_eDataError, "garbage after index");
+    }
+
+    if (!NIL_P(footer)) {
+        AUX_LZMA_TEST(lzma_index_stream_flags(index, &flags));
+    }
+
+    if (!NIL_P(padding)) {
+        AUX_LZMA_TEST(lzma_index_stream_padding(index, NUM2ULL(padding)));
+    }
+
+    return obj;
+}
+
+/*
+ * call-seq:
+ *  stream_padding = size
+ *
+ * 最後のストリームの後ろにある、ストリームパディングのバイト数を設定します。4 の倍数である必要があります。
+ */
+static VALUE
+ext_index_set_stream_padding(VALUE index, VALUE padding)
+{
+    AUX_LZMA_TEST(lzma_index_stream_padding(ext_index_ref(index), NUM2ULL(padding)));
+    return padding;
+}
+
+/*
+ * call-seq:
+ *  cat(other) -> self
+ *
+ * other のストリームを self の後ろに連結します。
+ *
+ * other の内容は self に移されるため、other はそれ以降利用できなくなります。
+ */
+static VALUE
+ext_index_cat(VALUE index, VALUE other)
+{
+    lzma_index *dest = ext_index_ref(index);
+    if (!rb_obj_is_kind_of(other, cIndex)) {
+        rb_raise(rb_eTypeError, "not a LZMA::Index - #<%s>", rb_obj_classname(other));
+    }
+    lzma_index *src = ext_index_ref(other);
+    if (src == dest) {
+        rb_raise(rb_eArgError, "can not concatenate to itself");
+    }
+
+    AUX_LZMA_TEST(lzma_index_cat(dest, src, NULL));
+    DATA_PTR(other) = NULL;
+
+    return index;
+}
+
+#define INDEX_GETTER(NAME, EXPR)                \
+    static VALUE                                \
+    ext_index_ ## NAME(VALUE index)             \
+    {                                           \
+        const lzma_index *i = ext_index_ref(index); \
+        return ULL2NUM(EXPR);                   \
+    }                                           \
+
+INDEX_GETTER(stream_count, lzma_index_stream_count(i))
+INDEX_GETTER(block_count, lzma_index_block_count(i))
+INDEX_GETTER(size, lzma_index_size(i))
+INDEX_GETTER(stream_size, lzma_index_stream_size(i))
+INDEX_GETTER(total_size, lzma_index_total_size(i))
+INDEX_GETTER(file_size, lzma_index_file_size(i))
+INDEX_GETTER(uncompressed_size, lzma_index_uncompressed_size(i))
+INDEX_GETTER(checks, lzma_index_checks(i))
+
+#undef INDEX_GETTER
+
+static VALUE
+ext_index_iter_to_hash(const lzma_index_iter *iter)
+{
+    VALUE h = rb_hash_new();
+#define SET(NAME, VALUE) rb_hash_aset(h, ID2SYM(rb_intern(NAME)), ULL2NUM(VALUE))
+    SET("stream_number", iter->stream.number);
+    SET("stream_compressed_offset", iter->stream.compressed_offset);
+    SET("stream_uncompressed_offset", iter->stream.uncompressed_offset);
+    SET("stream_padding", iter->stream.padding);
+    SET("number", iter->block.number_in_file);
+    SET("number_in_stream", iter->block.number_in_stream);
+    SET("compressed_file_offset", iter->block.compressed_file_offset);
+    SET("uncompressed_file_offset", iter->block.uncompressed_file_offset);
+    SET("compressed_stream_offset", iter->block.compressed_stream_offset);
+    SET("uncompressed_stream_offset", iter->block.uncompressed_stream_offset);
+    SET("unpadded_size", iter->block.unpadded_size);
+    SET("total_size", iter->block.total_size);
+    SET("uncompressed_size", iter->block.uncompressed_size);
+    SET("check", iter->stream.flags ? iter->stream.flags->check : LZMA_CHECK_NONE);
+#undef SET
+    return h;
+}
+
+/*
+ * call-seq:
+ *  each_block { |block| ... } -> self
+ *  each_block -> enumerator
+ *
+ * すべてのストリームのブロックについて、位置や大きさを Hash で渡します。
+ *
+ * Hash のキーは +:stream_number+, +:number+ (ファイル全体での通し番号), +:compressed_file_offset+
+ * (ファイルの先頭からのブロックの位置), +:uncompressed_file_offset+, +:total_size+, +:uncompressed_size+,
+ * +:check+ などです。
+ */
+static VALUE
+ext_index_each_block(VALUE index)
+{
+    RETURN_ENUMERATOR(index, 0, 0);
+
+    lzma_index_iter iter;
+    lzma_index_iter_init(&iter, ext_index_ref(index));
+    while (!lzma_index_iter_next(&iter, LZMA_INDEX_ITER_BLOCK)) {
+        rb_yield(ext_index_iter_to_hash(&iter));
+    }
+
+    return index;
+}
+
+/*
+ * call-seq:
+ *  locate(offset) -> block or nil
+ *
+ * 伸張後のデータで offset の位置を含むブロックを LZMA::Index#each_block と同じ形式の Hash で返します。
+ *
+ * offset がデータの大きさ以上であれば +nil+ を返します。
+ */
+static VALUE
+ext_index_locate(VALUE index, VALUE offset)
+{
+    lzma_index_iter iter;
+    lzma_index_iter_init(&iter, ext_index_ref(index));
+    if (lzma_index_iter_locate(&iter, NUM2ULL(offset))) {
+        return Qnil;
+    }
+    return ext_index_iter_to_hash(&iter);
+}
+
 static VALUE
 ext_index_s_memusage(VALUE index, VALUE streams, VALUE blocks)
 {
@@ -70,6 +299,21 @@ extlzma_init_Index(void)
     rb_undef_alloc_func(cIndex);
     rb_define_singleton_method(cIndex, "memusage", RUBY_METHOD_FUNC(ext_index_s_memusage), 2);
     rb_define_method(cIndex, "memused", RUBY_METHOD_FUNC(ext_index_memused), 0);
+    rb_define_singleton_method(cIndex, "decode_header", RUBY_METHOD_FUNC(ext_index_s_decode_header), 1);
+    rb_define_singleton_method(cIndex, "decode_footer", RUBY_METHOD_FUNC(ext_index_s_decode_footer), 1);
+    rb_define_singleton_method(cIndex, "decode", RUBY_METHOD_FUNC(ext_index_s_decode), -1);
+    rb_define_method(cIndex, "stream_padding=", RUBY_METHOD_FUNC(ext_index_set_stream_padding), 1);
+    rb_define_method(cIndex, "cat", RUBY_METHOD_FUNC(ext_index_cat), 1);
+    rb_define_method(cIndex, "stream_count", RUBY_METHOD_FUNC(ext_index_stream_count), 0);
+    rb_define_method(cIndex, "block_count", RUBY_METHOD_FUNC(ext_index_block_count), 0);
+    rb_define_method(cIndex, "size", RUBY_METHOD_FUNC(ext_index_size), 0);
+    rb_define_method(cIndex, "stream_size", RUBY_METHOD_FUNC(ext_index_stream_size), 0);
+    rb_define_method(cIndex, "total_size", RUBY_METHOD_FUNC(ext_index_total_size), 0);
+    rb_define_method(cIndex, "file_size", RUBY_METHOD_FUNC(ext_index_file_size), 0);
+    rb_define_method(cIndex, "uncompressed_size", RUBY_METHOD_FUNC(ext_index_uncompressed_size), 0);
+    rb_define_method(cIndex, "checks", RUBY_METHOD_FUNC(ext_index_checks), 0);
+    rb_define_method(cIndex, "each_block", RUBY_METHOD_FUNC(ext_index_each_block), 0);
+    rb_define_method(cIndex, "locate", RUBY_METHOD_FUNC(ext_index_locate), 1);
 
     cIEncoder = rb_define_class_under(cIndex, "Encoder", cIndex);
     rb_define_alloc_func(cIEncoder, ext_index_alloc);
@@ -0,0 +1,469 @@
+#include "extlzma.h"
+
+#ifdef HAVE_PTHREAD_H
+#   include <pthread.h>
+#   include <signal.h>
+#endif
+
+#ifdef HAVE_UNISTD_H
+#   include <unistd.h>
+#endif
+
+/*
+ * GVL を解放した状態で呼ばれることを前提とした、プロセス全体で共有するスレッドプール。
+ *
+ * extlzma_parallel_run に与えられた処理 (job) は待ち行列に繋がれ、呼び出し元のスレッドと
+ * 待機している作業スレッドが次の index を原子的に取り出して func を呼び出す。
+ * 手の空いた作業スレッドは、参加しているスレッドが最も少ない job に加わる
+ * (index の取り出しが原子的であるため、他のスレッドが進めている job の残りをそのまま横取りできる)。
+ *
+ * 作業スレッドは必要になったときに生成され、終了せずに次の job を待つ。
+ * 呼び出し元を含めて同時に処理を行うスレッドの数は pool.cap に制限される。
+ * 作業スレッドの生成に失敗した場合や上限に達している場合でも、
+ * 呼び出し元のスレッドがすべての index を処理するため結果は変わらない。
+ *
+ * fork した子プロセスには作業スレッドが存在しないため、pthread_atfork によって状態を初期化する。
+ */
+
+struct parallel_job
+{
+    extlzma_parallel_f *func;
+    void *arg;
+    size_t num;
+    size_t next;
+    int limit;          // 参加できるスレッドの最大数 (呼び出し元を含む)
+    int joined;         // 参加しているスレッドの数 (pool.lock で保護する)
+    int peak;           // joined の最大値
+    struct parallel_job *link;
+};
+
+static struct
+{
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;      // 作業スレッドが job を待つ
+    pthread_cond_t leave;       // 呼び出し元が作業スレッドの離脱を待つ
+#endif
+    struct parallel_job *queue;
+    int cap;            // 同時に処理を行うスレッドの最大数
+    int auto_cap;       // CPU の数と cgroup の CPU 割り当てから求めた cap の既定値
+    int quota;          // cgroup の CPU 割り当て。0 であれば制限なし
+    int workers;
+    int idle;
+    int busy;
+    uint64_t jobs;
+    uint64_t tasks;
+    uint64_t stolen;    // 作業スレッドが処理した index の数
+    uint64_t busy_ns;
+    uint64_t forks;
+} pool = {
+#ifdef HAVE_PTHREAD_H
+    PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+#endif
+};
+
+static VALUE mThreadPool;
+
+static int
+cpu_count(void)
+{
+    long n = 0;
+
+#ifdef HAVE_LZMA_CPUTHREADS
+    n = lzma_cputhreads();
+#endif
+
+#if defined(HAVE_UNISTD_H) && defined(_SC_NPROCESSORS_ONLN)
+    if (n < 1) { n = sysconf(_SC_NPROCESSORS_ONLN); }
+#endif
+
+    return (n < 1 ? 1 : (n > EXTLZMA_THREADS_MAX ? EXTLZMA_THREADS_MAX : (int)n));
+}
+
+/*
+ * cgroup の CPU 割り当て (quota / period を切り上げた値) を返す。制限がなければ 0 を返す。
+ *
+ * cgroup v2 の cpu.max と、cgroup v1 の cpu.cfs_quota_us / cpu.cfs_period_us を読む。
+ */
+static int
+cgroup_cpu_quota(void)
+{
+    long long quota = -1, period = 0;
+    FILE *fp;
+
+    if ((fp = fopen("/sys/fs/cgroup/cpu.max", "r")) != NULL) {
+        char buf[32];
+        if (fscanf(fp, "%31s %lld", buf, &period) == 2 && strcmp(buf, "max") != 0) {
+            quota = strtoll(buf, NULL, 10);
+        }
+        fclose(fp);
+    } else if ((fp = fopen("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r")) != NULL) {
+        if (fscanf(fp, "%lld", &quota) != 1) { quota = -1; }
+        fclose(fp);
+        if ((fp = fopen("/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r")) != NULL) {
+            if (fscanf(fp, "%lld", &period) != 1) { period = 0; }
+            fclose(fp);
+        }
+    }
+
+    if (quota <= 0 || period <= 0) { return 0; }
+
+    long long n = (quota + period - 1) / period;
+    return (n > EXTLZMA_THREADS_MAX ? EXTLZMA_THREADS_MAX : (int)n);
+}
+
+int
+extlzma_cpu_threads(void)
+{
+    return __atomic_load_n(&pool.cap, __ATOMIC_RELAXED);
+}
+
+static void
+parallel_consume(struct parallel_job *job, int worker)
+{
+    uint64_t start = aux_clock_ns();
+    uint64_t count = 0;
+
+    for (;;) {
+        size_t i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if (i >= job->num) { break; }
+        job->func(job->arg, i);
+        count ++;
+    }
+
+    __atomic_fetch_add(&pool.tasks, count, __ATOMIC_RELAXED);
+    if (worker) { __atomic_fetch_add(&pool.stolen, count, __ATOMIC_RELAXED); }
+    __atomic_fetch_add(&pool.busy_ns, aux_clock_ns() - start, __ATOMIC_RELAXED);
+}
+
+static inline int
+job_pending_p(const struct parallel_job *job)
+{
+    return __atomic_load_n(&job->next, __ATOMIC_RELAXED) < job->num;
+}
+
+#ifdef HAVE_PTHREAD_H
+/*
+ * 作業スレッドが加わる job を選ぶ。pool.lock を保持した状態で呼ぶ。
+ */
+static struct parallel_job *
+pool_pick(void)
+{
+    struct parallel_job *pick = NULL;
+
+    if (pool.busy >= pool.cap) { return NULL; }
+
+    for (struct parallel_job *job = pool.queue; job; job = job->link) {
+        if (job->joined < job->limit && job_pending_p(job) &&
+                (!pick || job->joined < pick->joined)) {
+            pick = job;
+        }
+    }
+
+    return pick;
+}
+
+static void *
+pool_worker(void *unused)
+{
+    pthread_mutex_lock(&pool.lock);
+
+    for (;;) {
+        if (pool.workers > pool.cap - 1) { break; }
+
+        struct parallel_job *job = pool_pick();
+        if (!job) {
+            pool.idle ++;
+            pthread_cond_wait(&pool.wakeup, &pool.lock);
+            pool.idle --;
+            continue;
+        }
+
+        job->joined ++;
+        if (job->joined > job->peak) { job->peak = job->joined; }
+        pool.busy ++;
+        pthread_mutex_unlock(&pool.lock);
+
+        parallel_consume(job, 1);
+
+        pthread_mutex_lock(&pool.lock);
+        pool.busy --;
+        if (-- job->joined == 0) { pthread_cond_broadcast(&pool.leave); }
+    }
+
+    pool.workers --;
+    pthread_mutex_unlock(&pool.lock);
+
+    return NULL;
+}
+
+/*
+ * 作業スレッドを生成する。pool.lock を保持した状態で呼ぶ。
+ *
+ * シグナルは Ruby のスレッドが受け取る必要があるため、作業スレッドではすべて遮断する。
+ */
+static void
+pool_spawn(int n)
+{
+    sigset_t all, saved;
+    pthread_attr_t attr;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &saved);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    for (; n > 0 && pool.workers < pool.cap - 1; n --) {
+        pthread_t th;
+        if (pthread_create(&th, &attr, pool_worker, NULL) != 0) { break; }
+        pool.workers ++;
+    }
+
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+}
+
+static void
+pool_atfork_prepare(void)
+{
+    pthread_mutex_lock(&pool.lock);
+}
+
+static void
+pool_atfork_parent(void)
+{
+    pthread_mutex_unlock(&pool.lock);
+}
+
+/*
+ * fork した子プロセスでは親の作業スレッドも、親で処理中の job も存在しない。
+ */
+static void
+pool_atfork_child(void)
+{
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.wakeup, NULL);
+    pthread_cond_init(&pool.leave, NULL);
+    pool.queue = NULL;
+    pool.workers = 0;
+    pool.idle = 0;
+    pool.busy = 0;
+    pool.forks ++;
+}
+#endif
+
+/*
+ * func(arg, 0) ... func(arg, num - 1) を最大 threads 個のスレッドで並列に呼び出し、すべての終了を待つ。
+ *
+ * threads が 1 未満の場合は pool.cap とする。処理に参加したスレッドの数を返す。
+ */
+int
+extlzma_parallel_run(size_t num, int threads, extlzma_parallel_f *func, void *arg)
+{
+    struct parallel_job job = { func, arg, num, 0, threads, 1, 1, NULL };
+
+    if (job.limit < 1) { job.limit = extlzma_cpu_threads(); }
+    if ((size_t)job.limit > num) { job.limit = (int)num; }
+
+    __atomic_fetch_add(&pool.jobs, 1, __ATOMIC_RELAXED);
+
+#ifdef HAVE_PTHREAD_H
+    if (job.limit > 1) {
+        pthread_mutex_lock(&pool.lock);
+        job.link = pool.queue;
+        pool.queue = &job;
+        pool.busy ++;
+        int want = job.limit - 1 - pool.idle;
+        if (want > 0) { pool_spawn(want); }
+        pthread_cond_broadcast(&pool.wakeup);
+        pthread_mutex_unlock(&pool.lock);
+
+        parallel_consume(&job, 0);
+
+        pthread_mutex_lock(&pool.lock);
+        for (struct parallel_job **pp = &pool.queue; *pp; pp = &(*pp)->link) {
+            if (*pp == &job) {
+                *pp = job.link;
+                break;
+            }
+        }
+        pool.busy --;
+        job.joined --;
+        while (job.joined > 0) {
+            pthread_cond_wait(&pool.leave, &pool.lock);
+        }
+        // 呼び出し元が抜けて空いた分で、他の job を待っている作業スレッドを起こす
+        if (pool.idle > 0 && pool.queue) { pthread_cond_signal(&pool.wakeup); }
+        pthread_mutex_unlock(&pool.lock);
+
+        return job.peak;
+    }
+#endif
+
+    parallel_consume(&job, 0);
+    return 1;
+}
+
+/*
+ * call-seq:
+ *  LZMA::ThreadPool.max_threads -> integer
+ *
+ * 呼び出し元のスレッドを含めて、同時に処理を行うスレッドの最大数を返します。
+ *
+ * +threads: 0+ を与えた場合のスレッドの数も、この値となります。
+ */
+static VALUE
+pool_s_max_threads(VALUE mod)
+{
+    return INT2NUM(extlzma_cpu_threads());
+}
+
+/*
+ * call-seq:
+ *  LZMA::ThreadPool.max_threads = n
+ *
+ * 同時に処理を行うスレッドの最大数を変更します。
+ *
+ * 0 または +nil+ を与えると、CPU の数と cgroup の CPU 割り当てから求めた既定値に戻します。
+ * 上限を超えている待機中の作業スレッドは終了します。
+ */
+static VALUE
+pool_s_set_max_threads(VALUE mod, VALUE n)
+{
+    int cap = NIL_P(n) ? 0 : NUM2INT(n);
+    if (cap < 0) { rb_raise(rb_eArgError, "wrong max_threads (%d for 0..)", cap); }
+    if (cap == 0) { cap = pool.auto_cap; }
+    if (cap > EXTLZMA_THREADS_MAX) { cap = EXTLZMA_THREADS_MAX; }
+
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_lock(&pool.lock);
+    __atomic_store_n(&pool.cap, cap, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&pool.wakeup);
+    pthread_mutex_unlock(&pool.lock);
+#else
+    pool.cap = cap;
+#endif
+
+    return n;
+}
+
+/*
+ * call-seq:
+ *  LZMA::ThreadPool.cpu_quota -> integer or nil
+ *
+ * cgroup によって CPU の割り当てが制限されている場合、その CPU の数 (切り上げ) を返します。
+ */
+static VALUE
+pool_s_cpu_quota(VALUE mod)
+{
+    return (pool.quota > 0 ? INT2NUM(pool.quota) : Qnil);
+}
+
+/*
+ * call-seq:
+ *  LZMA::ThreadPool.stats -> hash
+ *
+ * スレッドプールの状態と計数を返します。
+ *
+ * [max_threads]    同時に処理を行うスレッドの最大数です。
+ * [workers]        生成済みの作業スレッドの数です。
+ * [idle]           待機している作業スレッドの数です。
+ * [busy]           処理を行っているスレッドの数です (呼び出し元のスレッドを含みます)。
+ * [queue_depth]    未処理の部分が残っている job の数です。
+ * [jobs]           受け付けた job の数です。
+ * [tasks]          処理した index の数です。
+ * [stolen_tasks]   tasks のうち、作業スレッドが処理した数です。
+ * [busy_ns]        各スレッドが処理に費やした時間の合計をナノ秒で表したものです。
+ * [forks]          fork によって状態を初期化した回数です。
+ */
+static VALUE
+pool_s_stats(VALUE mod)
+{
+    VALUE hash = rb_hash_new();
+    int workers = 0, idle = 0, busy = 0, depth = 0;
+
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_lock(&pool.lock);
+    workers = pool.workers;
+    idle = pool.idle;
+    busy = pool.busy;
+    for (const struct parallel_job *job = pool.queue; job; job = job->link) {
+        if (job_pending_p(job)) { depth ++; }
+    }
+    pthread_mutex_unlock(&pool.lock);
+#endif
+
+    rb_hash_aset(hash, ID2SYM(rb_intern("max_threads")), INT2NUM(extlzma_cpu_threads()));
+    rb_hash_aset(hash, ID2SYM(rb_intern("workers")), INT2NUM(workers));
+    rb_hash_aset(hash, ID2SYM(rb_intern("idle")), INT2NUM(idle));
+    rb_hash_aset(hash, ID2SYM(rb_intern("busy")), INT2NUM(busy));
+    rb_hash_aset(hash, ID2SYM(rb_intern("queue_depth")), INT2NUM(depth));
+    rb_hash_aset(hash, ID2SYM(rb_intern("jobs")), ULL2NUM(__atomic_load_n(&pool.jobs, __ATOMIC_RELAXED)));
+    rb_hash_aset(hash, ID2SYM(rb_intern("tasks")), ULL2NUM(__atomic_load_n(&pool.tasks, __ATOMIC_RELAXED)));
+    rb_hash_aset(hash, ID2SYM(rb_intern("stolen_tasks")), ULL2NUM(__atomic_load_n(&pool.stolen, __ATOMIC_RELAXED)));
+    rb_hash_aset(hash, ID2SYM(rb_intern("busy_ns")), ULL2NUM(__atomic_load_n(&pool.busy_ns, __ATOMIC_RELAXED)));
+    rb_hash_aset(hash, ID2SYM(rb_intern("forks")), ULL2NUM(pool.forks));
+
+    return hash;
+}
+
+/*
+ * call-seq:
+ *  LZMA::ThreadPool.reset_stats -> nil
+ *
+ * 計数を 0 に戻します。
+ */
+static VALUE
+pool_s_reset_stats(VALUE mod)
+{
+    __atomic_store_n(&pool.jobs, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&pool.tasks, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&pool.stolen, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&pool.busy_ns, 0, __ATOMIC_RELAXED);
+    pool.forks = 0;
+
+    return Qnil;
+}
+
+void
+extlzma_init_ThreadPool(void)
+{
+    int cpus = cpu_count();
+    pool.quota = cgroup_cpu_quota();
+    pool.auto_cap = (pool.quota > 0 && pool.quota < cpus ? pool.quota : cpus);
+    pool.cap = pool.auto_cap;
+
+    const char *env = getenv("EXTLZMA_MAX_THREADS");
+    if (env && *env) {
+        int n = atoi(env);
+        if (n > 0) { pool.cap = (n > EXTLZMA_THREADS_MAX ? EXTLZMA_THREADS_MAX : n); }
+    }
+
+#ifdef HAVE_PTHREAD_H
+    pthread_atfork(pool_atfork_prepare, pool_atfork_parent, pool_atfork_child);
+#endif
+
+    /*
+     * Document-module: LZMA::ThreadPool
+     *
+     * extlzma のネイティブスレッドによる並列処理 (LZMA::Utils.crc32 などの +threads:+、
+     * LZMA::Stream.code_all、LZMA::Tuner.measure) が共有するスレッドプールです。
+     *
+     * 作業スレッドはプロセスごとに一つのプールにまとめられ、同時に処理を行うスレッドの数は
+     * LZMA::ThreadPool.max_threads に制限されます。既定値は CPU の数と cgroup の CPU 割り当ての小さい方で、
+     * 環境変数 EXTLZMA_MAX_THREADS でも与えることが出来ます。
+     *
+     * fork した子プロセスでは、最初の並列処理の際に作業スレッドを生成しなおします。
+     *
+     * LZMA::Stream::MTEncoder / LZMA::Stream::MTDecoder は liblzma が自らスレッドを生成するため、
+     * このプールは用いません。ただし +threads: 0+ の場合のスレッドの数は max_threads となります。
+     */
+    mThreadPool = rb_define_module_under(extlzma_mLZMA, "ThreadPool");
+    rb_define_singleton_method(mThreadPool, "max_threads", RUBY_METHOD_FUNC(pool_s_max_threads), 0);
+    rb_define_singleton_method(mThreadPool, "max_threads=", RUBY_METHOD_FUNC(pool_s_set_max_threads), 1);
+    rb_define_singleton_method(mThreadPool, "cpu_quota", RUBY_METHOD_FUNC(pool_s_cpu_quota), 0);
+    rb_define_singleton_method(mThreadPool, "stats", RUBY_METHOD_FUNC(pool_s_stats), 0);
+    rb_define_singleton_method(mThreadPool, "reset_stats", RUBY_METHOD_FUNC(pool_s_reset_stats), 0);
+}
@@ -0,0 +1,71 @@
+#include "extlzma.h"
+
+/*
+ * rsyncable のための、内容によるブロックの区切りの決定。
+ *
+ * gear hash (h = (h << 1) + gear[b]) を入力に対して転がし、上位ビットがすべて 0 となった位置で区切る。
+ * ハッシュの上位ビットは直前の 64 バイトのみに依存するため、同じ内容の区間には同じ位置に区切りが現れ、
+ * 入力の一部が変わっても、その前後以外の区切りは変わらない。
+ *
+ * 区切りの間隔は平均の 1/4 から 4 倍までに制限する。
+ */
+
+static uint64_t gear[256];
+
+void
+extlzma_rsync_setup(struct extlzma_rsync *r, uint64_t average, lzma_action flush)
+{
+    int bits = 0;
+    while (bits < 62 && ((uint64_t)1 << (bits + 1)) <= average) { bits ++; }
+
+    r->hash = 0;
+    r->since = 0;
+    r->shift = 64 - bits;
+    r->min = ((uint64_t)1 << bits) / 4;
+    r->max = ((uint64_t)1 << bits) * 4;
+    r->flush = flush;
+}
+
+size_t
+extlzma_rsync_scan(struct extlzma_rsync *r, const uint8_t *ptr, size_t size, int *cut)
+{
+    uint64_t h = r->hash;
+    uint64_t since = r->since;
+    size_t i = 0;
+
+    *cut = 0;
+
+    // 最小の間隔に達するまでは区切らないため、ハッシュの更新のみを行う
+    for (; i < size && since < r->min; i ++, since ++) {
+        h = (h << 1) + gear[ptr[i]];
+    }
+
+    for (; i < size; i ++) {
+        h = (h << 1) + gear[ptr[i]];
+        since ++;
+        if ((h >> r->shift) == 0 || since >= r->max) {
+            i ++;
+            *cut = 1;
+            since = 0;
+            break;
+        }
+    }
+
+    r->hash = h;
+    r->since = since;
+
+    return i;
+}
+
+void
+extlzma_init_Rsyncable(void)
+{
+    // splitmix64 による固定の表。出力を再現可能とするため、乱数の種は変えてはならない
+    uint64_t x = 0x6c7a6d6172737963ULL;
+    for (int i = 0; i < 256; i ++) {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+    }
+}
@@ -6,11 +6,32 @@ static VALUE cDecoder;
 static VALUE cAutoDecoder;
 static VALUE cRawEncoder;
 static VALUE cRawDecoder;
+static VALUE cBlockDecoder;
+#ifdef HAVE_LZMA_STREAM_ENCODER_MT
+static VALUE cMTEncoder;
+#endif
+#ifdef HAVE_LZMA_STREAM_DECODER_MT
+static VALUE cMTDecoder;
+#endif
+static ID id_max_output;
+static ID id_max_ratio;
+static ID id_size_hint;
+static ID id_ignore_check;
+static ID id_threads;
+static ID id_block_size;
+static ID id_memlimit_threading;
+static ID id_rsyncable;
 
 enum {
     WORK_BUFFER_SIZE = 256 * 1024, // 256 KiB
     BUFFER_BLOCK_SIZE = WORK_BUFFER_SIZE,
     UPDATE_TRY_MAX = 2,
+    CODE_EXPANSION_ESTIMATE = 4,
+    CODE_SLICE_IN = 32 * 1024,      // 32 KiB
+    CODE_SLICE_OUT = 128 * 1024,    // 128 KiB
+    RATIO_CHECK_MIN = 1 << 20,      // 1 MiB
+    RSYNC_AVERAGE = 1 << 20,        // 1 MiB
+    RSYNC_AVERAGE_MIN = 4 * 1024,   // 4 KiB
 };
 
 static inline void
@@ -19,129 +40,1067 @@ filter_copy(lzma_filter *dest, VALUE filter)
     memcpy(dest, extlzma_getfilter(filter), sizeof(*dest));
 }
 
+/*
+ * LZMA::Stream のインスタンスが保持するデータ。
+ *
+ * lzma_stream を先頭に置いているため、lzma_stream * としても扱える。
+ */
+struct stream
+{
+    lzma_stream stream;
+    uint64_t max_output;    // 出力の最大バイト数。0 であれば制限しない
+    double max_ratio;       // 出力と入力の比の最大値。0 であれば制限しない
+    uint32_t dictsize;      // 圧縮器が実際に用いる LZMA1/LZMA2 の辞書の大きさ。0 であれば不明
+    uint64_t memusage;      // 圧縮器の生成時に見積もった作業メモリ量。0 であれば不明
+    lzma_block *block;      // LZMA::Stream::BlockDecoder が用いる。liblzma が初期化後も参照する
+    struct extlzma_rsync *rsync;    // rsyncable な圧縮器であれば区切りを決めるための状態
+    int closed;             // LZMA::Stream#end によって作業メモリを解放済み
+    int finished;           // LZMA_STREAM_END に達した
+    int warn_unfinished;    // LZMA_STREAM_END に達しないまま回収された場合に警告する
+    int busy;               // code / feed / code_all の処理中 (入れ子になりうるため計数する)
+};
+
 static void
-stream_clear(lzma_stream *stream)
+stream_clear(struct stream *stream)
 {
     static const lzma_stream init = LZMA_STREAM_INIT;
-    memcpy(stream, &init, sizeof(init));
+    memcpy(&stream->stream, &init, sizeof(init));
+    stream->max_output = 0;
+    stream->max_ratio = 0;
+    stream->dictsize = 0;
+    stream->memusage = 0;
+    stream->block = NULL;
+    stream->rsync = NULL;
+    stream->closed = 0;
+    stream->finished = 0;
+    stream->warn_unfinished = 0;
+    stream->busy = 0;
+}
+
+static inline lzma_stream *
+getstream(VALUE lzma)
+{
+    return getref(lzma);
+}
+
+static inline lzma_stream *
+getstream_open(VALUE lzma)
+{
+    lzma_stream *p = getref(lzma);
+    if (((struct stream *)p)->closed) {
+        rb_raise(rb_eIOError, "closed stream - #<%s:%p>", rb_obj_classname(lzma), (void *)lzma);
+    }
+    return p;
+}
+
+static inline struct stream *
+stream_ext(lzma_stream *p)
+{
+    return (struct stream *)p;
+}
+
+/*
+ * code / feed / code_all の処理中であることを示す。
+ *
+ * 他のスレッドが GVL を解放して lzma_code を呼び出している間や、feed のブロックの中で
+ * LZMA::Stream#end が作業メモリを解放しないようにするために用いる。
+ * 例外によって抜ける場合も戻すため、rb_ensure の後始末として stream_busy_leave を与える。
+ */
+static inline void
+stream_busy_enter(lzma_stream *p)
+{
+    stream_ext(p)->busy ++;
+}
+
+static VALUE
+stream_busy_leave(VALUE stream)
+{
+    stream_ext(getstream(stream))->busy --;
+    return Qnil;
+}
+
+/*
+ * feed のブロックから戻った後に、ストリームが閉じられていないことを確かめる。
+ */
+static inline void
+stream_check_open(lzma_stream *p)
+{
+    if (stream_ext(p)->closed) {
+        rb_raise(rb_eIOError, "stream closed during feed");
+    }
+}
+
+/*
+ * GC の際は lzma_end によって作業メモリを解放するのみで、残りのデータの圧縮は行わない
+ * (GC の停止時間が圧縮の処理時間だけ長くなるため)。
+ *
+ * そのため閉じられないまま回収された圧縮器の出力は途中で切れており、
+ * warn_unfinished が設定されていればその旨を警告する。
+ * GC の途中では Ruby の API を呼び出せないため、警告は標準エラー出力へ直接書き込む。
+ */
+static inline void
+stream_cleanup(void *pp)
+{
+    if (pp) {
+        lzma_stream *p = (lzma_stream *)pp;
+        const struct stream *st = stream_ext(p);
+        if (st->warn_unfinished && !st->closed && !st->finished) {
+            fprintf(stderr,
+                    "extlzma: warning: encoder %p was garbage collected without close;"
+                    " the compressed output is truncated (%" PRIu64 " bytes in, %" PRIu64 " bytes out)\n",
+                    (void *)p, (uint64_t)p->total_in, (uint64_t)p->total_out);
+        }
+        lzma_end(p);
+        xfree(stream_ext(p)->block);
+        xfree(stream_ext(p)->rsync);
+        free(p);
+    }
+}
+
+static void
+stream_mark(void *p)
+{
+}
+
+static VALUE
+stream_alloc(VALUE klass)
+{
+    struct stream *p;
+    VALUE obj = Data_Make_Struct(klass, struct stream, stream_mark, stream_cleanup, p);
+    stream_clear(p);
+    return obj;
+}
+
+static VALUE
+aux_str_reserve(VALUE str, size_t size)
+{
+    size_t capa = rb_str_capacity(str);
+    if (capa < size) {
+        rb_str_modify_expand(str, size - RSTRING_LEN(str));
+    } else {
+        rb_str_modify(str);
+    }
+
+    return str;
+}
+
+/*
+ * lzma_code を一度に処理する量を制限して繰り返し呼び出すための状態。
+ *
+ * GVL を解放している間に Thread#raise や Thread#kill などが行われると
+ * ubf (code_cancel) によって *cancel が設定され、区切りの良いところで処理を中断する。
+ */
+struct code_call
+{
+    lzma_stream *stream;
+    lzma_action action;
+    const int *cancel;
+    lzma_ret status;
+    int started;
+    int interrupted;
+    int exceeded;       // 出力の制限を超えた (CODE_EXCEED_*)
+    size_t out_budget;  // GVL を保持したまま処理する場合の出力の上限。0 であれば制限しない
+};
+
+enum {
+    CODE_EXCEED_NONE = 0,
+    CODE_EXCEED_OUTPUT,
+    CODE_EXCEED_RATIO,
+};
+
+/*
+ * 出力の制限を確認する。
+ *
+ * 比の制限は、出力が RATIO_CHECK_MIN を超えてから確認する
+ * (ストリームの先頭では入力に対する出力が大きく偏ることがあるため)。
+ */
+static inline int
+code_check_exceed(const struct stream *st)
+{
+    const lzma_stream *p = &st->stream;
+
+    if (st->max_output && p->total_out > st->max_output) {
+        return CODE_EXCEED_OUTPUT;
+    }
+
+    if (st->max_ratio > 0 && p->total_out > RATIO_CHECK_MIN &&
+            (double)p->total_out > st->max_ratio * (double)(p->total_in ? p->total_in : 1)) {
+        return CODE_EXCEED_RATIO;
+    }
+
+    return CODE_EXCEED_NONE;
+}
+
+static void
+code_cancel(void *cancel)
+{
+    __atomic_store_n((int *)cancel, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * 入力と出力をそれぞれ CODE_SLICE_IN / CODE_SLICE_OUT に制限して lzma_code を呼び出す。
+ *
+ * 制限によって lzma_code が停止した場合のみ続きを処理するため、
+ * 結果は制限せずに一度で lzma_code を呼び出した場合と同じになる。
+ *
+ * LZMA_RUN 以外の action では avail_in を変更してはならない (liblzma の制約) ため、出力のみを制限する。
+ *
+ * out_budget が設定されている (GVL を保持している) 場合は、それだけ出力した区切りで中断として戻る。
+ * 小さな入力から大きな出力が伸張される場合に、割り込めないまま GVL を保持し続けないようにするため。
+ */
+static void
+code_call_run(struct code_call *call)
+{
+    lzma_stream *stream = call->stream;
+    int slice_in = (call->action == LZMA_RUN);
+    const struct stream *st = stream_ext(stream);
+    size_t produced = 0;
+    lzma_ret s;
+
+    call->started = 1;
+    call->interrupted = 0;
+    call->exceeded = CODE_EXCEED_NONE;
+
+    for (;;) {
+        size_t rest_in = stream->avail_in;
+        size_t rest_out = stream->avail_out;
+        size_t in = (slice_in && rest_in > CODE_SLICE_IN) ? CODE_SLICE_IN : rest_in;
+        size_t out = (rest_out > CODE_SLICE_OUT) ? CODE_SLICE_OUT : rest_out;
+
+        if (st->max_output) {
+            // 制限を 1 バイトだけ超えられるようにして、超えたことを検出する
+            uint64_t allow = (stream->total_out < st->max_output ? st->max_output - stream->total_out : 0) + 1;
+            if (out > allow) { out = (size_t)allow; }
+        }
+
+        stream->avail_in = in;
+        stream->avail_out = out;
+        EXTLZMA_PROBE4(code__entry, stream, (int)call->action, in, out);
+        s = lzma_code(stream, call->action);
+        EXTLZMA_PROBE4(code__return, stream, (int)s, in - stream->avail_in, out - stream->avail_out);
+
+        int limited = (in < rest_in && stream->avail_in == 0) ||
+                      (out < rest_out && stream->avail_out == 0);
+        produced += out - stream->avail_out;
+        stream->avail_in += rest_in - in;
+        stream->avail_out += rest_out - out;
+
+        if ((call->exceeded = code_check_exceed(st)) != CODE_EXCEED_NONE) { break; }
+        if (s != LZMA_OK || !limited) { break; }
+
+        if (__atomic_load_n(call->cancel, __ATOMIC_ACQUIRE)) {
+            call->interrupted = 1;
+            break;
+        }
+
+        if (call->out_budget && produced >= call->out_budget) {
+            call->interrupted = 1;
+            break;
+        }
+    }
+
+    call->status = s;
+    if (s == LZMA_STREAM_END) { stream_ext(stream)->finished = 1; }
+}
+
+/*
+ * lzma_code の出力量を見積もる (入力の CODE_EXPANSION_ESTIMATE 倍を上限とする)。
+ */
+static inline size_t
+aux_lzma_code_out_estimate(const lzma_stream *stream)
+{
+    size_t out = stream->avail_in * CODE_EXPANSION_ESTIMATE;
+    if (out > stream->avail_out) { out = stream->avail_out; }
+    return out;
+}
+
+/*
+ * lzma_code の処理量を見積もる。
+ *
+ * 伸張では入力よりも出力が大きくなるため、出力側も加える。
+ * 見積もりの精度は問題とならない (LZMA::GVL の学習も同じ見積もりに対して行われるため)。
+ */
+static inline size_t
+aux_lzma_code_work(const lzma_stream *stream)
+{
+    return stream->avail_in + aux_lzma_code_out_estimate(stream);
+}
+
+/*
+ * GVL を保持したまま処理する場合の出力の上限。
+ *
+ * 見積もった出力量を超えた時点で一旦戻り、割り込みを確認してから改めて GVL を解放するかどうかを決める。
+ * 出力が見積もりを大きく超える (小さな入力から大きく伸張される) 場合でも、GVL を保持する時間は見積もりの範囲に収まる。
+ */
+static inline size_t
+aux_lzma_code_out_budget(const lzma_stream *stream)
+{
+    size_t out = aux_lzma_code_out_estimate(stream);
+    return (out < CODE_SLICE_OUT ? CODE_SLICE_OUT : out);
+}
+
+static inline int
+aux_lzma_code_first_p(const lzma_stream *stream)
+{
+    // 最初の lzma_code では辞書やハッシュテーブルの初期化が行われる
+    return (stream->total_in == 0 && stream->total_out == 0);
+}
+
+/*
+ * src / dest / maxdest を lzma_stream に設定する。
+ *
+ * dest には既に格納されている内容の後ろに追記する。
+ */
+static inline void
+code_setup(lzma_stream *p, VALUE src, VALUE dest, size_t maxdestn)
+{
+    if (NIL_P(src)) {
+        p->next_in = NULL;
+        p->avail_in = 0;
+    } else {
+        rb_str_modify(src);
+        p->next_in = (uint8_t *)RSTRING_PTR(src);
+        p->avail_in = RSTRING_LEN(src);
+    }
+
+    aux_str_reserve(dest, maxdestn);
+    size_t destlen = RSTRING_LEN(dest);
+    if (destlen > maxdestn) { destlen = maxdestn; }
+    p->next_out = (uint8_t *)RSTRING_PTR(dest) + destlen;
+    p->avail_out = maxdestn - destlen;
+}
+
+/*
+ * 処理された分を src から取り除き、dest の長さを設定する。
+ */
+static inline void
+code_settle(lzma_stream *p, VALUE src, VALUE dest, size_t maxdestn)
+{
+    if (p->next_in) {
+        size_t srcrest = p->avail_in;
+        memmove(RSTRING_PTR(src), p->next_in, srcrest);
+        rb_str_set_len(src, srcrest);
+    }
+
+    rb_str_set_len(dest, maxdestn - p->avail_out);
 }
 
-static inline lzma_stream *
-getstream(VALUE lzma)
-{
-    return getref(lzma);
+static void *
+aux_lzma_code_nogvl(va_list *p)
+{
+    code_call_run(va_arg(*p, struct code_call *));
+    return NULL;
+}
+
+/*
+ * 中断された場合は *interrupted が真となる。このとき stream は処理を再開できる状態にある。
+ *
+ * 出力の制限を超えた場合は *exceeded が CODE_EXCEED_NONE 以外となる。
+ */
+static inline lzma_ret
+aux_lzma_code(lzma_stream *stream, lzma_action sync, int *interrupted, int *exceeded)
+{
+    int cancel = 0;
+    struct code_call call = { stream, sync, &cancel, LZMA_OK, 0, 0, CODE_EXCEED_NONE, 0 };
+    size_t work = aux_lzma_code_work(stream);
+    int first = aux_lzma_code_first_p(stream);
+
+    if (extlzma_gvl_hold_p(EXTLZMA_GVL_CODE, work, first)) {
+        call.out_budget = aux_lzma_code_out_budget(stream);
+    }
+
+    aux_thread_call_with_policy_ubf(EXTLZMA_GVL_CODE, work, first,
+                                    code_cancel, &cancel,
+                                    aux_lzma_code_nogvl, &call);
+
+    // lzma_code を呼ぶ前に割り込まれた場合も中断として扱う
+    *interrupted = (!call.started || call.interrupted);
+    *exceeded = call.exceeded;
+
+    return call.status;
+}
+
+static void
+code_raise_exceeded(const lzma_stream *p, int exceeded)
+{
+    const struct stream *st = stream_ext((lzma_stream *)p);
+    VALUE exc;
+
+    if (exceeded == CODE_EXCEED_OUTPUT) {
+        exc = rb_exc_new_str(extlzma_eOutputLimitError,
+                rb_sprintf("output limit exceeded (max_output: %" PRIu64 ", input offset: %" PRIu64 ")",
+                           st->max_output, (uint64_t)p->total_in));
+        rb_ivar_set(exc, rb_intern("@limit"), ID2SYM(rb_intern("max_output")));
+    } else {
+        exc = rb_exc_new_str(extlzma_eOutputLimitError,
+                rb_sprintf("output ratio limit exceeded (max_ratio: %g, input offset: %" PRIu64 ", output offset: %" PRIu64 ")",
+                           st->max_ratio, (uint64_t)p->total_in, (uint64_t)p->total_out));
+        rb_ivar_set(exc, rb_intern("@limit"), ID2SYM(rb_intern("max_ratio")));
+    }
+
+    rb_ivar_set(exc, rb_intern("@input_offset"), ULL2NUM(p->total_in));
+    rb_ivar_set(exc, rb_intern("@output_offset"), ULL2NUM(p->total_out));
+    rb_exc_raise(exc);
+}
+
+/*
+ * call-seq:
+ *  code(src, dest, maxdest, action) -> status
+ *
+ * +lzma_code+ を用いて、圧縮/伸長処理を行います。
+ *
+ * [RETURN]
+ *      +lzma_code+ が返す整数値をそのまま返します。
+ *
+ * [src]
+ *      処理前のバイナリデータが格納された文字列オブジェクトを与えます。
+ *
+ *      このオブジェクトは変更されます。
+ *
+ *      処理された部分が取り除かれます (処理されなかった部分が残ります)。
+ *
+ * [dest]
+ *      処理後のバイナリデータを格納する文字列オブジェクトを与えます。
+ *
+ * [maxdest]
+ *      dest の最大処理バイト数を与えます。
+ *
+ * [action]
+ *      +lzma_code+ の +action+ 引数に渡される整数値です。
+ *
+ * 処理は一定量ごとに区切って行われ、その区切りで Thread#raise や Thread#kill、Timeout.timeout などの割り込みを受け付けます。
+ *
+ * 割り込みによって例外が発生した場合、src と dest はそれまでに処理された状態となります。
+ * 例外を捕捉した後に続きを処理するには、同じ src を与えて再び呼び出して下さい
+ * (dest は置き換えられるため、それまでの内容は呼び出し側で退避しておく必要があります)。
+ */
+static VALUE
+stream_code_body(VALUE args)
+{
+    const VALUE *argv = (const VALUE *)args;
+    VALUE stream = argv[0], src = argv[1], dest = argv[2], maxdest = argv[3], action = argv[4];
+    lzma_stream *p = getstream_open(stream);
+
+    if (!NIL_P(src)) { rb_check_type(src, RUBY_T_STRING); }
+    rb_check_type(dest, RUBY_T_STRING);
+    size_t maxdestn = NUM2SIZET(maxdest);
+    lzma_action act = NUM2INT(action);
+    lzma_ret s;
+
+    rb_str_modify(dest);
+    rb_str_set_len(dest, 0);
+
+    for (;;) {
+        code_setup(p, src, dest, maxdestn);
+
+        int interrupted, exceeded;
+        s = aux_lzma_code(p, act, &interrupted, &exceeded);
+
+        code_settle(p, src, dest, maxdestn);
+
+        if (exceeded) { code_raise_exceeded(p, exceeded); }
+        if (!interrupted) { break; }
+
+        /*
+         * 割り込みを処理する。例外が発生した場合でも src と dest は整合した状態にある。
+         *
+         * 割り込みの処理中に他のスレッドが src や dest を変更する可能性があるため、
+         * 再開する際は code_setup で設定しなおす。
+         */
+        rb_thread_check_ints();
+    }
+
+    return UINT2NUM(s);
+}
+
+static VALUE
+stream_code(VALUE stream, VALUE src, VALUE dest, VALUE maxdest, VALUE action)
+{
+    VALUE args[] = { stream, src, dest, maxdest, action };
+    stream_busy_enter(getstream_open(stream));
+    return rb_ensure(stream_code_body, (VALUE)args, stream_busy_leave, stream);
+}
+
+/*
+ * dest が配列の場合に、出力を追記する文字列を返す。
+ *
+ * 凍結されておらず maxdestn に満たない最初の要素を用い、なければ新たな文字列を追加する。
+ * 長さを 0 に戻した要素は、確保済みの領域のまま再び用いられる。
+ */
+static VALUE
+feed_chunk(VALUE chunks, size_t maxdestn)
+{
+    for (long i = 0; i < RARRAY_LEN(chunks); i ++) {
+        VALUE str = RARRAY_AREF(chunks, i);
+        if (RB_TYPE_P(str, RUBY_T_STRING) && !OBJ_FROZEN(str) && (size_t)RSTRING_LEN(str) < maxdestn) {
+            return str;
+        }
+    }
+
+    VALUE str = rb_str_buf_new(maxdestn);
+    rb_ary_push(chunks, str);
+    return str;
+}
+
+/*
+ * src の off から srclen までを処理する。src は凍結された文字列か nil である。
+ *
+ * dest が配列であれば、ブロックを呼ばずに出力を配列の要素に追記する。
+ */
+static lzma_ret
+feed_range(lzma_stream *p, VALUE src, size_t off, size_t srclen, VALUE dest, size_t maxdestn, lzma_action act)
+{
+    int chunked = RB_TYPE_P(dest, RUBY_T_ARRAY);
+    lzma_ret s;
+
+    for (;;) {
+        p->next_in = NIL_P(src) ? NULL : (const uint8_t *)RSTRING_PTR(src) + off;
+        p->avail_in = srclen - off;
+
+        VALUE out = chunked ? feed_chunk(dest, maxdestn) : dest;
+        size_t base = chunked ? (size_t)RSTRING_LEN(out) : 0;
+        aux_str_reserve(out, maxdestn);
+        p->next_out = (uint8_t *)RSTRING_PTR(out) + base;
+        p->avail_out = maxdestn - base;
+
+        int interrupted, exceeded;
+        s = aux_lzma_code(p, act, &interrupted, &exceeded);
+
+        size_t used = srclen - off - p->avail_in;
+        off += used;
+        size_t produced = maxdestn - base - p->avail_out;
+        int room = (p->avail_out > 0);
+        rb_str_set_len(out, base + produced);
+        p->next_in = NULL;
+        p->avail_in = 0;
+
+        if (exceeded) { code_raise_exceeded(p, exceeded); }
+        if (produced > 0 && !chunked) {
+            rb_yield(out);
+            stream_check_open(p);
+        }
+
+        if (interrupted) {
+            rb_thread_check_ints();
+            continue;
+        }
+
+        if (s != LZMA_OK) { break; }
+        if (used == 0 && produced == 0) { break; }
+        if (act == LZMA_RUN && off == srclen && room) {
+            // 出力に余裕がある状態で入力を使い切った = これ以上の出力は次の入力を待つ必要がある
+            break;
+        }
+    }
+
+    RB_GC_GUARD(src);
+
+    return s;
+}
+
+/*
+ * rsyncable な圧縮器では、内容によって決まる区切りごとに rsync->flush を行いブロックを閉じる。
+ */
+static lzma_ret
+feed_rsyncable(lzma_stream *p, VALUE src, VALUE dest, size_t maxdestn)
+{
+    size_t srclen = RSTRING_LEN(src);
+    size_t off = 0;
+    lzma_ret s = LZMA_OK;
+
+    while (off < srclen) {
+        // ブロックの中で解放されることに備え、feed_range を呼ぶたびに取り直す
+        stream_check_open(p);
+        struct extlzma_rsync *rsync = stream_ext(p)->rsync;
+        int cut;
+        size_t n = extlzma_rsync_scan(rsync, (const uint8_t *)RSTRING_PTR(src) + off, srclen - off, &cut);
+        s = feed_range(p, src, off, off + n, dest, maxdestn, LZMA_RUN);
+        if (s != LZMA_OK) { break; }
+        off += n;
+
+        if (cut) {
+            stream_check_open(p);
+            s = feed_range(p, Qnil, 0, 0, dest, maxdestn, stream_ext(p)->rsync->flush);
+            if (s != LZMA_STREAM_END) { break; }
+            s = LZMA_OK;
+        }
+    }
+
+    RB_GC_GUARD(src);
+
+    return s;
+}
+
+/*
+ * call-seq:
+ *  feed(src, dest, maxdest, action) { |dest| ... } -> status
+ *  feed(src, chunks, maxdest, action) -> status
+ *
+ * src をすべて処理するまで (action が LZMA::RUN 以外の場合は +lzma_code+ が LZMA::OK 以外を返すまで)
+ * +lzma_code+ を繰り返し、出力があるたびに dest をブロックに渡します。
+ *
+ * LZMA::Stream#code と異なり、src は変更されず、処理された部分を取り除くための複写も行われません。
+ *
+ * [RETURN]
+ *      最後の +lzma_code+ の戻り値を返します。
+ *
+ * [src]
+ *      処理前のバイナリデータが格納された文字列オブジェクト、または +nil+ を与えます。
+ *
+ * [dest]
+ *      処理後のバイナリデータを格納する文字列オブジェクトを与えます。
+ *
+ *      ブロックを呼ぶたびに内容は置き換えられます (同じオブジェクトが使いまわされます)。
+ *
+ * [chunks]
+ *      dest の代わりに配列を与えると、ブロックは呼ばずに、出力を maxdest バイトずつの文字列として配列に格納します。
+ *
+ *      凍結されておらず maxdest バイトに満たない最初の要素に追記し、満ちたら次の要素に進みます。
+ *      要素が足りなければ新たな文字列を追加します。
+ *      長さを 0 にした (LZMA::Utils.writev で書き込んだ) 要素は、確保済みの領域のまま再び用いられます。
+ *
+ * [maxdest]
+ *      一度にブロックへ渡す最大のバイト数を与えます。
+ *
+ * [action]
+ *      +lzma_code+ の +action+ 引数に渡される整数値です。
+ *
+ * 割り込みによって例外が発生した場合、src のどこまでが処理されたのかを知ることは出来ません。
+ */
+static VALUE
+stream_feed_body(VALUE args)
+{
+    const VALUE *argv = (const VALUE *)args;
+    VALUE stream = argv[0], src = argv[1], dest = argv[2], maxdest = argv[3], action = argv[4];
+    lzma_stream *p = getstream_open(stream);
+
+    if (!RB_TYPE_P(dest, RUBY_T_ARRAY)) {
+        rb_need_block();
+        rb_check_type(dest, RUBY_T_STRING);
+    }
+    if (!NIL_P(src)) {
+        // ブロックの中で変更されても影響を受けないようにする
+        src = rb_str_new_frozen(rb_str_to_str(src));
+    }
+    size_t maxdestn = NUM2SIZET(maxdest);
+    lzma_action act = NUM2INT(action);
+
+    if (maxdestn < 1) {
+        rb_raise(rb_eArgError, "maxdest is too small (%d for 1..)", (int)maxdestn);
+    }
+
+    if (stream_ext(p)->rsync && act == LZMA_RUN && !NIL_P(src)) {
+        return UINT2NUM(feed_rsyncable(p, src, dest, maxdestn));
+    }
+
+    return UINT2NUM(feed_range(p, src, 0, NIL_P(src) ? 0 : RSTRING_LEN(src), dest, maxdestn, act));
+}
+
+static VALUE
+stream_feed(VALUE stream, VALUE src, VALUE dest, VALUE maxdest, VALUE action)
+{
+    VALUE args[] = { stream, src, dest, maxdest, action };
+    stream_busy_enter(getstream_open(stream));
+    return rb_ensure(stream_feed_body, (VALUE)args, stream_busy_leave, stream);
+}
+
+struct code_entry
+{
+    struct code_call call;
+    VALUE src;
+    VALUE dest;
+    size_t maxdest;
+    int done;
+};
+
+struct code_batch
+{
+    struct code_entry *entries;
+    size_t num;
+    int threads;
+    int first;
+    int cancel;
+};
+
+static void
+code_batch_one(void *arg, size_t i)
+{
+    struct code_entry *e = &((struct code_batch *)arg)->entries[i];
+    if (!e->done) { code_call_run(&e->call); }
+}
+
+static void *
+code_batch_nogvl(va_list *vp)
+{
+    struct code_batch *batch = va_arg(*vp, struct code_batch *);
+    int threads = va_arg(*vp, int);
+
+    if (threads == 1) {
+        for (size_t i = 0; i < batch->num; i ++) {
+            code_batch_one(batch, i);
+        }
+    } else {
+        extlzma_parallel_run(batch->num, threads, code_batch_one, batch);
+    }
+
+    return NULL;
+}
+
+/*
+ * obj が他の要素ですでに使われていれば例外を発生させる。seen は比較に同一性を用いるハッシュである。
+ */
+static void
+code_entry_claim(VALUE seen, VALUE obj, size_t i, const char *what)
+{
+    VALUE j = rb_hash_lookup(seen, obj);
+    if (!NIL_P(j)) {
+        rb_raise(rb_eArgError, "same %s given twice (at %d and %d)", what, NUM2INT(j), (int)i);
+    }
+    rb_hash_aset(seen, obj, SIZET2NUM(i));
+}
+
+/*
+ * ary の i 番目の要素を解釈する。to_ary によって変換した要素は ary に格納しなおし、GC から保護する。
+ */
+static int
+code_entry_scan(struct code_entry *e, VALUE ary, size_t i, VALUE seen, const int *cancel)
+{
+    VALUE entry = rb_convert_type(RARRAY_AREF(ary, i), RUBY_T_ARRAY, "Array", "to_ary");
+    rb_ary_store(ary, i, entry);
+    if (RARRAY_LEN(entry) != 5) {
+        rb_raise(rb_eArgError,
+                 "wrong entry size (%d for 5) - expect [stream, src, dest, maxdest, action]",
+                 (int)RARRAY_LEN(entry));
+    }
+
+    VALUE stream = RARRAY_AREF(entry, 0);
+    if (!rb_obj_is_kind_of(stream, extlzma_cStream)) {
+        rb_raise(rb_eTypeError,
+                 "not a stream - #<%s:%p>",
+                 rb_obj_classname(stream), (void *)stream);
+    }
+
+    memset(e, 0, sizeof(*e));
+    e->call.stream = getstream_open(stream);
+    e->call.cancel = cancel;
+    e->src = RARRAY_AREF(entry, 1);
+    e->dest = RARRAY_AREF(entry, 2);
+    if (!NIL_P(e->src)) { rb_check_type(e->src, RUBY_T_STRING); }
+    rb_check_type(e->dest, RUBY_T_STRING);
+
+    // 複数のスレッドが同じ lzma_stream や文字列を同時に書き換えないようにする
+    code_entry_claim(seen, stream, i, "stream");
+    if (!NIL_P(e->src)) { code_entry_claim(seen, e->src, i, "string"); }
+    code_entry_claim(seen, e->dest, i, "string");
+    e->maxdest = NUM2SIZET(RARRAY_AREF(entry, 3));
+    e->call.action = NUM2INT(RARRAY_AREF(entry, 4));
+
+    return aux_lzma_code_first_p(e->call.stream);
+}
+
+/*
+ * LZMA::Stream.code_all の本体。各ストリームは処理中として印を付けてある。
+ */
+static VALUE
+code_all_body(VALUE arg)
+{
+    struct code_batch *batch = (struct code_batch *)arg;
+    size_t num = batch->num;
+
+    for (;;) {
+        size_t work = 0;
+        for (size_t i = 0; i < num; i ++) {
+            struct code_entry *e = &batch->entries[i];
+            if (e->done) { continue; }
+            code_setup(e->call.stream, e->src, e->dest, e->maxdest);
+            e->call.started = 0;
+            work += aux_lzma_code_work(e->call.stream);
+        }
+
+        int force = batch->first || (batch->threads != 1 && num > 1);
+        int hold = extlzma_gvl_hold_p(EXTLZMA_GVL_CODE, work, force);
+        for (size_t i = 0; i < num; i ++) {
+            struct code_entry *e = &batch->entries[i];
+            e->call.out_budget = (hold ? aux_lzma_code_out_budget(e->call.stream) : 0);
+        }
+
+        aux_thread_call_with_policy_ubf(EXTLZMA_GVL_CODE, work, force,
+                                        code_cancel, &batch->cancel,
+                                        code_batch_nogvl, batch, batch->threads);
+
+        int interrupted = 0;
+        struct code_entry *exceeded = NULL;
+        for (size_t i = 0; i < num; i ++) {
+            struct code_entry *e = &batch->entries[i];
+            if (e->done) { continue; }
+            code_settle(e->call.stream, e->src, e->dest, e->maxdest);
+            if (e->call.started && e->call.exceeded && !exceeded) {
+                exceeded = e;
+            }
+            if (!e->call.started || e->call.interrupted) {
+                interrupted = 1;
+            } else {
+                e->done = 1;
+            }
+        }
+
+        if (exceeded) {
+            code_raise_exceeded(exceeded->call.stream, exceeded->call.exceeded);
+        }
+
+        if (!interrupted) { break; }
+
+        rb_thread_check_ints();
+        batch->cancel = 0;
+    }
+
+    VALUE result = rb_ary_new_capa(num);
+    for (size_t i = 0; i < num; i ++) {
+        rb_ary_push(result, UINT2NUM(batch->entries[i].call.status));
+    }
+
+    return result;
+}
+
+static VALUE
+code_all_leave(VALUE arg)
+{
+    struct code_batch *batch = (struct code_batch *)arg;
+    for (size_t i = 0; i < batch->num; i ++) {
+        stream_ext(batch->entries[i].call.stream)->busy --;
+    }
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *  LZMA::Stream.code_all([[stream, src, dest, maxdest, action], ...], threads: 1) -> [status, ...]
+ *
+ * 複数のストリームに対する LZMA::Stream#code を、一度の GVL の解放でまとめて行います。
+ *
+ * 各要素の意味と src / dest の扱いは LZMA::Stream#code と同じです。
+ * 同じストリームや、同じ文字列 (src と dest を含みます) を複数回与えることは出来ません。
+ *
+ * [RETURN]
+ *      各要素に対する +lzma_code+ の戻り値を配列として返します。
+ *
+ * [threads]
+ *      1 より大きい値を与えると、複数のスレッドで並行して処理します。0 を与えると CPU の数となります。
+ */
+static VALUE
+stream_s_code_all(int argc, VALUE argv[], VALUE mod)
+{
+    VALUE ary, opts;
+    rb_scan_args(argc, argv, "1:", &ary, &opts);
+    ary = rb_ary_dup(rb_convert_type(ary, RUBY_T_ARRAY, "Array", "to_ary"));
+
+    int threads = 1;
+    if (!NIL_P(opts)) {
+        VALUE v = rb_hash_lookup(opts, ID2SYM(rb_intern("threads")));
+        if (!NIL_P(v)) {
+            threads = NUM2INT(v);
+            if (threads < 0) { rb_raise(rb_eArgError, "wrong threads (%d for 0..)", threads); }
+            if (threads > EXTLZMA_THREADS_MAX) { threads = EXTLZMA_THREADS_MAX; }
+        }
+    }
+
+    size_t num = RARRAY_LEN(ary);
+    VALUE tmp;
+    struct code_batch batch = { ALLOCV_N(struct code_entry, tmp, num + 1), num, threads, 0, 0 };
+
+    VALUE seen = rb_hash_new();
+    rb_funcall(seen, rb_intern("compare_by_identity"), 0);
+    for (size_t i = 0; i < num; i ++) {
+        batch.first |= code_entry_scan(&batch.entries[i], ary, i, seen, &batch.cancel);
+    }
+
+    for (size_t i = 0; i < num; i ++) {
+        struct code_entry *e = &batch.entries[i];
+        rb_str_modify(e->dest);
+        rb_str_set_len(e->dest, 0);
+        stream_busy_enter(e->call.stream);
+    }
+
+    VALUE result = rb_ensure(code_all_body, (VALUE)&batch, code_all_leave, (VALUE)&batch);
+
+    ALLOCV_END(tmp);
+    RB_GC_GUARD(ary);
+
+    return result;
 }
 
-static inline void
-stream_cleanup(void *pp)
+/*
+ * call-seq:
+ *  max_output = size
+ *
+ * 出力 (伸張器であれば伸張されたデータ) の合計の最大バイト数を設定します。+nil+ を与えると制限しません。
+ *
+ * 制限を超えた時点で、+lzma_code+ を呼び出している途中であっても処理を止め、
+ * LZMA::OutputLimitError 例外が発生します。
+ *
+ * 小さな入力から極端に大きなデータが伸張される (いわゆる展開爆弾) ことを防ぐために用います。
+ * +memlimit+ は作業メモリ量のみを制限し、出力は制限しません。
+ */
+static VALUE
+stream_set_max_output(VALUE stream, VALUE size)
 {
-    if (pp) {
-        lzma_stream *p = (lzma_stream *)pp;
-        lzma_end(p);
-        free(p);
-    }
+    stream_ext(getstream(stream))->max_output = NIL_P(size) ? 0 : NUM2ULL(size);
+    return size;
 }
 
-static void
-stream_mark(void *p)
+static VALUE
+stream_get_max_output(VALUE stream)
 {
+    uint64_t n = stream_ext(getstream(stream))->max_output;
+    return n ? ULL2NUM(n) : Qnil;
 }
 
+/*
+ * call-seq:
+ *  max_ratio = ratio
+ *
+ * 入力に対する出力の比 (total_out / total_in) の最大値を設定します。+nil+ を与えると制限しません。
+ *
+ * 比は出力が 1 MiB を超えてから確認されます。制限を超えた場合は LZMA::OutputLimitError 例外が発生します。
+ */
 static VALUE
-stream_alloc(VALUE klass)
+stream_set_max_ratio(VALUE stream, VALUE ratio)
 {
-    lzma_stream *p;
-    VALUE obj = Data_Make_Struct(klass, lzma_stream, stream_mark, stream_cleanup, p);
-    stream_clear(p);
-    return obj;
+    double n = NIL_P(ratio) ? 0 : NUM2DBL(ratio);
+    if (n < 0) { rb_raise(rb_eArgError, "negative ratio - %g", n); }
+    stream_ext(getstream(stream))->max_ratio = n;
+    return ratio;
 }
 
 static VALUE
-aux_str_reserve(VALUE str, size_t size)
+stream_get_max_ratio(VALUE stream)
 {
-    size_t capa = rb_str_capacity(str);
-    if (capa < size) {
-        rb_str_modify_expand(str, size - RSTRING_LEN(str));
-    } else {
-        rb_str_modify(str);
-    }
-
-    return str;
+    double n = stream_ext(getstream(stream))->max_ratio;
+    return n > 0 ? DBL2NUM(n) : Qnil;
 }
 
-static inline void *
-aux_lzma_code_nogvl(va_list *p)
+/*
+ * call-seq:
+ *  total_in -> integer
+ *
+ * これまでに処理された入力の合計バイト数を返します。
+ */
+static VALUE
+stream_total_in(VALUE stream)
 {
-    lzma_stream *stream = va_arg(*p, lzma_stream *);
-    lzma_action sync = va_arg(*p, lzma_action);
-    return (void *)lzma_code(stream, sync);
+    return ULL2NUM(getstream(stream)->total_in);
 }
 
-static inline lzma_ret
-aux_lzma_code(lzma_stream *stream, lzma_action sync)
+/*
+ * call-seq:
+ *  total_out -> integer
+ *
+ * これまでに出力された合計バイト数を返します。
+ */
+static VALUE
+stream_total_out(VALUE stream)
 {
-    return (lzma_ret)aux_thread_call_without_gvl(aux_lzma_code_nogvl, stream, sync);
+    return ULL2NUM(getstream(stream)->total_out);
 }
 
 /*
  * call-seq:
- *  code(src, dest, maxdest, action) -> status
+ *  dictsize -> integer or nil
  *
- * +lzma_code+ を用いて、圧縮/伸長処理を行います。
+ * 圧縮器が実際に用いている LZMA1/LZMA2 の辞書の大きさを返します。
+ * 圧縮器の生成時に size_hint を与えた場合は、フィルタに設定した値より小さくなることがあります。
  *
- * [RETURN]
- *      +lzma_code+ が返す整数値をそのまま返します。
+ * 伸張器や、LZMA1/LZMA2 フィルタを用いない場合は +nil+ を返します。
+ */
+static VALUE
+stream_dictsize(VALUE stream)
+{
+    uint32_t n = stream_ext(getstream(stream))->dictsize;
+    return n ? UINT2NUM(n) : Qnil;
+}
+
+/*
+ * call-seq:
+ *  memusage -> integer
  *
- * [src]
- *      処理前のバイナリデータが格納された文字列オブジェクトを与えます。
+ * ストリームが現在用いている作業メモリ量をバイト数で返します。
  *
- *      このオブジェクトは変更されます。
+ * liblzma は最初に処理を行うまで作業メモリを確保しないため、
+ * まだ処理を行っていない圧縮器は、フィルタの設定から見積もった作業メモリ量を返します。
+ */
+static VALUE
+stream_memusage(VALUE stream)
+{
+    lzma_stream *p = getstream(stream);
+    uint64_t n = lzma_memusage(p);
+    return ULL2NUM(n > 0 ? n : stream_ext(p)->memusage);
+}
+
+/*
+ * call-seq:
+ *  end -> nil
+ *  close -> nil
  *
- *      処理された部分が取り除かれます (処理されなかった部分が残ります)。
+ * lzma_end を呼び出して、ストリームが用いている作業メモリを直ちに解放します。
  *
- * [dest]
- *      処理後のバイナリデータを格納する文字列オブジェクトを与えます。
+ * 以降のこのストリームに対する LZMA::Stream#code などは IOError 例外が発生します。
+ * すでに解放済みの場合は何もしません。
  *
- * [maxdest]
- *      dest の最大処理バイト数を与えます。
+ * 圧縮器の場合、残りのデータは書き出されません。
+ * 先に LZMA::FINISH を与えて LZMA::STREAM_END まで処理して下さい。
  *
- * [action]
- *      +lzma_code+ の +action+ 引数に渡される整数値です。
+ * 他のスレッドや LZMA::Stream#feed のブロックの中など、このストリームの
+ * LZMA::Stream#code / LZMA::Stream#feed / LZMA::Stream.code_all の処理中に呼ぶと IOError 例外が発生します。
  */
 static VALUE
-stream_code(VALUE stream, VALUE src, VALUE dest, VALUE maxdest, VALUE action)
+stream_end(VALUE stream)
 {
     lzma_stream *p = getstream(stream);
+    struct stream *st = stream_ext(p);
 
-    if (NIL_P(src)) {
-        p->next_in = NULL;
-        p->avail_in = 0;
-    } else {
-        rb_check_type(src, RUBY_T_STRING);
-        rb_str_modify(src);
-        p->next_in = (uint8_t *)RSTRING_PTR(src);
-        p->avail_in = RSTRING_LEN(src);
+    if (st->busy) {
+        rb_raise(rb_eIOError, "stream in use - #<%s:%p>", rb_obj_classname(stream), (void *)stream);
     }
 
-    size_t maxdestn = NUM2SIZET(maxdest);
-    rb_check_type(dest, RUBY_T_STRING);
-    aux_str_reserve(dest, maxdestn);
-    p->next_out = (uint8_t *)RSTRING_PTR(dest);
-    p->avail_out = maxdestn;
-
-    lzma_action act = NUM2INT(action);
-
-    lzma_ret s = aux_lzma_code(p, act);
-
-    if (p->next_in) {
-        size_t srcrest = p->avail_in;
-        memmove(RSTRING_PTR(src), p->next_in, srcrest);
-        rb_str_set_len(src, srcrest);
+    if (!st->closed) {
+        lzma_end(p);
+        xfree(st->block);
+        xfree(st->rsync);
+        st->block = NULL;
+        st->rsync = NULL;
+        st->memusage = 0;
+        st->closed = 1;
     }
 
-    rb_str_set_len(dest, maxdestn - p->avail_out);
+    return Qnil;
+}
 
-    return UINT2NUM(s);
+/*
+ * call-seq:
+ *  closed? -> true or false
+ *
+ * LZMA::Stream#end によって作業メモリが解放されていれば真を返します。
+ */
+static VALUE
+stream_closed_p(VALUE stream)
+{
+    return stream_ext(getstream(stream))->closed ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *  warn_unfinished = flag
+ *
+ * 真を与えると、LZMA::STREAM_END に達せず、LZMA::Stream#end も呼ばれないまま
+ * GC に回収された場合に、標準エラー出力へ警告を書き込むようになります。
+ *
+ * LZMA::Encoder が内部で用いるためのメソッドです。
+ */
+static VALUE
+stream_set_warn_unfinished(VALUE stream, VALUE flag)
+{
+    stream_ext(getstream(stream))->warn_unfinished = RTEST(flag);
+    return flag;
 }
 
 // filter は LZMA::Filter クラスのインスタンスを与えることができる
@@ -206,31 +1165,131 @@ conv_checkmethod(VALUE check)
     }
 }
 
-static inline void
-ext_encoder_init_scanargs(VALUE encoder, int argc, VALUE argv[], lzma_filter filterpack[LZMA_FILTERS_MAX + 1], uint32_t *check)
+static inline int
+filter_lzma_p(const lzma_filter *filter)
 {
-    if (check) {
-        VALUE tmp;
-        rb_scan_args(argc, argv, "13:", NULL, NULL, NULL, NULL, &tmp);
-        if (NIL_P(tmp)) {
-            *check = LZMA_CHECK_CRC64;
-        } else {
-            *check = conv_checkmethod(tmp);
-            argc --;
+    return ((filter->id == LZMA_FILTER_LZMA1 || filter->id == LZMA_FILTER_LZMA2) && filter->options);
+}
+
+/*
+ * 入力の大きさ (size_hint) が分かっている場合に、LZMA1/LZMA2 の辞書を入力を収めるのに十分な大きさまで縮める。
+ *
+ * liblzma はマッチファインダのハッシュ表の大きさを辞書の大きさから決めるため、
+ * 作業メモリ量と初期化にかかる時間がともに小さくなる。
+ * 入力がすべて辞書に収まるため、圧縮率は変わらない。
+ *
+ * LZMA::Filter の設定は変更せず、optpack に複写したものを filterpack から参照させる。
+ */
+void
+extlzma_filter_clamp_dictsize(lzma_filter filterpack[LZMA_FILTERS_MAX + 1], lzma_options_lzma optpack[LZMA_FILTERS_MAX], uint64_t size_hint)
+{
+    for (; filterpack->id != LZMA_VLI_UNKNOWN; filterpack ++, optpack ++) {
+        if (!filter_lzma_p(filterpack)) { continue; }
+
+        const lzma_options_lzma *opts = filterpack->options;
+        // 加算があふれる場合は飽和させる (いずれにせよ辞書は縮められない)
+        uint64_t need = size_hint + opts->preset_dict_size;
+        if (need < size_hint) { need = UINT64_MAX; }
+        // dict は opts->dict_size (uint32_t) に達した時点で止めるため、あふれることはない
+        uint64_t dict = LZMA_DICT_SIZE_MIN;
+        while (dict < need && dict < opts->dict_size) { dict <<= 1; }
+        if (dict >= opts->dict_size) { continue; }
+
+        memcpy(optpack, opts, sizeof(*optpack));
+        optpack->dict_size = (uint32_t)dict;
+        filterpack->options = optpack;
+    }
+}
+
+static uint32_t
+filter_dictsize(const lzma_filter *filterpack)
+{
+    uint32_t dictsize = 0;
+    for (; filterpack->id != LZMA_VLI_UNKNOWN; filterpack ++) {
+        if (filter_lzma_p(filterpack)) {
+            dictsize = ((const lzma_options_lzma *)filterpack->options)->dict_size;
         }
+    }
+    return dictsize;
+}
+
+/*
+ * optpack が NULL でなければ圧縮器として扱い、size_hint を受け付ける。
+ *
+ * キーワード引数のハッシュを返す (与えられなかった場合は nil)。
+ */
+static inline VALUE
+ext_encoder_init_scanargs(VALUE encoder, int argc, VALUE argv[], lzma_filter filterpack[LZMA_FILTERS_MAX + 1], lzma_options_lzma optpack[LZMA_FILTERS_MAX], uint32_t *check)
+{
+    VALUE opts = Qnil;
+    if (optpack) {
+        rb_scan_args(argc, argv, "13:", NULL, NULL, NULL, NULL, &opts);
+        if (!NIL_P(opts)) { argc --; }
     } else {
         rb_scan_args(argc, argv, "13", NULL, NULL, NULL, NULL);
     }
+    if (check) {
+        *check = NIL_P(opts) ? LZMA_CHECK_CRC64 : conv_checkmethod(opts);
+    }
     memset(filterpack, 0, sizeof(lzma_filter[LZMA_FILTERS_MAX + 1]));
     filter_setup(filterpack, argv, argv + argc, encoder);
+
+    if (optpack) {
+        VALUE size_hint = NIL_P(opts) ? Qnil : rb_hash_lookup(opts, ID2SYM(id_size_hint));
+        if (!NIL_P(size_hint)) {
+            extlzma_filter_clamp_dictsize(filterpack, optpack, NUM2ULL(size_hint));
+        }
+        struct stream *st = stream_ext(getstream(encoder));
+        uint64_t memusage = lzma_raw_encoder_memusage(filterpack);
+        st->dictsize = filter_dictsize(filterpack);
+        st->memusage = (memusage == UINT64_MAX ? 0 : memusage);
+    }
+
+    return opts;
+}
+
+/*
+ * stream__init プローブ。filters は圧縮器であればフィルタの連鎖を、伸張器であれば NULL を与える。
+ */
+static inline void
+stream_probe_init(VALUE stream, const lzma_filter *filters)
+{
+#ifdef EXTLZMA_USDT
+    lzma_stream *p = getstream(stream);
+    uint64_t memusage = lzma_memusage(p);
+    EXTLZMA_PROBE5(stream__init, p, rb_obj_classname(stream),
+                   (filters ? (uint64_t)filters[0].id : (uint64_t)LZMA_VLI_UNKNOWN),
+                   (filters ? (uint64_t)filters[1].id : (uint64_t)LZMA_VLI_UNKNOWN),
+                   (memusage > 0 ? memusage : stream_ext(p)->memusage));
+#endif
+}
+
+/*
+ * キーワード引数 rsyncable を解釈する。真であれば RSYNC_AVERAGE、整数であればそれを区切りの平均の間隔とする。
+ */
+static void
+encoder_setup_rsyncable(VALUE stream, VALUE opts, lzma_action flush)
+{
+    VALUE v = NIL_P(opts) ? Qnil : rb_hash_lookup(opts, ID2SYM(id_rsyncable));
+    if (!RTEST(v)) { return; }
+
+    uint64_t average = (v == Qtrue ? RSYNC_AVERAGE : NUM2ULL(v));
+    if (average < RSYNC_AVERAGE_MIN) {
+        rb_raise(rb_eArgError,
+                 "rsyncable interval too small (%" PRIu64 " for %d..)", average, RSYNC_AVERAGE_MIN);
+    }
+
+    struct stream *st = stream_ext(getstream(stream));
+    if (!st->rsync) { st->rsync = ALLOC(struct extlzma_rsync); }
+    extlzma_rsync_setup(st->rsync, average, flush);
 }
 
 /*
  * call-seq:
- *  initialize(filter1, check: CHECK_CRC64) -> encoder
- *  initialize(filter1, filter2, check: CHECK_CRC64) -> encoder
- *  initialize(filter1, filter2, filter3, check: CHECK_CRC64) -> encoder
- *  initialize(filter1, filter2, filter3, filter4, check: CHECK_CRC64) -> encoder
+ *  initialize(filter1, check: CHECK_CRC64, size_hint: nil, rsyncable: false) -> encoder
+ *  initialize(filter1, filter2, check: CHECK_CRC64, size_hint: nil, rsyncable: false) -> encoder
+ *  initialize(filter1, filter2, filter3, check: CHECK_CRC64, size_hint: nil, rsyncable: false) -> encoder
+ *  initialize(filter1, filter2, filter3, filter4, check: CHECK_CRC64, size_hint: nil, rsyncable: false) -> encoder
  *
  * 圧縮器を生成します。圧縮されたデータストリームは xz ファイルフォーマットです。
  *
@@ -245,6 +1304,24 @@ ext_encoder_init_scanargs(VALUE encoder, int argc, VALUE argv[], lzma_filter fil
  *
  *  CHECK_NONE CHECK_CRC32 CHECK_CRC64 CHECK_SHA256 のいずれかの定数を与えます。
  *
+ * [size_hint]
+ *  圧縮するデータの合計の大きさが分かっている場合にバイト数で与えます。
+ *
+ *  LZMA1/LZMA2 フィルタの辞書の大きさがこれを超える場合は、データを収めるのに十分な大きさまで縮めて圧縮します。
+ *  圧縮率はほぼ変わらずに、作業メモリ量と初期化にかかる時間を減らすことが出来ます。
+ *  与えたフィルタの設定は変更されません。実際に用いられる辞書の大きさは LZMA::Stream#dictsize で確認できます。
+ *
+ *  size_hint を超えるデータを与えることも出来ますが、圧縮率が低下することがあります。
+ *
+ * [rsyncable]
+ *  真を与えると、入力の内容から決まる位置 (平均 1 MiB ごと) でブロックを閉じます。整数を与えると、それを平均の間隔とします。
+ *
+ *  各ブロックはそれ以前の内容に依存せずに圧縮されるため、一部を変更したデータを圧縮しなおしても、
+ *  変更した位置の前後以外のブロックは同じバイト列となります。rsync や重複排除による転送量を減らすことが出来ます。
+ *  ブロックごとに辞書が初期化されるため、圧縮率はわずかに低下します。
+ *
+ *  区切りは LZMA::Stream#feed (LZMA::Encoder#write などが用います) に与えた入力に対してのみ決められます。
+ *
  * [EXCEPTIONS]
  *      (NO DOCUMENTS)
  */
@@ -255,37 +1332,37 @@ encoder_init(int argc, VALUE argv[], VALUE stream)
 
     uint32_t check;
     lzma_filter filterpack[LZMA_FILTERS_MAX + 1];
-    ext_encoder_init_scanargs(stream, argc, argv, filterpack, &check);
+    lzma_options_lzma optpack[LZMA_FILTERS_MAX];
+    VALUE opts = ext_encoder_init_scanargs(stream, argc, argv, filterpack, optpack, &check);
 
     AUX_LZMA_TEST(RETRY_NOMEM(2, lzma_stream_encoder(p, filterpack, check)));
+    stream_probe_init(stream, filterpack);
+    encoder_setup_rsyncable(stream, opts, LZMA_FULL_FLUSH);
 
     return stream;
 }
 
-static inline void
-ext_decoder_init_scanargs(int argc, VALUE argv[], uint64_t *memlimit, uint32_t *flags)
+static inline VALUE
+ext_decoder_init_scanargs(VALUE stream, int argc, VALUE argv[], uint64_t *memlimit, uint32_t *flags)
 {
-    switch (argc) {
-    case 0:
-        *memlimit = UINT64_MAX;
-        *flags = 0;
-        return;
-    case 1:
-        *memlimit = NIL_P(argv[0]) ? UINT64_MAX : NUM2SIZET(argv[0]);
-        *flags = 0;
-        return;
-    case 2:
-        *memlimit = NIL_P(argv[0]) ? UINT64_MAX : NUM2SIZET(argv[0]);
-        *flags = NIL_P(argv[1]) ? 0 : (uint32_t)NUM2UINT(argv[1]);
-        return;
+    VALUE vmemlimit, vflags, opts;
+    rb_scan_args(argc, argv, "02:", &vmemlimit, &vflags, &opts);
+    *memlimit = NIL_P(vmemlimit) ? UINT64_MAX : NUM2SIZET(vmemlimit);
+    *flags = NIL_P(vflags) ? 0 : (uint32_t)NUM2UINT(vflags);
+
+    if (!NIL_P(opts)) {
+        VALUE max_output = rb_hash_lookup(opts, ID2SYM(id_max_output));
+        VALUE max_ratio = rb_hash_lookup(opts, ID2SYM(id_max_ratio));
+        if (!NIL_P(max_output)) { stream_set_max_output(stream, max_output); }
+        if (!NIL_P(max_ratio)) { stream_set_max_ratio(stream, max_ratio); }
     }
 
-    rb_error_arity(argc, 0, 2);
+    return opts;
 }
 
 /*
  * call-seq:
- *  initialize(memlimit = nil, flags = 0)
+ *  initialize(memlimit = nil, flags = 0, max_output: nil, max_ratio: nil)
  *
  * [RETURN]
  *      伸張器を返します。
@@ -293,6 +1370,12 @@ ext_decoder_init_scanargs(int argc, VALUE argv[], uint64_t *memlimit, uint32_t *
  * [memlimit]
  *      作業メモリ量の最大値を指定します。単位はバイトです。
  *
+ * [max_output]
+ *      伸張されるデータの最大バイト数を指定します。LZMA::Stream#max_output= を見て下さい。
+ *
+ * [max_ratio]
+ *      伸張されるデータと入力の比の最大値を指定します。LZMA::Stream#max_ratio= を見て下さい。
+ *
  * [flags]
  *      伸張器の挙動を変更するための整数値を指定します。定数として次のものが利用できます。
  *
@@ -309,16 +1392,17 @@ autodecoder_init(int argc, VALUE argv[], VALUE stream)
     lzma_stream *p = getstream(stream);
     uint64_t memlimit;
     uint32_t flags;
-    ext_decoder_init_scanargs(argc, argv, &memlimit, &flags);
+    ext_decoder_init_scanargs(stream, argc, argv, &memlimit, &flags);
 
     AUX_LZMA_TEST(RETRY_NOMEM(2, lzma_auto_decoder(p, memlimit, flags)));
+    stream_probe_init(stream, NULL);
 
     return stream;
 }
 
 /*
  * call-seq:
- *  initialize(memlimit = nil, flags = 0)
+ *  initialize(memlimit = nil, flags = 0, max_output: nil, max_ratio: nil)
  *
  * xz ストリームの伸張器を返します。
  *
@@ -331,19 +1415,20 @@ decoder_init(int argc, VALUE argv[], VALUE stream)
 
     uint64_t memlimit;
     uint32_t flags;
-    ext_decoder_init_scanargs(argc, argv, &memlimit, &flags);
+    ext_decoder_init_scanargs(stream, argc, argv, &memlimit, &flags);
 
     AUX_LZMA_TEST(RETRY_NOMEM(2, lzma_stream_decoder(p, memlimit, flags)));
+    stream_probe_init(stream, NULL);
 
     return stream;
 }
 
 /*
  * call-seq:
- *  initialize(filter1) -> encoder
- *  initialize(filter1, filter2) -> encoder
- *  initialize(filter1, filter2, filter3) -> encoder
- *  initialize(filter1, filter2, filter3, filter4) -> encoder
+ *  initialize(filter1, size_hint: nil) -> encoder
+ *  initialize(filter1, filter2, size_hint: nil) -> encoder
+ *  initialize(filter1, filter2, filter3, size_hint: nil) -> encoder
+ *  initialize(filter1, filter2, filter3, filter4, size_hint: nil) -> encoder
  *
  * 生の (xzヘッダなどの付かない) LZMA1/LZMA2ストリームを構成する圧縮器を生成します。
  *
@@ -354,6 +1439,11 @@ decoder_init(int argc, VALUE argv[], VALUE stream)
  *      Filter インスタンスを与えます。
  *
  *      Filter インスタンスは、例えば LZMA2 フィルタを生成する場合 Filter.lzma2 を利用します。
+ *
+ * [size_hint]
+ *      LZMA::Stream::Encoder#initialize と同じです。
+ *
+ *      辞書が縮められた場合でも、伸張する際は元のフィルタを与えることが出来ます。
  */
 static VALUE
 rawencoder_init(int argc, VALUE argv[], VALUE stream)
@@ -361,9 +1451,11 @@ rawencoder_init(int argc, VALUE argv[], VALUE stream)
     lzma_stream *p = getstream(stream);
 
     lzma_filter filterpack[LZMA_FILTERS_MAX + 1];
-    ext_encoder_init_scanargs(stream, argc, argv, filterpack, NULL);
+    lzma_options_lzma optpack[LZMA_FILTERS_MAX];
+    ext_encoder_init_scanargs(stream, argc, argv, filterpack, optpack, NULL);
 
     AUX_LZMA_TEST(RETRY_NOMEM(2, lzma_raw_encoder(p, filterpack)));
+    stream_probe_init(stream, filterpack);
 
     return stream;
 }
@@ -381,9 +1473,197 @@ rawdecoder_init(int argc, VALUE argv[], VALUE stream)
     lzma_stream *p = getstream(stream);
 
     lzma_filter filterpack[LZMA_FILTERS_MAX + 1];
-    ext_encoder_init_scanargs(stream, argc, argv, filterpack, NULL);
+    ext_encoder_init_scanargs(stream, argc, argv, filterpack, NULL, NULL);
 
     AUX_LZMA_TEST(RETRY_NOMEM(2, lzma_raw_decoder(p, filterpack)));
+    stream_probe_init(stream, filterpack);
+
+    return stream;
+}
+
+#if defined(HAVE_LZMA_STREAM_ENCODER_MT) || defined(HAVE_LZMA_STREAM_DECODER_MT)
+/*
+ * キーワード引数 threads を解釈する。0 (省略時) は CPU の数とする。
+ */
+static uint32_t
+conv_threads(VALUE opts)
+{
+    VALUE v = NIL_P(opts) ? Qnil : rb_hash_lookup(opts, ID2SYM(id_threads));
+    int threads = NIL_P(v) ? 0 : NUM2INT(v);
+    if (threads < 0) { rb_raise(rb_eArgError, "wrong threads (%d for 0..)", threads); }
+    if (threads == 0) { threads = extlzma_cpu_threads(); }
+    if (threads > EXTLZMA_THREADS_MAX) { threads = EXTLZMA_THREADS_MAX; }
+    return (uint32_t)threads;
+}
+#endif
+
+#ifdef HAVE_LZMA_STREAM_ENCODER_MT
+/*
+ * call-seq:
+ *  initialize(filter1, ..., check: CHECK_CRC64, threads: 0, block_size: 0, size_hint: nil, rsyncable: false) -> encoder
+ *
+ * 複数のスレッドで圧縮する xz ストリームの圧縮器を生成します。
+ *
+ * 入力をブロックに分けて並列に圧縮します。各ブロックのヘッダには圧縮後と伸張後の大きさが記録されるため、
+ * LZMA::Stream::MTDecoder で並列に伸張することが出来ます。
+ *
+ * [filter1, check, size_hint, rsyncable]
+ *      LZMA::Stream::Encoder#initialize と同じです。
+ * [threads]
+ *      圧縮に用いるスレッドの数です。0 の場合は CPU の数となります。
+ * [block_size]
+ *      ブロックの大きさ (伸張後のバイト数) です。0 の場合は LZMA2 の辞書の大きさの 3 倍 (最低 1 MiB) となります。
+ */
+static VALUE
+mtencoder_init(int argc, VALUE argv[], VALUE stream)
+{
+    lzma_stream *p = getstream(stream);
+
+    uint32_t check;
+    lzma_filter filterpack[LZMA_FILTERS_MAX + 1];
+    lzma_options_lzma optpack[LZMA_FILTERS_MAX];
+    VALUE opts = ext_encoder_init_scanargs(stream, argc, argv, filterpack, optpack, &check);
+
+    lzma_mt mt = { 0 };
+    mt.threads = conv_threads(opts);
+    mt.filters = filterpack;
+    mt.check = check;
+    VALUE block_size = NIL_P(opts) ? Qnil : rb_hash_lookup(opts, ID2SYM(id_block_size));
+    if (!NIL_P(block_size)) { mt.block_size = NUM2ULL(block_size); }
+
+    uint64_t memusage = lzma_stream_encoder_mt_memusage(&mt);
+    stream_ext(p)->memusage = (memusage == UINT64_MAX ? 0 : memusage);
+
+    AUX_LZMA_TEST(RETRY_NOMEM(2, lzma_stream_encoder_mt(p, &mt)));
+    stream_probe_init(stream, filterpack);
+    // LZMA_FULL_FLUSH はすべてのスレッドの終了を待つため、並列性を損なわない LZMA_FULL_BARRIER を用いる
+    encoder_setup_rsyncable(stream, opts, LZMA_FULL_BARRIER);
+
+    return stream;
+}
+#endif /* HAVE_LZMA_STREAM_ENCODER_MT */
+
+#ifdef HAVE_LZMA_STREAM_DECODER_MT
+/*
+ * call-seq:
+ *  initialize(memlimit = nil, flags = 0, threads: 0, memlimit_threading: nil, max_output: nil, max_ratio: nil)
+ *
+ * 複数のスレッドで伸張する xz ストリームの伸張器を生成します。
+ *
+ * 入力を先読みしてブロックヘッダを解析し、圧縮後の大きさが記録されたブロックを各スレッドに割り当てて伸張します。
+ * 出力は元の順序に並べ直されるため、LZMA::Stream::Decoder と同じ結果となります。
+ * 入力を先頭から順に読むだけであるため、パイプやソケットからの入力にも用いることが出来ます。
+ *
+ * LZMA::Stream::MTEncoder や xz -T で圧縮したデータは、ブロックヘッダに大きさが記録されています。
+ * 大きさが記録されていないブロック (LZMA::Stream::Encoder で圧縮した場合など) は一つのスレッドで伸張します。
+ *
+ * [memlimit, flags, max_output, max_ratio]
+ *      LZMA::Stream::AutoDecoder#initialize と同じです。
+ *      memlimit を超える場合は LZMA::MemLimitError 例外が発生します。
+ * [threads]
+ *      伸張に用いるスレッドの数です。0 の場合は CPU の数となります。
+ * [memlimit_threading]
+ *      並列に伸張するために用いてよい作業メモリ量 (先読みした入力と出力の保持を含みます) の最大値です。
+ *      これを超える場合は、スレッドの数を減らすか一つのスレッドで伸張します。
+ *      省略した場合は物理メモリ量の 1/4 となります。
+ */
+static VALUE
+mtdecoder_init(int argc, VALUE argv[], VALUE stream)
+{
+    lzma_stream *p = getstream(stream);
+
+    uint64_t memlimit;
+    uint32_t flags;
+    VALUE opts = ext_decoder_init_scanargs(stream, argc, argv, &memlimit, &flags);
+
+    lzma_mt mt = { 0 };
+    mt.flags = flags;
+    mt.threads = conv_threads(opts);
+    mt.memlimit_stop = memlimit;
+    VALUE limit = NIL_P(opts) ? Qnil : rb_hash_lookup(opts, ID2SYM(id_memlimit_threading));
+    mt.memlimit_threading = NIL_P(limit) ? lzma_physmem() / 4 : NUM2ULL(limit);
+    if (mt.memlimit_threading > memlimit) { mt.memlimit_threading = memlimit; }
+
+    AUX_LZMA_TEST(RETRY_NOMEM(2, lzma_stream_decoder_mt(p, &mt)));
+    stream_probe_init(stream, NULL);
+
+    return stream;
+}
+#endif /* HAVE_LZMA_STREAM_DECODER_MT */
+
+static void
+block_filters_free(lzma_filter filters[LZMA_FILTERS_MAX + 1])
+{
+    for (int i = 0; i < LZMA_FILTERS_MAX && filters[i].id != LZMA_VLI_UNKNOWN; i ++) {
+        free(filters[i].options);
+        filters[i].options = NULL;
+    }
+}
+
+/*
+ * call-seq:
+ *  initialize(header, check, ignore_check: false) -> decoder
+ *
+ * xz ストリームの一つのブロックを伸張する伸張器を生成します。
+ *
+ * ブロックの終わりに達すると LZMA::STREAM_END を返します。
+ * インデックスなどから得たブロックの位置へ移動して、途中から伸張を再開するために用います。
+ *
+ * [header]
+ *      ブロックヘッダのバイト列です。大きさはブロックヘッダの先頭のバイトを b として <tt>(b + 1) * 4</tt> です。
+ *      伸張器に与えるデータはブロックヘッダの直後からとなります。
+ * [check]
+ *      ブロックを含むストリームの整合値の種類です (LZMA::Index.decode_footer などで得られます)。
+ * [ignore_check]
+ *      真を与えると、ブロックの整合値を確認しません。
+ */
+static VALUE
+blockdecoder_init(int argc, VALUE argv[], VALUE stream)
+{
+    VALUE header, check, opts;
+    rb_scan_args(argc, argv, "2:", &header, &check, &opts);
+    rb_check_type(header, RUBY_T_STRING);
+
+    struct stream *st = stream_ext(getstream(stream));
+    if (st->block) {
+        rb_raise(rb_eArgError, "already initialized");
+    }
+
+    const uint8_t *ptr = (const uint8_t *)RSTRING_PTR(header);
+    if (RSTRING_LEN(header) < 1 || ptr[0] == 0x00) {
+        rb_raise(rb_eArgError, "not a block header");
+    }
+
+    lzma_block block = { 0 };
+    lzma_filter filters[LZMA_FILTERS_MAX + 1];
+    block.version = 0;
+    block.check = (lzma_check)NUM2UINT(check);
+    block.header_size = lzma_block_header_size_decode(ptr[0]);
+    block.filters = filters;
+    if ((uint32_t)RSTRING_LEN(header) < block.header_size) {
+        rb_raise(rb_eArgError,
+                 "block header too short (%ld for %u)", (long)RSTRING_LEN(header), block.header_size);
+    }
+
+    AUX_LZMA_TEST(lzma_block_header_decode(&block, NULL, ptr));
+
+    // lzma_block_header_decode は ignore_check を偽に戻すため、その後で設定する
+    if (!NIL_P(opts) && RTEST(rb_hash_lookup(opts, ID2SYM(id_ignore_check)))) {
+        block.version = 1;
+        block.ignore_check = 1;
+    }
+
+    lzma_block *p = ALLOC(lzma_block);
+    memcpy(p, &block, sizeof(*p));
+    lzma_ret s = lzma_block_decoder(&st->stream, p);
+    block_filters_free(filters);
+    p->filters = NULL;
+    if (s != LZMA_OK) {
+        xfree(p);
+        AUX_LZMA_TEST(s);
+    }
+    st->block = p;
+    stream_probe_init(stream, NULL);
 
     return stream;
 }
@@ -391,9 +1671,32 @@ rawdecoder_init(int argc, VALUE argv[], VALUE stream)
 void
 extlzma_init_Stream(void)
 {
+    id_max_output = rb_intern("max_output");
+    id_max_ratio = rb_intern("max_ratio");
+    id_size_hint = rb_intern("size_hint");
+    id_ignore_check = rb_intern("ignore_check");
+    id_threads = rb_intern("threads");
+    id_block_size = rb_intern("block_size");
+    id_memlimit_threading = rb_intern("memlimit_threading");
+    id_rsyncable = rb_intern("rsyncable");
+
     extlzma_cStream = rb_define_class_under(extlzma_mLZMA, "Stream", rb_cObject);
     rb_undef_alloc_func(extlzma_cStream);
     rb_define_method(extlzma_cStream, "code", stream_code, 4);
+    rb_define_method(extlzma_cStream, "feed", stream_feed, 4);
+    rb_define_method(extlzma_cStream, "max_output", stream_get_max_output, 0);
+    rb_define_method(extlzma_cStream, "max_output=", stream_set_max_output, 1);
+    rb_define_method(extlzma_cStream, "max_ratio", stream_get_max_ratio, 0);
+    rb_define_method(extlzma_cStream, "max_ratio=", stream_set_max_ratio, 1);
+    rb_define_method(extlzma_cStream, "total_in", stream_total_in, 0);
+    rb_define_method(extlzma_cStream, "total_out", stream_total_out, 0);
+    rb_define_method(extlzma_cStream, "dictsize", stream_dictsize, 0);
+    rb_define_method(extlzma_cStream, "memusage", stream_memusage, 0);
+    rb_define_method(extlzma_cStream, "end", stream_end, 0);
+    rb_define_alias(extlzma_cStream, "close", "end");
+    rb_define_method(extlzma_cStream, "closed?", stream_closed_p, 0);
+    rb_define_private_method(extlzma_cStream, "warn_unfinished=", stream_set_warn_unfinished, 1);
+    rb_define_singleton_method(extlzma_cStream, "code_all", RUBY_METHOD_FUNC(stream_s_code_all), -1);
 
     cEncoder = rb_define_class_under(extlzma_cStream, "Encoder", extlzma_cStream);
     rb_define_alloc_func(cEncoder, stream_alloc);
@@ -427,4 +1730,20 @@ extlzma_init_Stream(void)
     rb_define_alias(cDecoder, "decode", "code");
     rb_define_alias(cDecoder, "decompress", "code");
     rb_define_alias(cDecoder, "uncompress", "code");
+
+    cBlockDecoder = rb_define_class_under(extlzma_cStream, "BlockDecoder", extlzma_cStream);
+    rb_define_alloc_func(cBlockDecoder, stream_alloc);
+    rb_define_method(cBlockDecoder, "initialize", RUBY_METHOD_FUNC(blockdecoder_init), -1);
+
+#ifdef HAVE_LZMA_STREAM_ENCODER_MT
+    cMTEncoder = rb_define_class_under(extlzma_cStream, "MTEncoder", extlzma_cStream);
+    rb_define_alloc_func(cMTEncoder, stream_alloc);
+    rb_define_method(cMTEncoder, "initialize", RUBY_METHOD_FUNC(mtencoder_init), -1);
+#endif
+
+#ifdef HAVE_LZMA_STREAM_DECODER_MT
+    cMTDecoder = rb_define_class_under(extlzma_cStream, "MTDecoder", extlzma_cStream);
+    rb_define_alloc_func(cMTDecoder, stream_alloc);
+    rb_define_method(cMTDecoder, "initialize", RUBY_METHOD_FUNC(mtdecoder_init), -1);
+#endif
 }
@@ -0,0 +1,233 @@
+#include "extlzma.h"
+
+/*
+ * LZMA::Tuner の試し圧縮を行う部分。
+ *
+ * 候補となるフィルタの組み合わせごとに lzma_raw_buffer_encode で標本を圧縮し、
+ * 圧縮後の大きさ、処理時間、作業メモリ量を求める。候補は extlzma_parallel_run で並列に処理する。
+ *
+ * xz のヘッダや整合値は候補の間で同じであるため、生の LZMA データ列で比較する。
+ *
+ * 辞書は標本を収める大きさまで縮めて試す (圧縮率は変わらず、マッチファインダの初期化の時間が
+ * 大きなプリセットの速さを不当に低く見せることがなくなる)。
+ * 同時に試す候補の作業メモリ量の合計は mem_budget 以下に抑える。
+ */
+
+static VALUE mTuner;
+static ID id_threads;
+static ID id_max_mem;
+static ID id_mem_budget;
+
+struct tuner_entry
+{
+    lzma_filter filters[LZMA_FILTERS_MAX + 1];
+    lzma_options_lzma optpack[LZMA_FILTERS_MAX];
+    uint64_t memusage;      // 与えられた設定のままでの作業メモリ量
+    uint64_t trialmem;      // 辞書を縮めた試し圧縮での作業メモリ量
+    uint64_t elapsed;
+    size_t outsize;
+    lzma_ret status;
+    int skip;
+};
+
+struct tuner_work
+{
+    const uint8_t *ptr;
+    size_t size;
+    size_t bound;
+    uint64_t budget;
+    struct tuner_entry *entries;
+    size_t *round;          // 同時に試す候補の番号
+};
+
+static void
+tuner_measure_one(void *arg, size_t i)
+{
+    struct tuner_work *work = arg;
+    struct tuner_entry *e = &work->entries[work->round[i]];
+
+    uint8_t *out = malloc(work->bound);
+    size_t outpos = 0;
+
+    if (!out) {
+        e->status = LZMA_MEM_ERROR;
+        return;
+    }
+
+    uint64_t start = aux_clock_ns();
+    e->status = lzma_raw_buffer_encode(e->filters, NULL, work->ptr, work->size, out, &outpos, work->bound);
+    e->elapsed = aux_clock_ns() - start;
+    e->outsize = outpos;
+
+    free(out);
+}
+
+static void *
+tuner_measure_nogvl(va_list *vp)
+{
+    struct tuner_work *work = va_arg(*vp, struct tuner_work *);
+    size_t num = va_arg(*vp, size_t);
+    int threads = va_arg(*vp, int);
+
+    /*
+     * 作業メモリ量の合計が budget に収まるだけの候補を順にまとめて試す。
+     * 一つで budget を超える候補は単独で試す。
+     */
+    for (size_t i = 0; i < num; ) {
+        size_t n = 0;
+        uint64_t used = 0;
+        for (; i < num; i ++) {
+            const struct tuner_entry *e = &work->entries[i];
+            if (e->skip) { continue; }
+            uint64_t need = e->trialmem + work->bound;
+            if (n > 0 && (need > work->budget || used > work->budget - need)) { break; }
+            work->round[n ++] = i;
+            used += need;
+        }
+
+        if (n > 0) {
+            extlzma_parallel_run(n, threads, tuner_measure_one, work);
+        }
+    }
+
+    return NULL;
+}
+
+static void
+tuner_setup_filters(lzma_filter filters[LZMA_FILTERS_MAX + 1], VALUE chain)
+{
+    chain = rb_Array(chain);
+    long num = RARRAY_LEN(chain);
+
+    if (num < 1 || num > LZMA_FILTERS_MAX) {
+        rb_raise(extlzma_eFilterTooLong,
+                 "wrong filter chain length (%ld for 1..%d)", num, LZMA_FILTERS_MAX);
+    }
+
+    for (long i = 0; i < num; i ++) {
+        VALUE f = RARRAY_AREF(chain, i);
+        if (!rb_obj_is_kind_of(f, extlzma_cFilter)) {
+            rb_raise(rb_eTypeError,
+                     "not a filter - #<%s:%p>", rb_obj_classname(f), (void *)f);
+        }
+        memcpy(&filters[i], extlzma_getfilter(f), sizeof(filters[i]));
+    }
+
+    filters[num].id = LZMA_VLI_UNKNOWN;
+    filters[num].options = NULL;
+}
+
+/*
+ * call-seq:
+ *  LZMA::Tuner.measure(sample, candidates, threads: 0, max_mem: nil, mem_budget: nil) -> array
+ *
+ * candidates に含まれるフィルタの組み合わせごとに sample を圧縮し、その結果を返します。
+ *
+ * 試し圧縮は GVL を解放した状態で、ネイティブスレッドを用いて並列に行われます。
+ * LZMA1/LZMA2 の辞書は sample を収める大きさまで縮めて試します。
+ *
+ * [RETURN]
+ *      candidates と同じ順序で、<tt>[圧縮後のバイト数, 処理時間 (ナノ秒), 作業メモリ量]</tt> の配列を要素とする配列です。
+ *      作業メモリ量は辞書を縮めない、与えられた設定のままでの値です。
+ *      フィルタの組み合わせが不正などの理由で圧縮できなかった候補と、
+ *      作業メモリ量が max_mem を超える候補は +nil+ となります。
+ * [sample]
+ *      試し圧縮を行う文字列です。
+ * [candidates]
+ *      LZMA::Filter のインスタンス、またはその配列 (フィルタの連鎖) を要素とする配列です。
+ * [threads]
+ *      並列に処理するスレッドの数です。0 の場合は CPU の数となります。
+ *
+ *      スレッドの数が CPU の数を超えると、処理時間が正しく求められなくなります。
+ * [max_mem]
+ *      作業メモリ量の上限をバイト数で与えます。これを超える候補は試し圧縮を行いません。
+ * [mem_budget]
+ *      同時に試し圧縮を行う候補の作業メモリ量の合計の上限をバイト数で与えます。
+ *      既定値は物理メモリ量の 1/4 です。
+ */
+static VALUE
+tuner_s_measure(int argc, VALUE argv[], VALUE mod)
+{
+    VALUE sample, candidates, opts;
+    rb_scan_args(argc, argv, "2:", &sample, &candidates, &opts);
+    rb_check_type(sample, RUBY_T_STRING);
+    rb_check_type(candidates, RUBY_T_ARRAY);
+
+    int threads = 0;
+    uint64_t max_mem = UINT64_MAX;
+    uint64_t budget = lzma_physmem() / 4;
+    if (!NIL_P(opts)) {
+        VALUE v = rb_hash_lookup(opts, ID2SYM(id_threads));
+        if (!NIL_P(v)) { threads = NUM2INT(v); }
+        v = rb_hash_lookup(opts, ID2SYM(id_max_mem));
+        if (!NIL_P(v)) { max_mem = NUM2ULL(v); }
+        v = rb_hash_lookup(opts, ID2SYM(id_mem_budget));
+        if (!NIL_P(v)) { budget = NUM2ULL(v); }
+    }
+    if (budget == 0) { budget = UINT64_MAX; } // 物理メモリ量が分からない場合
+
+    sample = rb_str_new_frozen(sample);
+    candidates = rb_ary_dup(candidates);
+    size_t num = RARRAY_LEN(candidates);
+
+    VALUE tmp, tmpround;
+    struct tuner_entry *entries = ALLOCV_N(struct tuner_entry, tmp, num + 1);
+    for (size_t i = 0; i < num; i ++) {
+        struct tuner_entry *e = &entries[i];
+        VALUE chain = rb_Array(RARRAY_AREF(candidates, i));
+        rb_ary_store(candidates, i, chain);
+        tuner_setup_filters(e->filters, chain);
+        e->memusage = lzma_raw_encoder_memusage(e->filters);
+        extlzma_filter_clamp_dictsize(e->filters, e->optpack, RSTRING_LEN(sample));
+        e->trialmem = lzma_raw_encoder_memusage(e->filters);
+        e->status = LZMA_PROG_ERROR;
+        e->skip = (e->memusage == UINT64_MAX || e->memusage > max_mem || e->trialmem == UINT64_MAX);
+    }
+
+    struct tuner_work work = {
+        (const uint8_t *)RSTRING_PTR(sample),
+        RSTRING_LEN(sample),
+        lzma_block_buffer_bound(RSTRING_LEN(sample)),
+        budget,
+        entries,
+        ALLOCV_N(size_t, tmpround, num + 1),
+    };
+
+    if (num > 0) {
+        aux_thread_call_without_gvl(tuner_measure_nogvl, &work, num, threads);
+    }
+
+    VALUE result = rb_ary_new_capa(num);
+    for (size_t i = 0; i < num; i ++) {
+        const struct tuner_entry *e = &entries[i];
+        if (e->status == LZMA_OK) {
+            rb_ary_push(result, rb_ary_new_from_args(3,
+                        SIZET2NUM(e->outsize), ULL2NUM(e->elapsed), ULL2NUM(e->memusage)));
+        } else {
+            rb_ary_push(result, Qnil);
+        }
+    }
+
+    ALLOCV_END(tmpround);
+    ALLOCV_END(tmp);
+    RB_GC_GUARD(sample);
+    RB_GC_GUARD(candidates);
+
+    return result;
+}
+
+void
+extlzma_init_Tuner(void)
+{
+    id_threads = rb_intern("threads");
+    id_max_mem = rb_intern("max_mem");
+    id_mem_budget = rb_intern("mem_budget");
+
+    /*
+     * Document-module: LZMA::Tuner
+     *
+     * 標本を実際に圧縮して、目的に合ったフィルタの設定を選びます。
+     */
+    mTuner = rb_define_module_under(extlzma_mLZMA, "Tuner");
+    rb_define_singleton_method(mTuner, "measure", RUBY_METHOD_FUNC(tuner_s_measure), -1);
+}
@@ -1,59 +1,394 @@
 #include "extlzma.h"
 
-static inline VALUE
-crc_calc(void *(*update)(va_list *vp), int argc, VALUE argv[])
+#ifdef HAVE_SYS_RESOURCE_H
+#   include <sys/resource.h>
+#endif
+
+#ifdef HAVE_SYS_SYSCALL_H
+#   include <sys/syscall.h>
+#endif
+
+#ifdef HAVE_UNISTD_H
+#   include <unistd.h>
+#endif
+
+#ifdef HAVE_SYS_UIO_H
+#   include <sys/uio.h>
+#   include <limits.h>
+#   include <errno.h>
+#   include <ruby/io.h>
+#endif
+
+enum {
+    CRC_PARALLEL_PART_MIN = 1 << 20, // 1 MiB
+};
+
+static ID id_threads;
+
+typedef uint64_t crc_update_f(const uint8_t *ptr, size_t size, uint64_t crc);
+typedef uint64_t crc_combine_f(uint64_t crc1, uint64_t crc2, uint64_t len2);
+
+static uint64_t
+crc32_update0(const uint8_t *ptr, size_t size, uint64_t crc)
 {
-    VALUE src, crc;
-    rb_scan_args(argc, argv, "11", &src, &crc);
-    rb_check_type(src, RUBY_T_STRING);
-    return (VALUE)aux_thread_call_without_gvl(update,
-            (const uint8_t *)RSTRING_PTR(src),
-            RSTRING_LEN(src),
-            NIL_P(crc) ? INT2FIX(0) : crc);
+    return lzma_crc32(ptr, size, (uint32_t)crc);
 }
 
+static uint64_t
+crc64_update0(const uint8_t *ptr, size_t size, uint64_t crc)
+{
+    return lzma_crc64(ptr, size, crc);
+}
 
-static VALUE
-crc32_update(va_list *vp)
+/*
+ * GF(2) 上の行列による CRC の結合 (zlib の crc32_combine と同じ手法)。
+ *
+ * crc1 に対して len2 バイトの 0 を処理した状態を行列の累乗で求め、crc2 と排他的論理和をとる。
+ */
+
+static uint64_t
+gf2_matrix_times(const uint64_t *mat, uint64_t vec)
+{
+    uint64_t sum = 0;
+    for (; vec; vec >>= 1, mat ++) {
+        if (vec & 1) { sum ^= *mat; }
+    }
+    return sum;
+}
+
+static void
+gf2_matrix_square(int bits, uint64_t *square, const uint64_t *mat)
+{
+    for (int n = 0; n < bits; n ++) {
+        square[n] = gf2_matrix_times(mat, mat[n]);
+    }
+}
+
+static uint64_t
+crc_combine(int bits, uint64_t poly, uint64_t crc1, uint64_t crc2, uint64_t len2)
+{
+    uint64_t even[64], odd[64];
+
+    if (len2 == 0) { return crc1; }
+
+    odd[0] = poly;
+    uint64_t row = 1;
+    for (int n = 1; n < bits; n ++, row <<= 1) {
+        odd[n] = row;
+    }
+
+    gf2_matrix_square(bits, even, odd); // 2 ビットの 0 に相当
+    gf2_matrix_square(bits, odd, even); // 4 ビットの 0 に相当
+
+    for (;;) {
+        gf2_matrix_square(bits, even, odd);
+        if (len2 & 1) { crc1 = gf2_matrix_times(even, crc1); }
+        len2 >>= 1;
+        if (len2 == 0) { break; }
+
+        gf2_matrix_square(bits, odd, even);
+        if (len2 & 1) { crc1 = gf2_matrix_times(odd, crc1); }
+        len2 >>= 1;
+        if (len2 == 0) { break; }
+    }
+
+    return crc1 ^ crc2;
+}
+
+uint64_t
+extlzma_crc32_combine(uint64_t crc1, uint64_t crc2, uint64_t len2)
+{
+    return crc_combine(32, 0xedb88320UL, crc1, crc2, len2);
+}
+
+uint64_t
+extlzma_crc64_combine(uint64_t crc1, uint64_t crc2, uint64_t len2)
+{
+    return crc_combine(64, 0xc96c5795d7870f42ULL, crc1, crc2, len2);
+}
+
+struct crc_parallel
+{
+    crc_update_f *update;
+    const uint8_t *ptr;
+    size_t size;
+    size_t partsize;
+    uint64_t init;
+    uint64_t *parts;
+};
+
+static void
+crc_parallel_part(void *arg, size_t i)
+{
+    struct crc_parallel *p = arg;
+    size_t off = p->partsize * i;
+    size_t size = p->size - off;
+    if (size > p->partsize) { size = p->partsize; }
+    p->parts[i] = p->update(p->ptr + off, size, (i == 0 ? p->init : 0));
+}
+
+static uint64_t
+crc_update_parallel(crc_update_f *update, crc_combine_f *combine,
+                    const uint8_t *ptr, size_t size, uint64_t crc, int threads)
+{
+    if (threads < 1) { threads = extlzma_cpu_threads(); }
+    if (threads > 1 && size / CRC_PARALLEL_PART_MIN < (size_t)threads) {
+        threads = (int)(size / CRC_PARALLEL_PART_MIN);
+    }
+    if (threads < 2) { return update(ptr, size, crc); }
+
+    uint64_t parts[EXTLZMA_THREADS_MAX];
+    struct crc_parallel work = {
+        update, ptr, size, (size + threads - 1) / threads, crc, parts
+    };
+    size_t num = (size + work.partsize - 1) / work.partsize;
+
+    extlzma_parallel_run(num, threads, crc_parallel_part, &work);
+
+    crc = parts[0];
+    for (size_t i = 1; i < num; i ++) {
+        size_t len = (i + 1 < num ? work.partsize : size - work.partsize * i);
+        crc = combine(crc, parts[i], len);
+    }
+
+    return crc;
+}
+
+static void *
+crc_calc_nogvl(va_list *vp)
 {
+    crc_update_f *update = va_arg(*vp, crc_update_f *);
+    crc_combine_f *combine = va_arg(*vp, crc_combine_f *);
     const uint8_t *ptr = va_arg(*vp, const uint8_t *);
     size_t size = va_arg(*vp, size_t);
-    VALUE crc = va_arg(*vp, VALUE);
-    return UINT2NUM(lzma_crc32(ptr, size, NUM2UINT(crc)));
+    uint64_t *crc = va_arg(*vp, uint64_t *);
+    int threads = va_arg(*vp, int);
+
+    if (threads == 1) {
+        *crc = update(ptr, size, *crc);
+    } else {
+        *crc = crc_update_parallel(update, combine, ptr, size, *crc, threads);
+    }
+
+    return NULL;
+}
+
+static inline int
+crc_scan_threads(VALUE opts)
+{
+    if (NIL_P(opts)) { return 1; }
+
+    VALUE threads = rb_hash_lookup(opts, ID2SYM(id_threads));
+    if (NIL_P(threads)) { return 1; }
+
+    int n = NUM2INT(threads);
+    if (n < 0) {
+        rb_raise(rb_eArgError, "wrong threads (%d for 0..)", n);
+    }
+
+    return (n > EXTLZMA_THREADS_MAX ? EXTLZMA_THREADS_MAX : n);
+}
+
+static inline uint64_t
+crc_calc(crc_update_f *update, crc_combine_f *combine, int argc, VALUE argv[])
+{
+    VALUE src, crc, opts;
+    rb_scan_args(argc, argv, "11:", &src, &crc, &opts);
+    rb_check_type(src, RUBY_T_STRING);
+    uint64_t crcn = NIL_P(crc) ? 0 : NUM2ULL(crc);
+    int threads = crc_scan_threads(opts);
+    // crc_many と同じく、GVL を解放している間は凍結した複写 (内容は共有される) の領域を参照する
+    src = rb_str_new_frozen(src);
+    size_t size = RSTRING_LEN(src);
+    int parallel = (threads != 1 && size >= CRC_PARALLEL_PART_MIN * 2);
+    EXTLZMA_PROBE3(crc__entry, (update == crc32_update0 ? 32 : 64), size, threads);
+    aux_thread_call_with_policy(EXTLZMA_GVL_CRC, size, parallel,
+                                crc_calc_nogvl, update, combine,
+                                (const uint8_t *)RSTRING_PTR(src),
+                                size, &crcn, threads);
+    EXTLZMA_PROBE3(crc__return, (update == crc32_update0 ? 32 : 64), size, crcn);
+    RB_GC_GUARD(src);
+    return crcn;
 }
 
 /*
  * call-seq:
- *  LZMA::Utils.crc32(string, crc = 0)
+ *  LZMA::Utils.crc32(string, crc = 0, threads: 1)
  *
  * liblzmaに含まれるlzma_crc32を呼び出します。
+ *
+ * [threads]
+ *      1 より大きい値を与えると、文字列を分割して複数のスレッドで計算し、結果を結合します。
+ *
+ *      0 を与えると CPU の数となります。分割した一つあたりが 1 MiB を下回る場合は、スレッドの数が減らされます。
  */
 static VALUE
 utils_crc32(int argc, VALUE argv[], VALUE self)
 {
-    return crc_calc((void *(*)(va_list *))crc32_update, argc, argv);
+    return UINT2NUM((uint32_t)crc_calc(crc32_update0, extlzma_crc32_combine, argc, argv));
 }
 
+/*
+ * call-seq:
+ *  LZMA::Utils.crc64(string, crc = 0, threads: 1)
+ *
+ * liblzmaに含まれるlzma_crc64を呼び出します。
+ *
+ * threads については LZMA::Utils.crc32 と同じです。
+ */
+static VALUE
+utils_crc64(int argc, VALUE argv[], VALUE self)
+{
+    return ULL2NUM(crc_calc(crc64_update0, extlzma_crc64_combine, argc, argv));
+}
 
+/*
+ * call-seq:
+ *  LZMA::Utils.crc32_combine(crc1, crc2, len2) -> integer
+ *
+ * 連続した二つのデータ列それぞれの CRC32 値を結合して、データ列全体の CRC32 値を求めます。
+ *
+ * [crc1]   前半のデータ列の CRC32 値を与えます。
+ * [crc2]   後半のデータ列の CRC32 値 (初期値 0 で計算したもの) を与えます。
+ * [len2]   後半のデータ列のバイト長を与えます。
+ */
 static VALUE
-crc64_update(va_list *vp)
+utils_crc32_combine(VALUE mod, VALUE crc1, VALUE crc2, VALUE len2)
 {
-    const uint8_t *ptr = va_arg(*vp, const uint8_t *);
-    size_t size = va_arg(*vp, size_t);
-    VALUE crc = va_arg(*vp, VALUE);
-    return ULL2NUM(lzma_crc64(ptr, size, NUM2ULL(crc)));
+    return UINT2NUM((uint32_t)extlzma_crc32_combine(NUM2UINT(crc1), NUM2UINT(crc2), NUM2ULL(len2)));
 }
 
 /*
  * call-seq:
- *  LZMA::Utils.crc64(string, crc = 0)
+ *  LZMA::Utils.crc64_combine(crc1, crc2, len2) -> integer
  *
- * liblzmaに含まれるlzma_crc64を呼び出します。
+ * LZMA::Utils.crc32_combine の CRC64 版です。
  */
 static VALUE
-utils_crc64(int argc, VALUE argv[], VALUE self)
+utils_crc64_combine(VALUE mod, VALUE crc1, VALUE crc2, VALUE len2)
 {
-    return crc_calc((void *(*)(va_list *))crc64_update, argc, argv);
+    return ULL2NUM(extlzma_crc64_combine(NUM2ULL(crc1), NUM2ULL(crc2), NUM2ULL(len2)));
+}
+
+struct crc_many
+{
+    crc_update_f *update;
+    const uint8_t **ptrs;
+    size_t *sizes;
+    uint64_t *crcs;
+};
+
+static void
+crc_many_one(void *arg, size_t i)
+{
+    struct crc_many *p = arg;
+    p->crcs[i] = p->update(p->ptrs[i], p->sizes[i], 0);
+}
+
+static void *
+crc_many_nogvl(va_list *vp)
+{
+    struct crc_many *work = va_arg(*vp, struct crc_many *);
+    size_t num = va_arg(*vp, size_t);
+    int threads = va_arg(*vp, int);
+
+    if (threads == 1) {
+        for (size_t i = 0; i < num; i ++) {
+            crc_many_one(work, i);
+        }
+    } else {
+        extlzma_parallel_run(num, threads, crc_many_one, work);
+    }
+
+    return NULL;
+}
+
+static VALUE
+crc_many(crc_update_f *update, VALUE (*conv)(uint64_t), int argc, VALUE argv[])
+{
+    VALUE ary, opts;
+    rb_scan_args(argc, argv, "1:", &ary, &opts);
+    rb_check_type(ary, RUBY_T_ARRAY);
+    int threads = crc_scan_threads(opts);
+    size_t num = RARRAY_LEN(ary);
+
+    for (size_t i = 0; i < num; i ++) {
+        rb_check_type(RARRAY_AREF(ary, i), RUBY_T_STRING);
+    }
+
+    /*
+     * GVL を解放している間に他のスレッドが文字列を変更しても影響を受けないように、
+     * 凍結した複写 (内容は共有される) を pinned に保持してその領域を参照する。
+     */
+    VALUE pinned = rb_ary_new_capa(num);
+    VALUE tmp;
+    struct crc_many work = { update };
+    work.ptrs = (const uint8_t **)ALLOCV(tmp, (sizeof(*work.ptrs) + sizeof(*work.sizes) + sizeof(*work.crcs)) * (num + 1));
+    work.sizes = (size_t *)(work.ptrs + num + 1);
+    work.crcs = (uint64_t *)(work.sizes + num + 1);
+    size_t total = 0;
+    for (size_t i = 0; i < num; i ++) {
+        VALUE str = rb_str_new_frozen(RARRAY_AREF(ary, i));
+        rb_ary_push(pinned, str);
+        work.ptrs[i] = (const uint8_t *)RSTRING_PTR(str);
+        work.sizes[i] = RSTRING_LEN(str);
+        total += work.sizes[i];
+    }
+
+    EXTLZMA_PROBE4(crc__many__entry, (update == crc32_update0 ? 32 : 64), num, total, threads);
+    aux_thread_call_with_policy(EXTLZMA_GVL_CRC, total, (threads != 1 && num > 1),
+                                crc_many_nogvl, &work, num, threads);
+    EXTLZMA_PROBE3(crc__many__return, (update == crc32_update0 ? 32 : 64), num, total);
+
+    VALUE result = rb_ary_new_capa(num);
+    for (size_t i = 0; i < num; i ++) {
+        rb_ary_push(result, conv(work.crcs[i]));
+    }
+    ALLOCV_END(tmp);
+    RB_GC_GUARD(ary);
+    RB_GC_GUARD(pinned);
+
+    return result;
+}
+
+static VALUE
+crc32_to_num(uint64_t crc)
+{
+    return UINT2NUM((uint32_t)crc);
+}
+
+static VALUE
+crc64_to_num(uint64_t crc)
+{
+    return ULL2NUM(crc);
+}
+
+/*
+ * call-seq:
+ *  LZMA::Utils.crc32_many(array_of_strings, threads: 1) -> array of integer
+ *
+ * 配列に含まれる各文字列の CRC32 値を、一度の GVL の解放でまとめて求めます。
+ *
+ * 小さな文字列を大量に処理する場合に、LZMA::Utils.crc32 を繰り返し呼ぶよりも効率的です。
+ *
+ * [threads]    LZMA::Utils.crc32 と同じです。
+ */
+static VALUE
+utils_crc32_many(int argc, VALUE argv[], VALUE self)
+{
+    return crc_many(crc32_update0, crc32_to_num, argc, argv);
+}
+
+/*
+ * call-seq:
+ *  LZMA::Utils.crc64_many(array_of_strings, threads: 1) -> array of integer
+ *
+ * LZMA::Utils.crc32_many の CRC64 版です。
+ */
+static VALUE
+utils_crc64_many(int argc, VALUE argv[], VALUE self)
+{
+    return crc_many(crc64_update0, crc64_to_num, argc, argv);
 }
 
 /*
@@ -86,20 +421,240 @@ utils_block_buffer_bound(VALUE mod, VALUE size)
     return SIZET2NUM(lzma_block_buffer_bound(NUM2SIZET(size)));
 }
 
+/*
+ * call-seq:
+ *  thread_nice(nice) -> true or false
+ *
+ * 呼び出したスレッド (と、その後にそのスレッドが生成するスレッド) の nice 値を設定します。
+ *
+ * liblzma の処理は呼び出したスレッドで GVL を解放して行われるため、
+ * 圧縮や伸張を行うスレッドの CPU の優先度を下げるために用います。
+ *
+ * [RETURN]
+ *      設定できた場合は +true+ を、スレッドごとに設定できない環境では +false+ を返します。
+ */
+static VALUE
+utils_thread_nice(VALUE mod, VALUE nice)
+{
+    int n = NUM2INT(nice);
+
+#if defined(__linux__) && defined(HAVE_SYS_RESOURCE_H) && defined(HAVE_SYS_SYSCALL_H)
+    // Linux では nice 値はスレッドごとに持ち、PRIO_PROCESS にスレッド ID を与えて設定できる
+    if (setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), n) != 0) {
+        rb_sys_fail("setpriority");
+    }
+    return Qtrue;
+#else
+    (void)n;
+    return Qfalse;
+#endif
+}
 
-static VALUE mUtils;
+#if defined(HAVE_SYS_UIO_H) && defined(HAVE_WRITEV)
+#   ifndef IOV_MAX
+#       define IOV_MAX 16
+#   endif
+
+static void *
+writev_nogvl(va_list *vp)
+{
+    int fd = va_arg(*vp, int);
+    const struct iovec *iov = va_arg(*vp, const struct iovec *);
+    int num = va_arg(*vp, int);
+    ssize_t *ret = va_arg(*vp, ssize_t *);
+    int *err = va_arg(*vp, int *);
+
+    *ret = writev(fd, iov, num);
+    *err = errno;
+
+    return NULL;
+}
+
+/*
+ * LZMA::Utils.writev の状態。
+ *
+ * chunks の凍結されていない要素は、GVL を解放している間に他のスレッドが変更
+ * (領域の再確保を含む) できないように、先頭から locked 個を rb_str_locktmp でロックしている。
+ */
+struct writev_state
+{
+    int fd;
+    VALUE chunks;
+    struct iovec *iov;
+    int iovcnt;
+    long locked;
+    size_t written;     // 書き込めたバイト数
+};
+
+static VALUE
+writev_body(VALUE arg)
+{
+    struct writev_state *st = (struct writev_state *)arg;
+    long num = RARRAY_LEN(st->chunks);
+
+    for (; st->locked < num; st->locked ++) {
+        VALUE str = RARRAY_AREF(st->chunks, st->locked);
+        if (!OBJ_FROZEN(str)) { rb_str_locktmp(str); }
+    }
+
+    st->iovcnt = 0;
+    for (long i = 0; i < num; i ++) {
+        VALUE str = RARRAY_AREF(st->chunks, i);
+        if (RSTRING_LEN(str) > 0) {
+            st->iov[st->iovcnt].iov_base = RSTRING_PTR(str);
+            st->iov[st->iovcnt].iov_len = RSTRING_LEN(str);
+            st->iovcnt ++;
+        }
+    }
+
+    struct iovec *iov = st->iov;
+    for (int i = 0; i < st->iovcnt; ) {
+        ssize_t n;
+        int err;
+        aux_thread_call_without_gvl(writev_nogvl, st->fd, iov + i,
+                                    (st->iovcnt - i > IOV_MAX ? IOV_MAX : st->iovcnt - i), &n, &err);
+
+        if (n < 0) {
+            if (err == EINTR) {
+                rb_thread_check_ints();
+            } else if (err == EAGAIN || err == EWOULDBLOCK) {
+                rb_io_wait_writable(st->fd);
+            } else {
+                rb_syserr_fail(err, "writev");
+            }
+            continue;
+        }
+
+        st->written += n;
+
+        // 書き込まれた分だけ iov を進める (一部のみ書き込まれた要素は先頭をずらす)
+        for (; i < st->iovcnt && (size_t)n >= iov[i].iov_len; i ++) {
+            n -= iov[i].iov_len;
+        }
+        if (i < st->iovcnt) {
+            iov[i].iov_base = (char *)iov[i].iov_base + n;
+            iov[i].iov_len -= n;
+        }
+    }
+
+    return Qnil;
+}
+
+/*
+ * ロックを解除し、書き込めた分を chunks の先頭から取り除く。例外が発生した場合も呼ばれる。
+ */
+static VALUE
+writev_leave(VALUE arg)
+{
+    struct writev_state *st = (struct writev_state *)arg;
+    size_t rest = st->written;
+
+    for (long i = 0; i < st->locked; i ++) {
+        VALUE str = RARRAY_AREF(st->chunks, i);
+        if (OBJ_FROZEN(str)) { continue; }
+        rb_str_unlocktmp(str);
+    }
+
+    for (long i = 0; i < RARRAY_LEN(st->chunks) && rest > 0; i ++) {
+        VALUE str = RARRAY_AREF(st->chunks, i);
+        size_t len = RSTRING_LEN(str);
+        size_t n = (rest < len ? rest : len);
+        rest -= n;
+        if (OBJ_FROZEN(str) || n == 0) { continue; }
+        memmove(RSTRING_PTR(str), RSTRING_PTR(str) + n, len - n);
+        rb_str_set_len(str, len - n);
+    }
+
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *  writev(io, chunks) -> integer
+ *
+ * chunks に含まれる文字列を、GVL を解放した状態で writev(2) によって io へまとめて書き込みます。
+ *
+ * 書き込む前に io の書き込みバッファを flush します。
+ * io の文字コードの変換は行われないため、バイナリモードの IO に対して用いて下さい。
+ *
+ * 書き込んだ要素 (凍結されていないもの) は長さを 0 に戻します。確保済みの領域は解放しないため、
+ * LZMA::Stream#feed の出力先として再び用いることが出来ます。
+ *
+ * 書き込みの途中で例外が発生した場合も、それまでに書き込めた分は要素の先頭から取り除かれます。
+ * 空でない要素の内容は書き込まれずに残った部分です (凍結された要素は変更されないため判別できません)。
+ *
+ * 書き込みの間、凍結されていない要素は一時的にロックされ、他のスレッドから変更できません。
+ * 同じ (凍結されていない) 文字列を複数回与えることは出来ません。
+ *
+ * [RETURN]
+ *      書き込んだバイト数を返します。
+ */
+static VALUE
+utils_writev(VALUE mod, VALUE io, VALUE chunks)
+{
+    rb_io_t *fptr;
+
+    io = rb_io_get_io(io);
+    chunks = rb_ary_dup(rb_convert_type(chunks, RUBY_T_ARRAY, "Array", "to_ary"));
+    GetOpenFile(io, fptr);
+    rb_io_check_writable(fptr);
+    rb_io_flush(io);
+
+    long num = RARRAY_LEN(chunks);
+    VALUE seen = rb_hash_new();
+    rb_funcall(seen, rb_intern("compare_by_identity"), 0);
+    for (long i = 0; i < num; i ++) {
+        VALUE str = rb_str_to_str(RARRAY_AREF(chunks, i));
+        rb_ary_store(chunks, i, str);
+        if (OBJ_FROZEN(str)) { continue; }
+        if (RTEST(rb_hash_lookup(seen, str))) {
+            rb_raise(rb_eArgError, "same chunk given twice (at %ld)", i);
+        }
+        rb_hash_aset(seen, str, Qtrue);
+    }
+
+    VALUE tmp;
+    struct writev_state st = { 0 };
+#ifdef HAVE_RB_IO_DESCRIPTOR
+    st.fd = rb_io_descriptor(io);
+#else
+    st.fd = fptr->fd;
+#endif
+    st.chunks = chunks;
+    st.iov = ALLOCV_N(struct iovec, tmp, num + 1);
+
+    rb_ensure(writev_body, (VALUE)&st, writev_leave, (VALUE)&st);
+
+    ALLOCV_END(tmp);
+    RB_GC_GUARD(chunks);
+
+    return SIZET2NUM(st.written);
+}
+#endif
+
+VALUE extlzma_mUtils;
 
 void
 extlzma_init_Utils(void)
 {
-    mUtils = rb_define_module_under(extlzma_mLZMA, "Utils");
+    id_threads = rb_intern("threads");
+
+    extlzma_mUtils = rb_define_module_under(extlzma_mLZMA, "Utils");
 
-    rb_extend_object(extlzma_mLZMA, mUtils);
-    rb_extend_object(mUtils, mUtils); // 自分に対してもモジュールメソッドを利用できるようにする
+    rb_extend_object(extlzma_mLZMA, extlzma_mUtils);
+    rb_extend_object(extlzma_mUtils, extlzma_mUtils); // 自分に対してもモジュールメソッドを利用できるようにする
 
-    rb_define_method(mUtils, "crc32", RUBY_METHOD_FUNC(utils_crc32), -1);
-    rb_define_method(mUtils, "crc64", RUBY_METHOD_FUNC(utils_crc64), -1);
-    rb_define_method(mUtils, "lookup_error", RUBY_METHOD_FUNC(utils_lookup_error), 1);
-    rb_define_method(mUtils, "stream_buffer_bound", RUBY_METHOD_FUNC(utils_stream_buffer_bound), 1);
-    rb_define_method(mUtils, "block_buffer_bound", RUBY_METHOD_FUNC(utils_block_buffer_bound), 1);
+    rb_define_method(extlzma_mUtils, "crc32", RUBY_METHOD_FUNC(utils_crc32), -1);
+    rb_define_method(extlzma_mUtils, "crc64", RUBY_METHOD_FUNC(utils_crc64), -1);
+    rb_define_method(extlzma_mUtils, "crc32_combine", RUBY_METHOD_FUNC(utils_crc32_combine), 3);
+    rb_define_method(extlzma_mUtils, "crc64_combine", RUBY_METHOD_FUNC(utils_crc64_combine), 3);
+    rb_define_method(extlzma_mUtils, "crc32_many", RUBY_METHOD_FUNC(utils_crc32_many), -1);
+    rb_define_method(extlzma_mUtils, "crc64_many", RUBY_METHOD_FUNC(utils_crc64_many), -1);
+    rb_define_method(extlzma_mUtils, "lookup_error", RUBY_METHOD_FUNC(utils_lookup_error), 1);
+    rb_define_method(extlzma_mUtils, "stream_buffer_bound", RUBY_METHOD_FUNC(utils_stream_buffer_bound), 1);
+    rb_define_method(extlzma_mUtils, "block_buffer_bound", RUBY_METHOD_FUNC(utils_block_buffer_bound), 1);
+    rb_define_method(extlzma_mUtils, "thread_nice", RUBY_METHOD_FUNC(utils_thread_nice), 1);
+#if defined(HAVE_SYS_UIO_H) && defined(HAVE_WRITEV)
+    rb_define_method(extlzma_mUtils, "writev", RUBY_METHOD_FUNC(utils_writev), 2);
+#endif
 }
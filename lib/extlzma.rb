@@ -10,6 +10,7 @@ end
 
 require_relative "extlzma/version"
 require "stringio"
+require "digest"
 
 module LZMA
   #
@@ -44,6 +45,33 @@ module LZMA
   #   圧縮データの受け皿となるオブジェクトを指定します。
   #
   #   <tt>.<<</tt> メソッドが呼ばれます。
+  # [skip_incompressible]
+  #   真を与えると、string_data を圧縮する前に LZMA::Utils.estimate_ratio で圧縮率を見積もり、
+  #   ほとんど圧縮できないと見込まれる場合 (すでに圧縮されたデータや暗号化されたデータなど) は、
+  #   preset や filter の指定に関わらずプリセット値 0 で圧縮します。
+  #   このとき LZMA2 は圧縮できないデータを非圧縮のチャンクとして格納するため、出力は有効な xz データのままです。
+  #
+  #   数値を与えると、その値を見積もりの閾値として用います。+true+ の場合は INCOMPRESSIBLE_RATIO です。
+  #
+  #   string_data 以外を与えた場合は無視されます。
+  # [size_hint]
+  #   圧縮するデータの合計の大きさを与えると、辞書をその大きさに合わせて縮めます。
+  #   詳しくは LZMA::Stream::Encoder#initialize を見てください。
+  #
+  #   string_data を与えた場合は、その大きさが自動的に用いられます。
+  # [threads]
+  #   1 以外を与えると LZMA::Stream::MTEncoder を用いて複数のスレッドで圧縮します。0 の場合は CPU の数となります。
+  #
+  #   ブロックヘッダに大きさが記録されるため、LZMA.decode の threads で並列に伸張できるようになります。
+  #   ``block_size:`` を与えることも出来ます。
+  # [rsyncable]
+  #   真を与えると、入力の内容から決まる位置でブロックを閉じ、変更されていない部分が同じバイト列となるように圧縮します。
+  #   詳しくは LZMA::Stream::Encoder#initialize を見てください。
+  # [into]
+  #   <tt>:chunks</tt> を与えると、string_data を圧縮した結果 (または outport を省略した場合の outport) を、
+  #   一つの文字列に連結せずに LZMA::Encoder::BLOCKSIZE ごとの凍結された文字列の配列とします。
+  #
+  #   大きなデータを圧縮する際の、文字列の再確保と複写を避けられます。
   # [YIELD RETURN]
   #   無視されます。
   # [YIELD encoder]
@@ -52,10 +80,21 @@ module LZMA
   # [EXCEPTIONS]
   #   (NO DOCUMENT)
   #
-  def self.encode(src = nil, *args, &block)
-    Aux.encode(src, Stream.encoder(*args), &block)
+  def self.encode(src = nil, *args, skip_incompressible: false, into: nil, **opts, &block)
+    if skip_incompressible && src.kind_of?(String)
+      limit = skip_incompressible.kind_of?(Numeric) ? skip_incompressible : INCOMPRESSIBLE_RATIO
+      args = [0] if Utils.estimate_ratio(src) >= limit
+    end
+
+    opts = { size_hint: src.bytesize, **opts } if src.kind_of?(String)
+    Aux.encode(src, Stream.encoder(*args, **opts), into: into, &block)
   end
 
+  #
+  # LZMA.encode の skip_incompressible に +true+ を与えた場合の閾値です。
+  #
+  INCOMPRESSIBLE_RATIO = 0.97
+
   #
   # call-seq:
   #   decode(string_data) -> decoded data
@@ -75,11 +114,80 @@ module LZMA
   #   圧縮されたデータを与えます。圧縮されたデータの形式は xz と lzma です。これらはあらかじめ区別する必要なく与えることが出来ます。
   # [options]
   #   LZMA::Filter::LZMA2.new に渡される可変引数です。詳細は LZMA::Filter::LZMA2.new を見てください。
+  # [max_output]
+  #   伸張されるデータの最大バイト数です。LZMA::Stream#max_output= を見てください。
+  # [max_ratio]
+  #   伸張されるデータと入力の比の最大値です。LZMA::Stream#max_ratio= を見てください。
+  # [threads]
+  #   1 以外を与えると LZMA::Stream::MTDecoder を用いて複数のスレッドで伸張します。0 の場合は CPU の数となります。
+  #
+  #   入力を先頭から順に読むため、パイプやソケットから読み込む場合にも並列に伸張できます。
+  #   この場合は xz 形式のみを受け付けます。
+  #   ``memlimit_threading:`` を与えることも出来ます。
+  #
+  #   liblzma が並列の伸張に対応していない場合は、一つのスレッドで伸張します。
+  # [offload_check]
+  #   真を与えると、整合値の確認を伸張と並行して別のネイティブスレッド (LZMA::Utils::CheckPipe) で行います。
+  #   LZMA::CHECK_SHA256 などの計算に時間のかかる整合値で、伸張にかかる時間を短くできます。
+  #
+  #   ブロックごとに伸張するため、src は xz 形式の文字列、または読み込む位置を指定できる IO である必要があります。
+  #
+  #   max_output: / max_ratio: / threads: などの他の引数とは組み合わせられません (ArgumentError 例外が発生します)。
+  #   伸張するデータが信頼できず、制限が必要な場合は offload_check を用いないで下さい。
+  #
+  #   整合値が一致しない場合は、そのブロックの終わりか、遅くともデータの終わりを返す前に
+  #   LZMA::DataError 例外が発生します。
   # [EXCEPTIONS]
-  #   (NO DOCUMENT)
+  #   制限を超えた場合は LZMA::OutputLimitError 例外が発生します。
   #
-  def self.decode(src, *args, &block)
-    Aux.decode(src, Stream.auto_decoder(*args), &block)
+  def self.decode(src, *args, offload_check: false, **opts, &block)
+    if offload_check
+      unless args.empty? && opts.empty?
+        names = opts.keys.map(&:inspect)
+        names.unshift("positional arguments") unless args.empty?
+        raise ArgumentError, "offload_check: can not be combined with #{names.join(", ")}"
+      end
+      return Aux.decode_offload_check(src, &block)
+    end
+
+    Aux.decode(src, Stream.auto_decoder(*args, **opts), &block)
+  end
+
+  #
+  # call-seq:
+  #   LZMA.decode_streams(inport, outport = "".b, threads: 0, max_buffer: 64 MiB, memlimit: nil, ignore_check: false) -> outport
+  #   LZMA.decode_streams(inport, threads: 0, max_buffer: 64 MiB, memlimit: nil, ignore_check: false) { |data| ... } -> nil
+  #
+  # 複数の xz ストリームを連結したファイル (<tt>cat a.xz b.xz ...</tt> や LZMA::Appender で追記したもの) を、
+  # ストリームごとに並列に伸張します。
+  #
+  # ストリームの境界は LZMA::Index.stream_ranges によってファイルの後ろからたどって求めます。
+  # いくつかのストリームをまとめて LZMA::Stream.code_all で伸張し、出力はストリームの順に書き込みます。
+  #
+  # [inport]
+  #   読み込む位置を指定できる (pread または seek のできる) IO のようなオブジェクト、または文字列です。
+  # [outport]
+  #   伸張したデータの受け皿です。<tt>.<<</tt> メソッドが呼ばれます。
+  # [YIELD data]
+  #   ブロックを与えた場合は、outport の代わりに伸張したデータを順に渡します。
+  #   使いまわされる文字列オブジェクトの場合があるため、ブロックの外で保持する場合は複製して下さい。
+  # [threads]
+  #   並列に伸張するスレッドの数です。0 の場合は LZMA::ThreadPool.max_threads となります。
+  # [max_buffer]
+  #   一度にまとめて伸張するストリームの、圧縮後と伸張後の大きさの合計の上限です。
+  #   伸張したデータはまとめた単位で出力されるため、おおよそこの大きさが同時に保持されるメモリ量となります。
+  #
+  #   これを超える大きさのストリームは、並列には伸張せずに順に読み込みながら伸張します。
+  # [memlimit]
+  #   一つのストリームの伸張に用いる作業メモリ量の上限です。
+  # [ignore_check]
+  #   真を与えると、整合値を確認しません。
+  #
+  def self.decode_streams(inport, outport = "".b, threads: 0, max_buffer: 64 << 20, memlimit: nil, ignore_check: false, &block)
+    inport = StringIO.new(inport) if inport.kind_of?(String)
+    block ||= ->(data) { outport << data }
+    Aux.decode_streams(inport, threads, max_buffer, memlimit, ignore_check ? LZMA::IGNORE_CHECK : 0, &block)
+    block_given? ? nil : outport
   end
 
   #
@@ -103,11 +211,14 @@ module LZMA
   #   LZMA::Filter のインスタンスを与えます。最大4つまで指定可能です。
   #
   #   省略時は lzma2 フィルタが指定されたとみなします。
+  # [size_hint]
+  #   LZMA.encode と同じです。src が文字列であれば、その大きさが自動的に用いられます。
   # [EXCEPTIONS]
   #   (NO DOCUMENT)
   #
-  def self.raw_encode(src, *args, &block)
-    Aux.encode(src, Stream.raw_encoder(*args), &block)
+  def self.raw_encode(src, *args, **opts, &block)
+    opts = { size_hint: src.bytesize, **opts } if src.kind_of?(String)
+    Aux.encode(src, Stream.raw_encoder(*args, **opts), &block)
   end
 
   # 
@@ -136,6 +247,70 @@ module LZMA
     Aux.decode(src, Stream.raw_decoder(*args), &block)
   end
 
+  #
+  # call-seq:
+  #   LZMA.dump(obj, outport = nil, preset = LZMA::PRESET_DEFAULT, format: :marshal, **opts) -> outport or encoded data
+  #   LZMA.dump(obj, outport, filter..., format: :marshal, **opts) -> outport or encoded data
+  #
+  # obj を直列化し、xz データとして outport に書き込みます。
+  #
+  # 直列化したデータ全体を文字列として作ることはせず、直列化の途中で少しずつ圧縮器に渡します。
+  #
+  # [RETURN outport]
+  #   outport を与えた場合はそのまま返します。
+  # [RETURN encoded data]
+  #   outport を省略した場合は、xz データとしての String インスタンスを返します。
+  # [format]
+  #   <tt>:marshal</tt> であれば Marshal.dump を、<tt>:json</tt> であれば JSON を用います。
+  #
+  #   JSON の場合、最上位の Array と Hash は要素ごとに JSON.generate で生成して書き込みます。
+  # [opts]
+  #   LZMA.encode と同じです。
+  #
+  def self.dump(obj, outport = nil, *args, format: :marshal, **opts)
+    Aux.encode(outport, Stream.encoder(*args, **opts)) do |encoder|
+      case format
+      when :marshal
+        Marshal.dump(obj, encoder)
+      when :json
+        Aux.dump_json(obj, encoder)
+      else
+        raise ArgumentError, "wrong format - #{format.inspect} (expect :marshal or :json)"
+      end
+
+      encoder.outport
+    end
+  end
+
+  #
+  # call-seq:
+  #   LZMA.load(inport, format: :marshal, **opts) -> obj
+  #
+  # LZMA.dump で書き込んだ xz データを伸張しながら復元します。
+  #
+  # Marshal の場合は伸張器から直接読み込むため、伸張したデータ全体を文字列として作ることはありません。
+  # JSON の場合は、JSON.parse に与えるために伸張したデータ全体を文字列にします。
+  #
+  # [inport]
+  #   xz データを文字列、または読み込みのできる IO のようなオブジェクトで与えます。
+  # [opts]
+  #   LZMA.decode と同じです。伸張するデータが信頼できない場合は max_output: などを与えて下さい。
+  #
+  def self.load(inport, *args, format: :marshal, **opts)
+    inport = StringIO.new(inport) if inport.kind_of?(String)
+    Aux.decode(inport, Stream.auto_decoder(*args, **opts)) do |decoder|
+      case format
+      when :marshal
+        Marshal.load(decoder)
+      when :json
+        require "json"
+        JSON.parse(decoder.read)
+      else
+        raise ArgumentError, "wrong format - #{format.inspect} (expect :marshal or :json)"
+      end
+    end
+  end
+
   def self.lzma1(*args)
     LZMA::Filter::LZMA1.new(*args)
   end
@@ -148,85 +323,140 @@ module LZMA
     LZMA::Filter::Delta.new(*args)
   end
 
-  class Encoder < Struct.new(:context, :outport, :writebuf, :workbuf, :status)
+  class Encoder < Struct.new(:context, :outport, :workbuf, :status)
     BLOCKSIZE = 256 * 1024 # 256 KiB
 
+    class << self
+      #
+      # 真であれば、close されずに GC に回収された圧縮器について警告を出力します (既定値は +true+ です)。
+      #
+      # 圧縮器は GC の際に残りのデータを圧縮しません (GC の停止時間を長くしないためです)。
+      # このため close しなかった圧縮器の出力は途中で切れた xz データとなります。
+      #
+      attr_accessor :warn_unclosed
+    end
+
+    self.warn_unclosed = true
+
+    #
+    # #write で一度に圧縮する入力の最大バイト数です。
+    #
+    # 出力を LZMA::Utils.writev でまとめて書き込む場合に、書き込むまでに溜める量を抑えます。
+    #
+    WRITE_SLICE = 4 * 1024 * 1024 # 4 MiB
+
+    #
+    # outport には <tt>.<<</tt> メソッドを持つオブジェクトの他に、次のものを与えることが出来ます。
+    #
+    # [バイナリモードの IO (File や Socket)]
+    #   出力を BLOCKSIZE ごとの使いまわされる文字列に溜め、LZMA::Utils.writev でまとめて書き込みます。
+    # [配列]
+    #   出力を BLOCKSIZE ごとの文字列として追加します。close の際に各要素は凍結されます。
+    #
     def initialize(context, outport)
-      super(context, outport,
-            StringIO.new("".force_encoding(Encoding::BINARY)),
-            "".force_encoding(Encoding::BINARY), [1])
-      self.class.method(:finalizer_regist).(self, context, outport, writebuf, workbuf, status)
+      super(context, outport, "".force_encoding(Encoding::BINARY), [1])
+      if Encoder.warn_unclosed && context.respond_to?(:warn_unfinished=, true)
+        context.__send__(:warn_unfinished=, true)
+      end
+      if outport.kind_of?(IO) && Utils.respond_to?(:writev) && outport.binmode?
+        @chunks = []
+      end
     end
 
     def write(buf)
-      writebuf.rewind
-      writebuf.string.clear
-      writebuf << buf
-      until writebuf.string.empty?
-        s = context.code(writebuf.string, workbuf, BLOCKSIZE, 0)
-        unless s == 0
-          Utils.raise_err s
-        end
-        outport << workbuf
-        workbuf.clear
+      buf = buf.to_s
+      if buf.bytesize > WRITE_SLICE
+        0.step(buf.bytesize - 1, WRITE_SLICE) { |off| write(buf.byteslice(off, WRITE_SLICE)) }
+        return self
       end
 
+      s = feed_outport(buf, LZMA::RUN)
+      Utils.raise_err s unless s == LZMA::OK
+
       self
     end
 
     alias << write
 
-    def close
+    #
+    # call-seq:
+    #   feed(buf) { |chunk| ... } -> self
+    #
+    # outport を用いずに、buf を圧縮して得られたデータをブロックに渡します。
+    #
+    # chunk は使いまわされる文字列オブジェクトです。ブロックの外で保持する場合は複製して下さい。
+    #
+    # chunk の最大の大きさは #chunksize で指定できます。
+    #
+    def feed(buf, &block)
+      s = context.feed(buf, workbuf, chunksize, LZMA::RUN, &block)
+      Utils.raise_err s unless s == LZMA::OK
+      self
+    end
+
+    #
+    # call-seq:
+    #   finish { |chunk| ... } -> nil
+    #
+    # 圧縮処理を終了し、残りのデータをブロックに渡します。#feed と対で用います。
+    #
+    def finish(&block)
       if eof?
         raise "already closed stream - #{inspect}"
       end
 
-      self.class.method(:finalizer_close).(context, outport, workbuf)
-
+      s = context.feed(nil, workbuf, chunksize, LZMA::FINISH, &block)
+      Utils.raise_err s unless s == LZMA::STREAM_END
       status[0] = nil
+      context.end
 
       nil
     end
 
-    def eof
-      !status[0]
+    attr_writer :chunksize
+
+    def chunksize
+      @chunksize || BLOCKSIZE
     end
 
-    alias eof? eof
+    #
+    # 残りのデータを圧縮して outport に書き込み、liblzma の作業メモリを直ちに解放します。
+    #
+    def close
+      if eof?
+        raise "already closed stream - #{inspect}"
+      end
 
-    class << self
-      private
-      def finalizer_regist(obj, context, outport, writebuf, workbuf, status)
-        ObjectSpace.define_finalizer(obj, finalizer_make(context, outport, writebuf, workbuf, status))
+      s = feed_outport(nil, LZMA::FINISH)
+      Utils.raise_err s unless s == LZMA::STREAM_END
+      status[0] = nil
+      context.end
+
+      if outport.kind_of?(Array)
+        outport.reject!(&:empty?)
+        outport.each(&:freeze)
       end
 
-      private
-      def finalizer_make(context, outport, writebuf, workbuf, status)
-        proc do
-          if status[0]
-            until writebuf.string.empty?
-              s = context.code(writebuf.string, workbuf, BLOCKSIZE, 0)
-              Utils.raise_err s unless s == LZMA::OK
-              outport << workbuf
-              workbuf.clear
-            end
+      nil
+    end
 
-            finalizer_close(context, outport, workbuf)
+    def eof
+      !status[0]
+    end
 
-            status[0] = nil
-          end
-        end
-      end
+    alias eof? eof
 
-      private
-      def finalizer_close(context, outport, workbuf)
-        while true
-          workbuf.clear
-          s = context.code(nil, workbuf, BLOCKSIZE, LZMA::FINISH)
-          outport << workbuf
-          break if s == LZMA::STREAM_END
-          Utils.raise_err s unless s == LZMA::OK
-        end
+    private
+
+    def feed_outport(buf, action)
+      if outport.kind_of?(Array)
+        context.feed(buf, outport, BLOCKSIZE, action)
+      elsif @chunks
+        s = context.feed(buf, @chunks, BLOCKSIZE, action)
+        Utils.writev(outport, @chunks)
+        s
+      else
+        context.feed(buf, workbuf, BLOCKSIZE, action) { |chunk| outport << chunk }
       end
     end
   end
@@ -234,258 +464,2082 @@ module LZMA
   class Decoder < Struct.new(:context, :inport, :readbuf, :workbuf, :status)
     BLOCKSIZE = 256 * 1024 # 256 KiB
 
+    #
+    # LZMA::Decoder は IO のように振る舞います。
+    #
+    # 伸張されたデータは workbuf に格納され、@pos までが読み出し済みです。
+    #
     def initialize(context, inport)
       super context, inport,
             "".force_encoding(Encoding::BINARY),
-            StringIO.new("".force_encoding(Encoding::BINARY)),
+            "".force_encoding(Encoding::BINARY),
             :ready
+      @pos = 0
+      @lineno = 0
     end
 
-    def read(size = nil, buf = "".force_encoding(Encoding::BINARY))
-      buf.clear
-      size = size.to_i if size
-      return buf if size == 0
+    attr_accessor :lineno
 
-      tmp = "".force_encoding(Encoding::BINARY)
-      while !eof && (size.nil? || size > 0)
-        if workbuf.eof?
-          fetch or break
-        end
+    #
+    # 伸張を再開するための位置です。LZMA::Decoder#checkpoint で得られ、LZMA::Decoder.resume に与えます。
+    #
+    # [compressed_offset]     位置を含むブロックの、xz ファイルの先頭からの位置です。
+    # [uncompressed_offset]   位置を含むブロックの、伸張後のデータでの位置です。
+    # [check]                 ブロックを含むストリームの整合値の種類です。
+    # [position]              伸張後のデータでの位置です。
+    #
+    # 各値は整数であるため、to_h などで保存して Checkpoint.new(**hash) で復元できます。
+    #
+    Checkpoint = Struct.new(:compressed_offset, :uncompressed_offset, :check, :position, keyword_init: true)
+
+    #
+    # call-seq:
+    #   resume(io, checkpoint, index: nil, ignore_check: false) -> decoder
+    #
+    # checkpoint の位置から伸張を再開する LZMA::Decoder を返します。
+    #
+    # io は xz ファイルを pread (または seek と read) できる IO です。
+    # 位置を含むブロックの先頭から伸張し、checkpoint.position までのデータは読み捨てます。
+    #
+    # 複数のストリームからなる xz ファイルであっても、後続のストリームのブロックを続けて伸張します。
+    #
+    # [index]
+    #   io の LZMA::Index です。省略した場合は LZMA::Index.scan で求めます。
+    # [ignore_check]
+    #   真を与えると、ブロックの整合値を確認しません。
+    #
+    def self.resume(io, checkpoint, index: nil, ignore_check: false)
+      index ||= Index.scan(io)
+      blocks = index.each_block.drop_while { |b| b[:compressed_file_offset] < checkpoint.compressed_offset }
+      head = blocks[0]
+      if head ? (head[:compressed_file_offset] != checkpoint.compressed_offset ||
+                 head[:uncompressed_file_offset] != checkpoint.uncompressed_offset) :
+                checkpoint.uncompressed_offset != index.uncompressed_size
+        raise ArgumentError, "checkpoint does not match the index - #{checkpoint.inspect}"
+      end
+
+      chain = Aux::BlockChain.new(io, blocks, checkpoint.uncompressed_offset, ignore_check: ignore_check)
+      decoder = new(chain, chain)
+      decoder.instance_variable_set(:@index, index)
 
-        workbuf.read(size, tmp) or break
-        buf << tmp
-        size -= tmp.bytesize if size
+      skip = checkpoint.position - checkpoint.uncompressed_offset
+      buf = "".b
+      while skip > 0
+        decoder.read([skip, BLOCKSIZE].min, buf) or raise EOFError, "checkpoint beyond the end of data"
+        skip -= buf.bytesize
       end
 
-      (buf.empty? ? nil : buf)
+      decoder
     end
 
-    def eof
-      !status && workbuf.eof?
+    #
+    # call-seq:
+    #   tell -> integer
+    #
+    # 伸張後のデータで、次に読み込む位置を返します。
+    #
+    def tell
+      context.total_out - rest
     end
 
-    alias eof? eof
+    alias pos tell
 
-    def close
-      self.status = nil
-      workbuf.rewind
-      workbuf.string.clear
-      nil
+    #
+    # call-seq:
+    #   checkpoint(index = nil) -> checkpoint
+    #
+    # 現在の位置から伸張を再開するための LZMA::Decoder::Checkpoint を返します。
+    #
+    # index を省略した場合は、inport を LZMA::Index.scan でたどって求めます (結果は保持されます)。
+    # このため inport は pread (または seek と read) のできる IO である必要があります。
+    #
+    def checkpoint(index = nil)
+      @index = index if index
+      @index ||= Index.scan(inport)
+      @index.checkpoint(tell)
     end
 
-    private
-    def fetch
-      return nil unless status == :ready
+    #
+    # call-seq:
+    #   read(size = nil, buf = "") -> buf or nil
+    #
+    # IO#read と同様に、size バイトのデータを読み込みます。
+    #
+    # 伸張済みのデータがない場合は、buf に直接伸張します。
+    #
+    def read(size = nil, buf = nil)
+      buf = prepare_buffer(buf)
+      if size
+        size = size.to_int
+        raise ArgumentError, "negative length #{size} given" if size < 0
+        return buf if size == 0
+      end
 
-      while workbuf.eof
-        if readbuf.empty?
-          inport.read(BLOCKSIZE, readbuf)
-        end
+      while size.nil? || buf.bytesize < size
+        if rest == 0
+          if buf.empty? && size
+            fetch(buf, size) or break
+            next
+          end
 
-        workbuf.string.clear
-        workbuf.rewind
-        if readbuf.empty?
-          s = context.code(nil, workbuf.string, BLOCKSIZE, LZMA::FINISH)
-        else
-          s = context.code(readbuf, workbuf.string, BLOCKSIZE, 0)
+          fetch or break
         end
 
-        case s
-        when LZMA::OK
-        when LZMA::STREAM_END
-          self.status = :finished
-          break
-        else
-          Utils.raise_err s
-        end
+        take(size && size - buf.bytesize, buf)
       end
 
-      self
+      (buf.empty? ? nil : buf)
     end
-  end
 
-  class Stream
-    def self.encoder(*args, **opts)
-      case
-      when args.empty?
-        Encoder.new(Filter::LZMA2.new(LZMA::PRESET_DEFAULT), **opts)
-      when args.size == 1 && args[0].kind_of?(Numeric)
-        Encoder.new(Filter::LZMA2.new(args[0]), **opts)
+    #
+    # call-seq:
+    #   readpartial(maxlen, buf = "") -> buf
+    #
+    # IO#readpartial と同様に、少なくとも 1 バイト以上、最大で maxlen バイトのデータを読み込みます。
+    #
+    # 伸張済みのデータがある場合はそれを返し、ない場合は buf に直接伸張します。
+    #
+    # 伸張済みのデータがなく、ストリームが終端に達している場合は EOFError 例外が発生します。
+    #
+    # IO.copy_stream はこのメソッドを用いて読み込みます。
+    #
+    def readpartial(maxlen, buf = nil)
+      buf = prepare_buffer(buf)
+      maxlen = maxlen.to_int
+      raise ArgumentError, "negative length #{maxlen} given" if maxlen < 0
+      return buf if maxlen == 0
+
+      if rest > 0
+        take(maxlen, buf)
       else
-        Encoder.new(*args, **opts)
+        fetch(buf, maxlen) or raise EOFError, "end of file reached"
       end
-    end
 
-    def self.decoder(*args)
-      case
-      when args.empty?
-        Decoder.new(Filter::LZMA2.new(LZMA::PRESET_DEFAULT))
-      when args.size == 1 && args[0].kind_of?(Numeric)
-        Decoder.new(Filter::LZMA2.new(args[0]))
-      else
-        Decoder.new(*args)
-      end
+      buf
     end
 
-    def self.auto_decoder(*args)
-      AutoDecoder.new(*args)
+    #
+    # call-seq:
+    #   read_nonblock(maxlen, buf = "", exception: true) -> buf
+    #
+    # LZMA::Decoder#readpartial と同じです。
+    #
+    # inport からの読み込みは inport.read によって行われるため、inport によっては処理が止まる可能性があります。
+    #
+    def read_nonblock(maxlen, buf = nil, exception: true)
+      readpartial(maxlen, buf)
+    rescue EOFError
+      raise if exception
+      nil
     end
 
-    def self.raw_encoder(*args)
-      case
-      when args.size == 0
-        RawEncoder.new(Filter::LZMA2.new(LZMA::PRESET_DEFAULT))
-      when args.size == 1 && args[0].kind_of?(Numeric)
-        RawEncoder.new(Filter::LZMA2.new(args[0]))
+    #
+    # call-seq:
+    #   gets(sep = $/, limit = nil, chomp: false) -> string or nil
+    #   gets(limit, chomp: false) -> string or nil
+    #
+    # IO#gets と同様に一行を読み込みます。
+    #
+    # 区切り文字列は伸張済みのデータに対して直接探索されます。
+    #
+    def gets(*args, chomp: false)
+      sep, limit = getline_args(*args)
+      return "".force_encoding(Encoding::BINARY) if limit == 0
+
+      if sep.nil?
+        line = read(limit)
       else
-        RawEncoder.new(*args)
+        paragraph = sep.empty?
+        sep = "\n\n" if paragraph
+        skip_newlines if paragraph
+        line = getline(sep, limit)
+        skip_newlines if paragraph && line
       end
-    end
 
-    def self.raw_decoder(*args)
-      case
-      when args.size == 0
-        RawDecoder.new(Filter::LZMA2.new(LZMA::PRESET_DEFAULT))
-      when args.size == 1 && args[0].kind_of?(Numeric)
-        RawDecoder.new(Filter::LZMA2.new(args[0]))
-      else
-        RawDecoder.new(*args)
+      return nil unless line
+
+      @lineno += 1
+      if chomp && sep
+        if line.end_with?(sep)
+          line.slice!(-sep.bytesize, sep.bytesize)
+        elsif sep == "\n" && line.end_with?("\r\n")
+          line.slice!(-2, 2)
+        end
       end
-    end
-  end
 
-  class Filter
-    def self.lzma1(*args)
-      LZMA1.new(*args)
+      line
     end
 
-    def self.lzma2(*args)
-      LZMA2.new(*args)
+    #
+    # call-seq:
+    #   readline(sep = $/, limit = nil, chomp: false) -> string
+    #
+    # LZMA::Decoder#gets と同じですが、終端に達している場合は EOFError 例外が発生します。
+    #
+    def readline(*args, **opts)
+      gets(*args, **opts) or raise EOFError, "end of file reached"
     end
 
-    def self.delta(*args)
-      Delta.new(*args)
-    end
-  end
+    #
+    # call-seq:
+    #   each_line(sep = $/, limit = nil, chomp: false) { |line| ... } -> self
+    #   each_line(sep = $/, limit = nil, chomp: false) -> enumerator
+    #
+    def each_line(*args, **opts)
+      return to_enum(:each_line, *args, **opts) unless block_given?
 
-  module Utils
-    extend self
+      while line = gets(*args, **opts)
+        yield line
+      end
 
-    def crc32_digest(seq, init = 0)
-      [Utils.crc32(seq, init)].pack("N")
+      self
     end
 
-    def crc32_hexdigest(seq, init = 0)
-      "%08X" % Utils.crc32(seq, init)
+    alias each each_line
+
+    def readlines(*args, **opts)
+      each_line(*args, **opts).to_a
     end
 
-    def crc64_digest(seq, init = 0)
-      [Utils.crc64(seq, init)].pack("Q>")
+    #
+    # call-seq:
+    #   getbyte -> integer or nil
+    #
+    def getbyte
+      return nil if rest == 0 && !fetch
+      byte = workbuf.getbyte(@pos)
+      @pos += 1
+      byte
     end
 
-    def crc64_hexdigest(seq, init = 0)
-      "%016X" % Utils.crc64(seq, init)
+    def readbyte
+      getbyte or raise EOFError, "end of file reached"
     end
 
-    # 
-    # CRC32 を Digest のように生成できるようになります。
-    #
-    class CRC32 < Struct.new(:state, :init)
-      def initialize(state = 0)
-        state = state.to_i
-        super(state, state)
-      end
+    def binmode
+      self
+    end
 
-      # 
-      # call-seq:
-      #   LZMA::Utils::CRC32#update(data) -> self
-      #
-      def update(data)
-        self.state = Utils.crc32(data, state)
-        self
-      end
+    def binmode?
+      true
+    end
 
-      alias << update
+    #
+    # call-seq:
+    #   feed(buf) { |chunk| ... } -> self
+    #
+    # inport から読み込む代わりに、圧縮されたデータ buf を与えて伸張し、得られたデータをブロックに渡します。
+    #
+    # ソケットの受信時に呼ばれるコールバックなどから、少しずつデータを与える場合に用います。
+    # 与えられたデータはその場で処理されるため、メッセージ全体が溜め込まれることはありません。
+    #
+    # chunk は使いまわされる文字列オブジェクトです。ブロックの外で保持する場合は複製して下さい。
+    #
+    # chunk の最大の大きさは #chunksize で指定できます。
+    #
+    # xz ストリームの終端に達した後に与えられたデータは無視されます。
+    #
+    def feed(buf, &block)
+      return self unless status == :ready
+
+      s = context.feed(buf, (@feedbuf ||= "".force_encoding(Encoding::BINARY)), chunksize, 0, &block)
+      case s
+      when LZMA::OK
+      when LZMA::STREAM_END
+        self.status = :finished
+      else
+        Utils.raise_err s
+      end
+
+      self
+    end
+
+    #
+    # call-seq:
+    #   finish { |chunk| ... } -> nil
+    #
+    # #feed によるデータの供給が終わったことを伝え、残りのデータをブロックに渡します。
+    #
+    # xz ストリームが途中で終わっている場合は LZMA::BufError 例外が発生します。
+    #
+    def finish(&block)
+      return nil unless status == :ready
+
+      s = context.feed(nil, (@feedbuf ||= "".force_encoding(Encoding::BINARY)), chunksize, LZMA::FINISH, &block)
+      case s
+      when LZMA::STREAM_END
+        self.status = :finished
+      when LZMA::OK
+        Utils.raise_err LZMA::BUF_ERROR, "unexpected end of stream"
+      else
+        Utils.raise_err s
+      end
+
+      nil
+    end
+
+    attr_writer :chunksize
+
+    def chunksize
+      @chunksize || BLOCKSIZE
+    end
+
+    #
+    # call-seq:
+    #   eof? -> true or false
+    #
+    # 読み込むデータが残っていない場合に真を返します。
+    #
+    # 伸張済みのデータがない場合は、inport から読み込んで確認します。
+    #
+    def eof
+      rest == 0 && !fetch
+    end
+
+    alias eof? eof
+
+    #
+    # 伸張器を閉じ、liblzma の作業メモリを直ちに解放します。
+    #
+    def close
+      self.status = nil
+      workbuf.clear
+      @pos = 0
+      context.end
+      nil
+    end
+
+    private
+    def rest
+      workbuf.bytesize - @pos
+    end
+
+    def prepare_buffer(buf)
+      if buf
+        buf.clear
+        buf.force_encoding(Encoding::BINARY)
+      else
+        "".force_encoding(Encoding::BINARY)
+      end
+    end
+
+    #
+    # 伸張済みのデータから最大 size バイト (nil であればすべて) を取り出し、buf に追加します。
+    #
+    def take(size, buf)
+      size = rest if size.nil? || size > rest
+      if @pos == 0 && size == workbuf.bytesize
+        buf << workbuf
+      else
+        buf << workbuf.byteslice(@pos, size)
+      end
+      @pos += size
+      buf
+    end
+
+    def getline_args(*args)
+      case args.size
+      when 0
+        sep, limit = $/, nil
+      when 1
+        if args[0].nil? || args[0].kind_of?(String)
+          sep, limit = args[0], nil
+        else
+          sep, limit = $/, args[0].to_int
+        end
+      when 2
+        sep, limit = args[0], (args[1] && args[1].to_int)
+      else
+        raise ArgumentError, "wrong number of arguments (given #{args.size}, expected 0..2)"
+      end
+
+      limit = nil if limit && limit < 0
+      [(sep && sep.b), limit]
+    end
+
+    def getline(sep, limit)
+      line = nil
+      while true
+        if rest == 0
+          fetch or break
+        end
+
+        line ||= "".force_encoding(Encoding::BINARY)
+        # 区切り文字列が伸張済みのデータの境界をまたぐ場合に備えて、line の末尾から探索を始める
+        if line.empty?
+          i = workbuf.index(sep, @pos)
+          if i
+            size = i + sep.bytesize - @pos
+            size = limit if limit && limit < size
+            return take(size, line)
+          end
+        else
+          head = line.bytesize - sep.bytesize + 1
+          head = 0 if head < 0
+          tail = line.byteslice(head, line.bytesize) + workbuf.byteslice(@pos, sep.bytesize - 1)
+          i = tail.index(sep)
+          if i
+            size = i + sep.bytesize - (line.bytesize - head)
+            size = limit - line.bytesize if limit && limit - line.bytesize < size
+            return take(size, line)
+          end
+          i = workbuf.index(sep, @pos)
+          if i
+            size = i + sep.bytesize - @pos
+            size = limit - line.bytesize if limit && limit - line.bytesize < size
+            return take(size, line)
+          end
+        end
+
+        take(limit && limit - line.bytesize, line)
+        return line if limit && line.bytesize >= limit
+      end
+
+      line
+    end
+
+    def skip_newlines
+      while true
+        if rest == 0
+          fetch or return
+        end
+
+        return unless workbuf.getbyte(@pos) == 0x0a
+        @pos += 1
+      end
+    end
+
+    #
+    # inport から読み込んで伸張します。
+    #
+    # dest を与えた場合はそこへ直接 (最大で maxdest バイト) 伸張し、与えない場合は workbuf へ伸張します。
+    #
+    # 伸張されたデータがあれば真を、終端に達した場合は nil を返します。
+    #
+    def fetch(dest = nil, maxdest = BLOCKSIZE)
+      return nil unless status == :ready
+
+      unless dest
+        dest = workbuf
+        @pos = 0
+      end
+
+      dest.clear
+      while dest.empty?
+        if readbuf.empty?
+          inport.read(BLOCKSIZE, readbuf)
+        end
+
+        if readbuf.empty?
+          s = context.code(nil, dest, maxdest, LZMA::FINISH)
+        else
+          s = context.code(readbuf, dest, maxdest, 0)
+        end
+
+        case s
+        when LZMA::OK
+        when LZMA::STREAM_END
+          self.status = :finished
+          break
+        else
+          Utils.raise_err s
+        end
+      end
+
+      (dest.empty? ? nil : self)
+    end
+  end
+
+  class Stream
+    def self.encoder(*args, threads: nil, **opts)
+      klass = Encoder
+      if threads && threads != 1 && const_defined?(:MTEncoder)
+        klass = MTEncoder
+        opts[:threads] = threads
+      end
+
+      case
+      when args.empty?
+        klass.new(Filter::LZMA2.new(LZMA::PRESET_DEFAULT), **opts)
+      when args.size == 1 && args[0].kind_of?(Numeric)
+        klass.new(Filter::LZMA2.new(args[0]), **opts)
+      else
+        klass.new(*args, **opts)
+      end
+    end
+
+    def self.decoder(*args, **opts)
+      case
+      when args.empty?
+        Decoder.new(Filter::LZMA2.new(LZMA::PRESET_DEFAULT))
+      when args.size == 1 && args[0].kind_of?(Numeric)
+        Decoder.new(Filter::LZMA2.new(args[0]))
+      else
+        Decoder.new(*args, **opts)
+      end
+    end
+
+    def self.auto_decoder(*args, threads: nil, **opts)
+      if threads && threads != 1 && const_defined?(:MTDecoder)
+        MTDecoder.new(*args, threads: threads, **opts)
+      else
+        AutoDecoder.new(*args, **opts)
+      end
+    end
+
+    def self.raw_encoder(*args, **opts)
+      case
+      when args.size == 0
+        RawEncoder.new(Filter::LZMA2.new(LZMA::PRESET_DEFAULT), **opts)
+      when args.size == 1 && args[0].kind_of?(Numeric)
+        RawEncoder.new(Filter::LZMA2.new(args[0]), **opts)
+      else
+        RawEncoder.new(*args, **opts)
+      end
+    end
+
+    def self.raw_decoder(*args)
+      case
+      when args.size == 0
+        RawDecoder.new(Filter::LZMA2.new(LZMA::PRESET_DEFAULT))
+      when args.size == 1 && args[0].kind_of?(Numeric)
+        RawDecoder.new(Filter::LZMA2.new(args[0]))
+      else
+        RawDecoder.new(*args)
+      end
+    end
+  end
+
+  class Filter
+    def self.lzma1(*args)
+      LZMA1.new(*args)
+    end
+
+    def self.lzma2(*args)
+      LZMA2.new(*args)
+    end
+
+    def self.delta(*args)
+      Delta.new(*args)
+    end
+  end
+
+  module Utils
+    extend self
+
+    def crc32_digest(seq, init = 0)
+      [Utils.crc32(seq, init)].pack("N")
+    end
+
+    def crc32_hexdigest(seq, init = 0)
+      "%08X" % Utils.crc32(seq, init)
+    end
+
+    def crc64_digest(seq, init = 0)
+      [Utils.crc64(seq, init)].pack("Q>")
+    end
+
+    def crc64_hexdigest(seq, init = 0)
+      "%016X" % Utils.crc64(seq, init)
+    end
+
+    #
+    # LZMA::Utils::CRC32 / LZMA::Utils::CRC64 / LZMA::Utils::SHA256 は拡張ライブラリで実装されています。
+    #
+    # update / reset / finish などは拡張ライブラリ側で定義され、
+    # digest や hexdigest などは Digest::Instance によって提供されます。
+    #
+    [CRC32, CRC64, SHA256].each do |klass|
+      klass.class_eval do
+        include Digest::Instance
+
+        def self.digest(data, *args)
+          new(*args).update(data).digest
+        end
+
+        def self.hexdigest(data, *args)
+          new(*args).update(data).hexdigest
+        end
+
+        def to_str
+          "#{self.class.name.split("::")[-1]} <#{hexdigest}>"
+        end
+
+        alias inspect to_str
+      end
+    end
+
+    def raise_err(lzma_ret, mesg = nil)
+      et = Utils.lookup_error(lzma_ret)
+      raise et, mesg, caller
+    end
+  end
+
+  extend Utils
+
+  #
+  # データの標本を試し圧縮して、目的に合った圧縮の設定を選びます。
+  #
+  #   result = LZMA::Tuner.recommend(sample, target_mbps: 20)
+  #   LZMA.encode(data, *result.filters)
+  #
+  module Tuner
+    #
+    # LZMA::Tuner.recommend が返す、フィルタの設定とその試し圧縮の結果です。
+    #
+    # [filters]   LZMA.encode などにそのまま渡すことの出来るフィルタの配列です。最後の要素は LZMA::Filter::LZMA2 です。
+    # [ratio]     元の大きさに対する圧縮後の大きさの比です。
+    # [mbps]      圧縮の速さです (MB/s)。
+    # [memusage]  圧縮に必要な作業メモリ量です (バイト)。
+    #
+    Result = Struct.new(:filters, :ratio, :mbps, :memusage) do
+      def lzma2
+        filters[-1]
+      end
+    end
+
+    PRESETS = [*0..9, 6 | LZMA::PRESET_EXTREME, 9 | LZMA::PRESET_EXTREME]
+    DELTA_DISTANCES = [1, 2, 4, 8]
+    BCJ_FILTERS = Filter::BCJ.constants(false).sort.map { |n| Filter::BCJ.const_get(n) }
+
+    # 前置フィルタの効果を調べるときに用いるプリセット値
+    PREFILTER_PRESET = 1
+
+    # 前置フィルタを採用するために必要な、圧縮後の大きさの比
+    PREFILTER_GAIN = 0.98
+
+    DICTSIZE_MIN = 4096
+    NICE_MIN = 8
+    NICE_MAX = 273
+
+    #
+    # call-seq:
+    #   recommend(sample, target_mbps: nil, max_mem: nil, size_hint: nil, prefilters: true, refine: true, threads: 0, mem_budget: nil) -> result
+    #
+    # sample をいくつかの設定で試し圧縮し、条件を満たす中で最もよく圧縮できる設定を LZMA::Tuner::Result で返します。
+    #
+    # 圧縮の速さと圧縮率のどちらにおいても他の候補に劣らない候補 (パレート最適な候補) の中から選びます。
+    # 条件を満たす候補がない場合は、最も速い候補を返します。
+    #
+    # [sample]
+    #   対象となるデータの代表的な一部を与えます。大きすぎると試し圧縮に時間がかかります。
+    # [target_mbps]
+    #   必要な圧縮の速さを MB/s で与えます。
+    # [max_mem]
+    #   圧縮に用いてもよい作業メモリ量をバイト数で与えます。
+    # [size_hint]
+    #   実際に圧縮するデータの大きさをバイト数で与えます。
+    #   各候補の辞書をその大きさを収めるのに十分な大きさまで縮め、作業メモリ量もそれによって求めます。
+    # [prefilters]
+    #   真であれば、LZMA::Filter::Delta と LZMA::Filter::BCJ を前置した場合も試し、効果があれば採用します。
+    # [refine]
+    #   真であれば、プリセット値による候補のうちパレート最適なものについて、
+    #   マッチファインダ (mf)、nice、depth を変えた候補も試します。
+    # [threads, mem_budget]
+    #   LZMA::Tuner.measure に渡されます。
+    #
+    def self.recommend(sample, target_mbps: nil, max_mem: nil, size_hint: nil, prefilters: true, refine: true, threads: 0, mem_budget: nil)
+      opts = { max_mem: max_mem, threads: threads, mem_budget: mem_budget }
+      pre = prefilters ? prefilter(sample, **opts) : []
+      presets = {}.compare_by_identity
+      candidates = PRESETS.map { |pr| (pre + [lzma2(pr, size_hint)]).tap { |c| presets[c] = pr } }
+      results = evaluate(sample, candidates, **opts)
+      if results.empty?
+        raise ArgumentError, "no candidate fits in max_mem (#{max_mem})"
+      end
+
+      front = pareto(results)
+      if refine
+        candidates = front.flat_map { |r| variants(presets[r.filters], r.lzma2, size_hint).map { |f| pre + [f] } }
+        front = pareto(results + evaluate(sample, candidates, **opts))
+      end
+
+      fit = target_mbps ? front.select { |r| r.mbps >= target_mbps } : front
+      fit.empty? ? front.max_by(&:mbps) : fit.min_by(&:ratio)
+    end
+
+    #
+    # call-seq:
+    #   prefilter(sample, max_mem: nil, threads: 0, mem_budget: nil) -> array of filter
+    #
+    # sample に対して効果のある前置フィルタを配列で返します。効果のあるものがなければ空の配列を返します。
+    #
+    def self.prefilter(sample, max_mem: nil, threads: 0, mem_budget: nil)
+      chains = [[]] +
+               DELTA_DISTANCES.map { |d| [Filter::Delta.new(d)] } +
+               BCJ_FILTERS.map { |k| [k.new] }
+      results = evaluate(sample, chains.map { |c| c + [Filter::LZMA2.new(PREFILTER_PRESET)] },
+                         max_mem: max_mem, threads: threads, mem_budget: mem_budget)
+      plain = results.find { |r| r.filters.size == 1 }
+      best = results.min_by(&:ratio)
+      return [] unless plain && best && best.ratio < plain.ratio * PREFILTER_GAIN
+      best.filters[0...-1]
+    end
+
+    #
+    # call-seq:
+    #   pareto(results) -> array of result
+    #
+    # results のうち、速さと圧縮率のどちらにおいても他に劣らないものを、速い順に返します。
+    #
+    def self.pareto(results)
+      front = []
+      results.sort_by { |r| [-r.mbps, r.ratio] }.each do |r|
+        front << r if front.empty? || r.ratio < front[-1].ratio
+      end
+      front
+    end
+
+    def self.evaluate(sample, candidates, max_mem: nil, threads: 0, mem_budget: nil)
+      size = sample.bytesize
+      measure(sample, candidates, max_mem: max_mem, threads: threads, mem_budget: mem_budget).
+        each_with_index.map { |(outsize, elapsed, memusage), i|
+          next nil unless outsize
+          Result.new(candidates[i], size > 0 ? outsize.fdiv(size) : 1.0,
+                     size * 1000.0 / [elapsed, 1].max, memusage)
+        }.compact
+    end
+
+    # size_hint を収める大きさまで辞書を縮めた (LZMA::Stream の size_hint と同じ) LZMA2 フィルタ
+    def self.lzma2(preset, size_hint, **opts)
+      full = Filter::LZMA2.new(preset).dictsize
+      dict = DICTSIZE_MIN
+      dict <<= 1 while size_hint && dict < size_hint && dict < full
+      Filter::LZMA2.new(preset, dictsize: size_hint ? [dict, full].min : full, **opts)
+    end
+
+    # プリセット値による設定から、マッチファインダ、nice、depth のいずれかを変えたもの
+    def self.variants(preset, filter, size_hint)
+      hc = (filter.mf == LZMA::MF_HC3 || filter.mf == LZMA::MF_HC4)
+      nice = filter.nice
+      # depth が 0 の場合に liblzma が用いる値
+      depth = filter.depth > 0 ? filter.depth : (hc ? 4 + nice / 4 : 16 + nice / 2)
+
+      tweaks = [{ mf: hc ? LZMA::MF_BT4 : LZMA::MF_HC4, depth: 0 }]
+      [nice / 2, [nice * 2, NICE_MAX].min].uniq.each do |n|
+        tweaks << { nice: n } if n >= NICE_MIN && n != nice
+      end
+      [depth / 2, depth * 2].each { |d| tweaks << { depth: d } if d > 0 }
+
+      tweaks.map { |t| lzma2(preset, size_hint, **t) }
+    end
+
+    private_class_method :evaluate, :lzma2, :variants
+
+    #
+    # 用途 (データの種類) ごとに LZMA::Tuner.recommend の結果を保持し、実際に圧縮した結果から設定を見直します。
+    #
+    #   tuner = LZMA::Tuner::Online.new(target_mbps: 20)
+    #   xz = tuner.encode(jpeg_data, :image)
+    #   xz = tuner.encode(log_text, :log)
+    #
+    # 次のいずれかの場合に、その時点で与えられたデータを標本として設定を選び直します。
+    #
+    # - 前回選んでから interval 回圧縮した
+    # - 実際の圧縮の速さが target_mbps を tolerance の割合以上下回った
+    # - 実際の圧縮率が試し圧縮での圧縮率を tolerance の割合以上上回った
+    #
+    # 実際の速さと圧縮率は、直近の値に重みをおいた移動平均で求めます。
+    #
+    class Online
+      State = Struct.new(:result, :calls, :ratio, :mbps)
+
+      # 移動平均で直近の値に与える重み
+      WEIGHT = 0.125
+
+      # 移動平均に含めるデータの最小の大きさ (xz のヘッダなどの影響を避けるため)
+      STATS_MIN = 64 * 1024
+
+      # 速さと圧縮率の見直しを判断する前に必要な圧縮の回数
+      WARMUP = 4
+
+      attr_reader :target_mbps, :max_mem, :interval, :tolerance, :sample_size
+
+      def initialize(target_mbps: nil, max_mem: nil, interval: 256, tolerance: 0.2, sample_size: 1 << 20, threads: 0)
+        @target_mbps = target_mbps
+        @max_mem = max_mem
+        @interval = interval
+        @tolerance = tolerance
+        @sample_size = sample_size
+        @threads = threads
+        @states = {}
+        @mutex = Mutex.new
+      end
+
+      #
+      # call-seq:
+      #   encode(data, data_class = nil) -> xz data
+      #
+      # data_class に対して選ばれた設定で data を圧縮します。
+      #
+      def encode(data, data_class = nil)
+        result = filters_for(data, data_class)
+        t = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+        dest = LZMA.encode(data, *result.filters)
+        record(data_class, data.bytesize, dest.bytesize, Process.clock_gettime(Process::CLOCK_MONOTONIC) - t)
+        dest
+      end
+
+      #
+      # call-seq:
+      #   filters_for(data, data_class = nil) -> result
+      #
+      # data_class に対して選ばれた設定を LZMA::Tuner::Result で返します。
+      # 見直しが必要であれば、data を標本として選び直します。
+      #
+      def filters_for(data, data_class = nil)
+        state = @mutex.synchronize { @states[data_class] ||= State.new(nil, 0) }
+        return state.result unless state.result.nil? || retune?(state)
+
+        sample = data.byteslice(0, sample_size)
+        result = Tuner.recommend(sample, target_mbps: target_mbps, max_mem: max_mem, threads: @threads)
+        @mutex.synchronize do
+          state.result = result
+          state.calls = 0
+          state.ratio = state.mbps = nil
+        end
+        result
+      end
+
+      #
+      # call-seq:
+      #   record(data_class, insize, outsize, seconds) -> self
+      #
+      # 実際に圧縮した結果を記録します。LZMA::Tuner::Online#encode を用いない場合に呼び出して下さい。
+      #
+      def record(data_class, insize, outsize, seconds)
+        @mutex.synchronize do
+          state = (@states[data_class] ||= State.new(nil, 0))
+          state.calls += 1
+          if insize >= STATS_MIN
+            mbps = insize / ([seconds, 1e-9].max * 1e6)
+            ratio = outsize.fdiv(insize)
+            state.mbps = state.mbps ? state.mbps + (mbps - state.mbps) * WEIGHT : mbps
+            state.ratio = state.ratio ? state.ratio + (ratio - state.ratio) * WEIGHT : ratio
+          end
+        end
+        self
+      end
+
+      #
+      # call-seq:
+      #   stats(data_class = nil) -> { result:, calls:, ratio:, mbps: } or nil
+      #
+      def stats(data_class = nil)
+        @mutex.synchronize do
+          state = @states[data_class] or return nil
+          state.to_h
+        end
+      end
+
+      private def retune?(state)
+        return true if state.calls >= interval
+        return false if state.calls < WARMUP || state.mbps.nil?
+        return true if target_mbps && state.mbps < target_mbps * (1 - tolerance)
+        state.ratio > state.result.ratio * (1 + tolerance)
+      end
+    end
+  end
+
+  class Index
+    HEADER_SIZE = 12
+    FOOTER_SIZE = 12
+
+    #
+    # call-seq:
+    #   read_stream(io, endpos = io.size) -> [index, startpos]
+    #
+    # io の endpos の位置で終わる xz ストリームを、フッタから後ろ向きにたどって読み込みます。
+    #
+    # ストリームの後ろにあるストリームパディングを読み飛ばし、フッタ、インデックス、ヘッダの順に確認します。
+    # ブロックは読み込まないため、ストリームの大きさによらず一定の読み込みで済みます。
+    #
+    # [RETURN index]
+    #   ストリームのインデックスです。ストリームパディングも記録されています。
+    # [RETURN startpos]
+    #   ストリームの先頭の位置です。
+    #
+    def self.read_stream(io, endpos = io.size)
+      pos = endpos
+      while pos >= HEADER_SIZE + FOOTER_SIZE && Aux.pread(io, 4, pos - 4) == "\0\0\0\0"
+        pos -= 4
+      end
+      padding = endpos - pos
+
+      if pos < HEADER_SIZE + FOOTER_SIZE
+        raise LZMA::FormatError, "not a xz stream (too short or padding only)"
+      end
+
+      footer = Aux.pread(io, FOOTER_SIZE, pos - FOOTER_SIZE)
+      backward_size, check = decode_footer(footer)
+      indexpos = pos - FOOTER_SIZE - backward_size
+      if indexpos < HEADER_SIZE
+        raise DataError, "broken xz stream (index out of range)"
+      end
+      index = decode(Aux.pread(io, backward_size, indexpos), footer, padding)
+
+      startpos = endpos - index.file_size
+      if startpos < 0 || decode_header(Aux.pread(io, HEADER_SIZE, startpos)) != check
+        raise DataError, "broken xz stream (stream header mismatch)"
+      end
+
+      [index, startpos]
+    end
+
+    #
+    # call-seq:
+    #   checkpoint(position) -> checkpoint
+    #
+    # 伸張後のデータでの position から伸張を再開するための LZMA::Decoder::Checkpoint を返します。
+    #
+    def checkpoint(position)
+      block = locate(position)
+      if block
+        LZMA::Decoder::Checkpoint.new(compressed_offset: block[:compressed_file_offset],
+                                uncompressed_offset: block[:uncompressed_file_offset],
+                                check: block[:check], position: position)
+      elsif position == uncompressed_size
+        LZMA::Decoder::Checkpoint.new(compressed_offset: file_size, uncompressed_offset: position,
+                                check: nil, position: position)
+      else
+        raise ArgumentError, "position out of range (#{position} for 0..#{uncompressed_size})"
+      end
+    end
+
+    #
+    # call-seq:
+    #   scan(io) -> index
+    #
+    # io に含まれるすべての xz ストリームを後ろからたどり、連結したインデックスを返します。
+    #
+    # 返されるインデックスの位置は io の先頭からの位置となるため、LZMA::Index#locate で
+    # すべてのストリームにわたって位置を求めることが出来ます。
+    #
+    def self.scan(io)
+      indexes = []
+      pos = io.size
+      while pos > 0
+        index, pos = read_stream(io, pos)
+        indexes << index
+      end
+
+      raise LZMA::FormatError, "empty file" if indexes.empty?
+
+      indexes.reverse!
+      indexes.drop(1).each_with_object(indexes[0]) { |i, all| all.cat(i) }
+    end
+
+    #
+    # call-seq:
+    #   stream_ranges(io) -> [[startpos, stream_size, uncompressed_size], ...]
+    #
+    # io に含まれるすべての xz ストリームを後ろからたどり、先頭から順に各ストリームの位置と大きさを返します。
+    #
+    # stream_size はストリームパディングを含まないバイト数です。
+    #
+    def self.stream_ranges(io)
+      ranges = []
+      pos = io.size
+      while pos > 0
+        index, pos = read_stream(io, pos)
+        ranges << [pos, index.stream_size, index.uncompressed_size]
+      end
+
+      raise LZMA::FormatError, "empty file" if ranges.empty?
+
+      ranges.reverse!
+    end
+  end
+
+  #
+  # 既存の xz ファイルの後ろに、新たな xz ストリームを追記します。
+  #
+  # 既存のデータを伸張・再圧縮することはなく、追記の前には最後のストリームのフッタとインデックスのみを確認します。
+  #
+  # 追記されたファイルは LZMA::CONCATENATED を与えた伸張器 (や xz コマンド) で伸張できます。
+  #
+  #   LZMA::Appender.open("events.xz", align: 4096, index: true) do |app|
+  #     app.append(hourly_events)
+  #   end
+  #
+  class Appender
+    INDEX_MAGIC = "XZAPIDX\x01".b
+    INDEX_HEADER_FORMAT = "Q<L<"    # xz ファイルの大きさ, ストリームの数
+    INDEX_HEADER_SIZE = 12
+    INDEX_ENTRY_FORMAT = "Q<L<"     # ストリームパディングのバイト数, インデックスのバイト数
+    INDEX_ENTRY_SIZE = 12
+
+    attr_reader :path, :io, :align, :index_path
+
+    #
+    # call-seq:
+    #   open(path, preset = LZMA::PRESET_DEFAULT, align: 4, index: nil, **opts) -> appender
+    #   open(path, filter..., align: 4, index: nil, **opts) -> appender
+    #   open(...) { |appender| ... } -> yield return value
+    #
+    # [path]
+    #   xz ファイルのパスです。存在しない場合は作成します。
+    # [preset, filter, opts]
+    #   追記するストリームの圧縮に用いる設定で、LZMA.encode と同じです。
+    # [align]
+    #   新たなストリームの開始位置をこの値の倍数にそろえます。
+    #   間はストリームパディング (0 のバイト列) で埋められます。4 の倍数である必要があります。
+    # [index]
+    #   真を与えると、すべてのストリームのインデックスを連結して LZMA::Appender#index で参照できるようにします。
+    #   文字列を与えると、連結したインデックスを復元するための情報をそのパスに保存します
+    #   (+true+ の場合は <tt>path + ".idx"</tt> です)。
+    #   保存した情報が xz ファイルと一致する場合は、ファイル全体をたどることなく復元します。
+    #
+    #   保存する情報は各ストリームのフッタとインデックスを並べたもので、
+    #   壊れている場合や xz ファイルと一致しない場合は無視してファイル全体をたどります。
+    #
+    def self.open(path, *args, **opts)
+      app = new(path, *args, **opts)
+      return app unless block_given?
+
+      begin
+        yield(app)
+      ensure
+        app.close
+      end
+    end
+
+    def initialize(path, *args, align: 4, index: nil, **opts)
+      unless align > 0 && align % 4 == 0
+        raise ArgumentError, "align must be a positive multiple of 4 (given #{align})"
+      end
+
+      @path = path
+      @args = args
+      @opts = opts
+      @align = align
+      @index_path = (index == true ? "#{path}.idx" : index)
+      @io = File.open(path, File::RDWR | File::CREAT | File::BINARY)
+      @streams = (index ? [] : nil)
+      @index = nil
+
+      begin
+        setup
+      rescue Exception
+        @io.close
+        raise
+      end
+    end
+
+    #
+    # すべてのストリームを連結したインデックスを返します。open の際に index を与えなかった場合は +nil+ です。
+    #
+    # 追記するたびに新たなインスタンスとなります。
+    #
+    def index
+      return nil unless @streams
+      @index ||= build_index
+    end
+
+    #
+    # call-seq:
+    #   append(data) -> self
+    #   append { |encoder| ... } -> self
+    #
+    # data、またはブロックで LZMA::Encoder に書き込んだデータを、新たな xz ストリームとして追記します。
+    #
+    # ブロックの中で例外が発生した場合は、ファイルを追記する前の大きさに戻してから例外を伝えます。
+    #
+    # 追記する間はファイルに File::LOCK_EX の flock をかけます。
+    # ファイルが LZMA::Recompressor などによって別のファイルに置き換えられていた場合は、
+    # 置き換えた後のファイルを開きなおしてから追記します (LZMA::Appender#io も変わります)。
+    #
+    def append(data = nil)
+      raise IOError, "closed appender" if @io.closed?
+
+      lock
+      origsize = pos = @io.size
+      begin
+        padding = (-pos) % align
+        if padding > 0
+          @io.pwrite("\0" * padding, pos)
+          pos += padding
+        end
+
+        @io.seek(pos)
+        LZMA.encode(@io, *@args, **@opts) do |encoder|
+          encoder << data if data
+          yield(encoder) if block_given?
+        end
+        @io.flush
+      rescue Exception
+        # LZMA.encode は例外が発生しても閉じたストリームを書き込むため、パディングを含めて取り除く
+        @io.flush rescue nil
+        @io.truncate(origsize)
+        raise
+      end
+
+      if @streams
+        @streams[-1][2] += padding if !@streams.empty?
+        @streams << read_stream_entry(@io.size)[0]
+        @index = nil
+      end
+
+      self
+    ensure
+      @io.flock(File::LOCK_UN) unless @io.closed?
+    end
+
+    alias << append
+
+    def close
+      return nil if @io.closed?
+      save_index if @index_path
+      @io.close
+      nil
+    end
+
+    def closed?
+      @io.closed?
+    end
+
+    private
+
+    # ロックを得るまでの間に path が別のファイルに置き換えられていれば、開きなおしてたどりなおす
+    def lock
+      loop do
+        @io.flock(File::LOCK_EX)
+        current = File.stat(@path) rescue nil
+        opened = @io.stat
+        return if current && current.ino == opened.ino && current.dev == opened.dev
+
+        io = File.open(@path, File::RDWR | File::CREAT | File::BINARY)
+        @io.close
+        @io = io
+        @streams = [] if @streams
+        @index = nil
+        setup
+      end
+    end
+
+    # @streams の要素は [フッタ, インデックス, ストリームパディングのバイト数]
+    def read_stream_entry(endpos)
+      index, startpos = Index.read_stream(@io, endpos)
+      footerpos = startpos + index.stream_size - Index::FOOTER_SIZE
+      footer = Aux.pread(@io, Index::FOOTER_SIZE, footerpos)
+      rawindex = Aux.pread(@io, index.size, footerpos - index.size)
+      [[footer, rawindex, index.file_size - index.stream_size], startpos]
+    end
+
+    def setup
+      size = @io.size
+      return if size == 0
+
+      if size % 4 != 0
+        raise LZMA::FormatError, "not a xz file (size is not a multiple of 4) - #{path}"
+      end
+
+      if @streams
+        @streams = load_index(size) || scan_streams(size)
+      else
+        Index.read_stream(@io, size)
+      end
+    end
+
+    def scan_streams(size)
+      streams = []
+      pos = size
+      while pos > 0
+        entry, pos = read_stream_entry(pos)
+        streams.unshift entry
+      end
+      streams
+    end
+
+    #
+    # 保存した情報は INDEX_MAGIC、INDEX_HEADER_FORMAT の後に、ストリームごとに
+    # INDEX_ENTRY_FORMAT、フッタ (Index::FOOTER_SIZE バイト)、インデックスを並べたものです。
+    #
+    def load_index(size)
+      return nil unless @index_path && File.exist?(@index_path)
+      data = File.binread(@index_path)
+      return nil unless data.byteslice(0, INDEX_MAGIC.bytesize) == INDEX_MAGIC
+
+      pos = INDEX_MAGIC.bytesize
+      return nil if pos + INDEX_HEADER_SIZE > data.bytesize
+      filesize, num = data.unpack(INDEX_HEADER_FORMAT, offset: pos)
+      return nil unless filesize == size && num > 0
+      pos += INDEX_HEADER_SIZE
+
+      streams = []
+      num.times do
+        return nil if pos + INDEX_ENTRY_SIZE + Index::FOOTER_SIZE > data.bytesize
+        padding, indexsize = data.unpack(INDEX_ENTRY_FORMAT, offset: pos)
+        pos += INDEX_ENTRY_SIZE
+        footer = data.byteslice(pos, Index::FOOTER_SIZE)
+        pos += Index::FOOTER_SIZE
+        return nil if pos + indexsize > data.bytesize
+        streams << [footer, data.byteslice(pos, indexsize), padding]
+        pos += indexsize
+      end
+      return nil unless pos == data.bytesize
+
+      # 最後のストリームのフッタとインデックスが xz ファイルと一致することを確認する
+      footer, rawindex, padding = streams[-1]
+      footerpos = size - padding - Index::FOOTER_SIZE
+      return nil if footerpos - rawindex.bytesize < 0
+      return nil unless Aux.pread(@io, Index::FOOTER_SIZE, footerpos) == footer
+      return nil unless Aux.pread(@io, rawindex.bytesize, footerpos - rawindex.bytesize) == rawindex
+
+      streams
+    end
+
+    def save_index
+      return unless @streams
+      data = INDEX_MAGIC + [@io.size, @streams.size].pack(INDEX_HEADER_FORMAT)
+      @streams.each do |footer, rawindex, padding|
+        data << [padding, rawindex.bytesize].pack(INDEX_ENTRY_FORMAT) << footer << rawindex
+      end
+      tmp = "#{@index_path}.tmp"
+      File.binwrite(tmp, data)
+      File.rename(tmp, @index_path)
+    end
+
+    def build_index
+      indexes = @streams.map { |footer, rawindex, padding| Index.decode(rawindex, footer, padding) }
+      return nil if indexes.empty?
+      indexes.drop(1).each_with_object(indexes[0]) { |i, all| all.cat(i) }
+    end
+  end
+
+  #
+  # 個別に圧縮した固定長のチャンクとしてデータをメモリ上に保持し、必要な部分のみを伸張して参照します。
+  #
+  # 各チャンクは生の LZMA2 データ列 (LZMA::Stream::RawEncoder) として圧縮され、
+  # 一つの文字列に連結されます。チャンクの位置は 64 ビット整数を詰めた文字列として保持します。
+  #
+  # 読み込みの際は、範囲に含まれるチャンクのみを (複数であれば並列に) 伸張します。
+  # 最近伸張したチャンクはいくつか保持され、同じチャンクへの続けての参照では伸張しません。
+  #
+  #   table = LZMA::CompressedBuffer.new(File.binread("table.bin"))
+  #   table.byteslice(1234567, 16)
+  #
+  class CompressedBuffer
+    #
+    # チャンクの大きさの既定値です。
+    #
+    CHUNK_SIZE = 64 * 1024 # 64 KiB
+
+    #
+    # 伸張したチャンクを保持する数の既定値です。
+    #
+    CACHE_SIZE = 4
+
+    #
+    # 一度に圧縮するチャンクの数です。圧縮器の作業メモリ量を抑えるために区切ります。
+    #
+    BATCH_SIZE = 64
+
+    attr_reader :bytesize, :chunk_size, :chunk_count
+
+    alias size bytesize
+
+    #
+    # call-seq:
+    #   new(data, chunk_size: CHUNK_SIZE, preset: LZMA::PRESET_DEFAULT, threads: 0, cache: CACHE_SIZE) -> compressed buffer
+    #
+    # [data]
+    #   保持するデータです。複写して圧縮するため、その後の変更は反映されません。
+    # [chunk_size]
+    #   チャンクの伸張後の大きさです。小さくすると読み込みが速くなり、圧縮率が低下します。
+    # [preset]
+    #   LZMA2 の圧縮プリセット値です。辞書の大きさはチャンクを収めるのに十分な大きさまで縮められます。
+    # [threads]
+    #   圧縮と伸張に用いるスレッドの数です。0 の場合は CPU の数となります。
+    # [cache]
+    #   伸張したチャンクを保持する数です。0 を与えると保持しません。
+    #
+    def initialize(data, chunk_size: CHUNK_SIZE, preset: LZMA::PRESET_DEFAULT, threads: 0, cache: CACHE_SIZE)
+      raise ArgumentError, "wrong chunk size (#{chunk_size} for 1..)" unless chunk_size > 0
+
+      data = String(data).b
+      @bytesize = data.bytesize
+      @chunk_size = chunk_size
+      @chunk_count = (@bytesize + chunk_size - 1) / chunk_size
+      @threads = threads
+      @cache_size = cache
+      @cache = {}
+      @lock = Mutex.new
+
+      dictsize = 4096
+      dictsize <<= 1 while dictsize < chunk_size
+      @filter = Filter::LZMA2.new(preset)
+      @filter.dictsize = dictsize if dictsize < @filter.dictsize
+
+      @data = "".b
+      offsets = [0]
+      (0...@chunk_count).each_slice(BATCH_SIZE) do |batch|
+        entries = batch.map do |i|
+          src = data.byteslice(i * chunk_size, chunk_size)
+          [Stream::RawEncoder.new(@filter), src, "".b, src.bytesize + (src.bytesize >> 4) + 64, LZMA::FINISH]
+        end
+        statuses = Stream.code_all(entries, threads: threads)
+        entries.zip(statuses) do |e, s|
+          Utils.raise_err s unless s == LZMA::STREAM_END
+          @data << e[2]
+          offsets << @data.bytesize
+        end
+      end
+      @data.freeze
+      @offsets = offsets.pack("Q<*").freeze
+    end
+
+    #
+    # 圧縮したデータとチャンクの位置の表の合計バイト数を返します。伸張したチャンクの保持分は含みません。
+    #
+    def compressed_size
+      @data.bytesize + @offsets.bytesize
+    end
+
+    #
+    # call-seq:
+    #   byteslice(offset) -> string or nil
+    #   byteslice(offset, length) -> string or nil
+    #   byteslice(range) -> string or nil
+    #
+    # String#byteslice と同じように、伸張後のデータの一部を返します。
+    #
+    def byteslice(off, len = nil)
+      if off.kind_of?(Range)
+        raise ArgumentError, "wrong number of arguments (given 2, expected 1)" if len
+        first = off.begin || 0
+        first += @bytesize if first < 0
+        last = off.end || -1
+        last += @bytesize if last < 0
+        last += 1 unless off.end && off.exclude_end?
+        len = last - first
+      else
+        first = off
+        first += @bytesize if first < 0
+        if len.nil?
+          return nil if first >= @bytesize
+          len = 1
+        end
+      end
+
+      return nil if first < 0 || first > @bytesize || len < 0
+      len = @bytesize - first if first + len > @bytesize
+      read(first, len)
+    end
+
+    alias [] byteslice
+
+    #
+    # call-seq:
+    #   each_chunk { |chunk| ... } -> self
+    #   each_chunk -> enumerator
+    #
+    # 伸張したチャンクを順に渡します。
+    #
+    def each_chunk
+      return to_enum(__method__) unless block_given?
+      (0...@chunk_count).each { |i| yield chunks([i])[0] }
+      self
+    end
+
+    #
+    # すべてのデータを伸張して返します。
+    #
+    def to_s
+      read(0, @bytesize)
+    end
+
+    def inspect
+      "#<#{self.class} bytesize=#{@bytesize} compressed_size=#{compressed_size} chunk_size=#{@chunk_size}>"
+    end
+
+    private
+
+    def read(first, len)
+      return "".b if len == 0
+      indexes = (first / @chunk_size .. (first + len - 1) / @chunk_size).to_a
+      buf = "".b
+      indexes.zip(chunks(indexes)) do |i, chunk|
+        head = (i == indexes[0] ? first - i * @chunk_size : 0)
+        buf << chunk.byteslice(head, len - buf.bytesize)
+      end
+      buf
+    end
+
+    def chunks(indexes)
+      found = @lock.synchronize { indexes.map { |i| (c = @cache.delete(i)) ? @cache[i] = c : nil } }
+      missing = indexes.each_index.reject { |n| found[n] }
+      return found if missing.empty?
+
+      entries = missing.map do |n|
+        i = indexes[n]
+        off, nextoff = @offsets.unpack("Q<2", offset: i * 8)
+        size = (i + 1 < @chunk_count ? @chunk_size : @bytesize - i * @chunk_size)
+        # LZMA2 の終端まで読ませるため、出力に 1 バイトの余裕を与える
+        [Stream::RawDecoder.new(@filter), @data.byteslice(off, nextoff - off), "".b, size + 1, LZMA::FINISH]
+      end
+      statuses = Stream.code_all(entries, threads: entries.size > 1 ? @threads : 1)
+      missing.zip(entries, statuses) do |n, e, s|
+        Utils.raise_err s unless s == LZMA::STREAM_END
+        found[n] = e[2].freeze
+      end
+
+      @lock.synchronize do
+        missing.last(@cache_size).each { |n| @cache[indexes[n]] = found[n] } if @cache_size > 0
+        @cache.shift while @cache.size > @cache_size
+      end
+
+      found
+    end
+  end
+
+  #
+  # 小さな記録を追記し、記録番号から個別に取り出すための圧縮された記録ファイルです。
+  #
+  # 記録はある程度の大きさ (または時間) ごとにまとめて一つの xz ストリームとして LZMA::Appender で追記されます。
+  # 各記録の位置 (まとまりの位置と、その中での位置) は <tt>path + ".rec"</tt> に保存され、
+  # LZMA::RecordLog#get は一つのまとまりのみを伸張します。
+  #
+  # 記録番号は 0 から始まる連番です。
+  #
+  #   LZMA::RecordLog.open("events.xz") do |log|
+  #     id = log.append(event.to_json)
+  #     log.get(id)
+  #   end
+  #
+  # 追記した記録はまとまりが閉じられるまでメモリ上にあります。
+  # LZMA::RecordLog#sync を呼ぶか、close した時点でファイルに書き込まれ、fsync されます。
+  # 途中で異常終了した場合は、位置の保存されていない記録を open の際に取り除きます。
+  #
+  # 記録の位置は xz ファイルの中のバイト位置であるため、記録ファイルを LZMA::Recompressor で圧縮しなおしてはいけません。
+  #
+  class RecordLog
+    include Enumerable
+
+    #
+    # まとまりを閉じる大きさ (伸張後のバイト数) の既定値です。
+    #
+    BLOCK_SIZE = 1 << 20 # 1 MiB
+
+    #
+    # まとまりを閉じる時間 (秒) の既定値です。
+    #
+    BLOCK_INTERVAL = 5.0
+
+    #
+    # まとまりを閉じた後に fsync する間隔 (秒) の既定値です。
+    #
+    SYNC_INTERVAL = 1.0
+
+    MAGIC = "XZRECLG\x01".b
+    ENTRY_FORMAT = "Q<3L<"
+    ENTRY_SIZE = 28
+    RECORD_MAX = 0xffffffff
+
+    attr_reader :path, :index_path
+
+    #
+    # call-seq:
+    #   open(path, preset = LZMA::PRESET_DEFAULT, readonly: false, block_size: BLOCK_SIZE, block_interval: BLOCK_INTERVAL, sync_interval: SYNC_INTERVAL, **opts) -> record log
+    #   open(...) { |record log| ... } -> yield return value
+    #
+    # [preset, opts]
+    #   まとまりの圧縮に用いる設定で、LZMA.encode と同じです。
+    # [readonly]
+    #   真を与えると、読み込みのみを行います。
+    # [block_size]
+    #   まとまりがこの大きさ以上となると閉じて書き込みます。
+    # [block_interval]
+    #   まとまりの最初の記録からこの秒数を過ぎて append すると、まとまりを閉じて書き込みます。
+    #   +nil+ を与えると時間では閉じません。
+    # [sync_interval]
+    #   まとまりを閉じた際、前回の fsync からこの秒数を過ぎていれば fsync します。
+    #   0 を与えるとまとまりを閉じるたびに、+nil+ を与えると LZMA::RecordLog#sync と close の際のみ fsync します。
+    #
+    def self.open(path, *args, **opts)
+      log = new(path, *args, **opts)
+      return log unless block_given?
+
+      begin
+        yield(log)
+      ensure
+        log.close
+      end
+    end
 
-      def finish
-        self
+    def initialize(path, *args, readonly: false, block_size: BLOCK_SIZE, block_interval: BLOCK_INTERVAL, sync_interval: SYNC_INTERVAL, **opts)
+      @path = path
+      @index_path = "#{path}.rec"
+      @block_size = block_size
+      @block_interval = block_interval
+      @sync_interval = sync_interval
+      @blocks = []    # 要素は [ストリームの位置, ストリームのバイト数, 最初の記録番号, 記録の数, 各記録の終わりの位置]
+      @count = 0
+      @pending = "".b
+      @pending_ends = []
+      @pending_since = nil
+      @cache = nil
+
+      if readonly
+        @io = File.open(path, "rb")
+        @side = nil
+        load_entries(File.exist?(@index_path) ? File.binread(@index_path) : "".b)
+      else
+        # 記録ファイルではない xz ファイルを切り詰めないようにする
+        if File.size?(path) && !File.size?(@index_path)
+          raise LZMA::FormatError, "record index not found - #{@index_path}"
+        end
+
+        @side = File.open(@index_path, File::RDWR | File::CREAT | File::BINARY)
+        recover(path)
+        @appender = Appender.new(path, *args, **opts)
+        @io = @appender.io
+        @synced_at = now
       end
+    rescue Exception
+      @side&.close
+      @io&.close if readonly
+      raise
+    end
 
-      def reset
-        self.state = init
-        self
+    #
+    # 記録の数を返します。まだ書き込まれていない記録も含みます。
+    #
+    def size
+      @count + @pending_ends.size
+    end
+
+    alias count size
+
+    #
+    # call-seq:
+    #   append(record) -> id
+    #
+    # 記録を追加し、その記録番号を返します。
+    #
+    def append(record)
+      raise IOError, "not opened for writing" unless @side
+      raise IOError, "closed record log" if closed?
+
+      record = String(record).b
+      if record.bytesize > RECORD_MAX
+        raise ArgumentError, "record too large (#{record.bytesize} for ..#{RECORD_MAX})"
+      end
+
+      seal if @pending.bytesize + record.bytesize > RECORD_MAX
+      seal if @block_interval && @pending_since && now - @pending_since >= @block_interval
+
+      id = size
+      @pending << record
+      @pending_ends << @pending.bytesize
+      @pending_since ||= now
+      seal if @pending.bytesize >= @block_size
+
+      id
+    end
+
+    def <<(record)
+      append(record)
+      self
+    end
+
+    #
+    # call-seq:
+    #   get(id) -> string or nil
+    #
+    # 記録番号 id の記録を返します。存在しない場合は +nil+ を返します。
+    #
+    # 記録を含むまとまりのみを伸張します。直前に伸張したまとまりは保持されます。
+    #
+    def get(id)
+      return nil unless id >= 0 && id < size
+
+      if id >= @count
+        n = id - @count
+        return record_at(@pending, @pending_ends.pack("L<*"), n)
       end
 
-      def digest
-        [state].pack("N")
+      i = @blocks.bsearch_index { |b| b[2] + b[3] > id }
+      record_at(block_data(i), @blocks[i][4], id - @blocks[i][2])
+    end
+
+    alias [] get
+
+    #
+    # call-seq:
+    #   each(from = 0) { |record| ... } -> self
+    #   each(from = 0) -> enumerator
+    #
+    # 記録番号 from 以降の記録を順に渡します。
+    #
+    def each(from = 0)
+      return to_enum(__method__, from) unless block_given?
+
+      i = @blocks.bsearch_index { |b| b[2] + b[3] > from } || @blocks.size
+      (i...@blocks.size).each do |j|
+        data = block_data(j)
+        _, _, first, num, ends = @blocks[j]
+        ([from - first, 0].max...num).each { |n| yield record_at(data, ends, n) }
+      end
+
+      ends = @pending_ends.pack("L<*")
+      ([from - @count, 0].max...@pending_ends.size).each { |n| yield record_at(@pending, ends, n) }
+
+      self
+    end
+
+    #
+    # 現在のまとまりを閉じて、xz ストリームとして書き込みます。
+    #
+    def seal
+      return self if @pending.empty?
+
+      io = @appender.io
+      before = io.size
+      start = before + (-before) % @appender.align
+      @appender.append(@pending)
+
+      ends = @pending_ends.pack("L<*")
+      entry = [start, io.size - start, @count, @pending_ends.size].pack(ENTRY_FORMAT) << ends
+      @side.seek(0, IO::SEEK_END)
+      @side.write(entry)
+      @side.flush
+
+      @blocks << [start, io.size - start, @count, @pending_ends.size, ends.freeze]
+      @count += @pending_ends.size
+      @pending = "".b
+      @pending_ends.clear
+      @pending_since = nil
+
+      fsync if @sync_interval && now - @synced_at >= @sync_interval
+
+      self
+    end
+
+    #
+    # 現在のまとまりを閉じて書き込み、fsync します。戻った時点で、それまでに追加した記録は永続化されています。
+    #
+    def sync
+      raise IOError, "not opened for writing" unless @side
+      seal
+      fsync
+      self
+    end
+
+    def close
+      return nil if closed?
+      if @side
+        sync
+        @appender.close
+        @side.close
+      else
+        @io.close
+      end
+      nil
+    end
+
+    def closed?
+      @io.closed?
+    end
+
+    private
+
+    def now
+      Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    end
+
+    # xz ファイル、位置の順に fsync することで、位置が指す先のストリームが必ず存在するようにする
+    def fsync
+      @io.fsync
+      @side.fsync
+      @synced_at = now
+    end
+
+    def record_at(data, ends, n)
+      head = (n == 0 ? 0 : ends.unpack1("L<", offset: (n - 1) * 4))
+      data.byteslice(head, ends.unpack1("L<", offset: n * 4) - head)
+    end
+
+    def block_data(i)
+      return @cache[1] if @cache && @cache[0] == i
+      pos, size, = @blocks[i]
+      data = LZMA.decode(Aux.pread(@io, size, pos))
+      @cache = [i, data]
+      data
+    end
+
+    def load_entries(data, datasize = nil)
+      if data.empty?
+        return 0
+      elsif data.byteslice(0, MAGIC.bytesize) != MAGIC
+        raise LZMA::FormatError, "not a record index - #{@index_path}"
       end
 
-      def hexdigest
-        "%08x" % state
+      pos = MAGIC.bytesize
+      while pos + ENTRY_SIZE <= data.bytesize
+        start, size, first, num = data.unpack(ENTRY_FORMAT, offset: pos)
+        break if first != @count || pos + ENTRY_SIZE + num * 4 > data.bytesize
+        break if datasize && start + size > datasize
+
+        @blocks << [start, size, first, num, data.byteslice(pos + ENTRY_SIZE, num * 4).freeze]
+        @count += num
+        pos += ENTRY_SIZE + num * 4
       end
 
-      alias to_s hexdigest
+      pos
+    end
 
-      def to_str
-        "CRC32 <#{hexdigest}>"
+    # 書き込みの途中で終了した場合に、位置の保存されていない部分を取り除く
+    def recover(path)
+      datasize = File.exist?(path) ? File.size(path) : 0
+      validsize = load_entries(@side.read, datasize)
+      if validsize == 0
+        @side.truncate(0)
+        @side.write(MAGIC)
+        @side.flush
+      else
+        @side.truncate(validsize)
       end
 
-      alias inspect to_str
+      last = @blocks[-1]
+      File.truncate(path, last ? last[0] + last[1] : 0) if File.exist?(path)
     end
+  end
+
+  #
+  # 速いプリセットで書き込んだ xz ファイルを、バックグラウンドで高い圧縮率のプリセットで圧縮しなおします。
+  #
+  # 圧縮しなおしたデータは一時ファイルに書き込まれ、fsync した後に rename で元のファイルと置き換えられます。
+  # このため、途中で異常終了した場合でも元のファイルか圧縮しなおしたファイルのどちらかが残ります。
+  # 置き換えたファイルのパーミッションと (可能であれば) 所有者は元のファイルと同じになります。
+  #
+  # 処理の間 (読み込みから rename まで) は元のファイルに File::LOCK_EX の flock をかけます。
+  # 圧縮しなおす対象のファイルに追記するプログラムは、書き込む間 File::LOCK_EX の flock をかけ、
+  # ロックを得た後にそのファイルがまだ同じパスにある (File#stat と File.stat(path) の ino が等しい) ことを
+  # 確かめる必要があります (置き換えられていた場合は開きなおします)。
+  # flock を用いない書き込みは、圧縮しなおしたファイルから失われることがあります。
+  # LZMA::Appender#append はこの手順に従います。LZMA::RecordLog の記録ファイルは対象とすることができません。
+  #
+  # 処理中のファイルを再び LZMA::Recompressor#ingest や LZMA::Recompressor#enqueue で与えると、
+  # 処理を終えた後にもう一度処理します。
+  #
+  # ジャーナルを与えると、処理待ちのファイルを記録します。同じジャーナルを与えて生成しなおすと、
+  # 終わっていなかったファイルを再び処理します。
+  #
+  #   rec = LZMA::Recompressor.new(threads: 2, nice: 10, bytes_per_sec: 50 << 20, journal: "recompress.journal")
+  #   rec.ingest("2024-01-01.log.xz", data)   # プリセット 1 で書き込み、圧縮しなおす対象に加える
+  #   ...
+  #   rec.shutdown
+  #
+  class Recompressor
+    #
+    # LZMA::Recompressor#ingest が用いるプリセット値です。
+    #
+    INGEST_PRESET = 1
+
+    #
+    # 圧縮しなおす際のプリセット値の既定値です。
+    #
+    TARGET_PRESET = 9 | LZMA::PRESET_EXTREME
+
+    BLOCKSIZE = 256 * 1024 # 256 KiB
 
-    # 
-    # CRC64 を Digest のように生成できるようになります。
+    TEMP_SUFFIX = ".recompress"
+
+    attr_reader :journal_path
+
+    #
+    # call-seq:
+    #   new(preset = TARGET_PRESET, threads: 1, nice: nil, bytes_per_sec: nil, journal: nil) -> recompressor
+    #   new(preset = TARGET_PRESET, ...) { |path, progress| ... } -> recompressor
+    #
+    # 処理を行うスレッドを開始します。
     #
-    class CRC64 < Struct.new(:state, :init)
-      def initialize(state = 0)
-        state = state.to_i
-        super(state, state)
+    # [preset]
+    #   圧縮しなおす際のプリセット値、または LZMA::Filter の配列です。
+    # [threads]
+    #   同時に処理するファイルの数 (スレッドの数) です。
+    # [nice]
+    #   処理を行うスレッドの nice 値です。LZMA::Utils.thread_nice を見てください。
+    # [bytes_per_sec]
+    #   すべてのスレッドを合わせた、読み込みと書き込みの 1 秒あたりのバイト数の上限です。
+    # [journal]
+    #   処理待ちのファイルを記録するジャーナルのパスです。
+    # [YIELD path, progress]
+    #   ファイルを処理し終えるたびに、そのパスと LZMA::Recompressor#progress の値が渡されます。
+    #   処理を行うスレッドから呼ばれます。
+    #
+    def initialize(preset = TARGET_PRESET, threads: 1, nice: nil, bytes_per_sec: nil, journal: nil, &on_progress)
+      raise ArgumentError, "wrong threads (#{threads} for 1..)" unless threads >= 1
+
+      @filters = Array(preset.kind_of?(Numeric) ? Filter::LZMA2.new(preset) : preset)
+      @nice = nice
+      @rate = bytes_per_sec
+      @on_progress = on_progress
+      @journal_path = journal
+      @queue = Queue.new
+      @lock = Mutex.new
+      @idle = ConditionVariable.new
+      @next_time = 0.0
+      @stats = { pending: 0, active: 0, done: 0, failed: 0, bytes_in: 0, bytes_out: 0 }
+      @errors = {}
+      @queued = {}    # 待ち行列にあるパス
+      @active = {}    # 処理中のパスと、終えた後に再び処理するかどうか
+
+      if @journal_path
+        load_journal
+        @queued.each_key { |path| @queue << path }
+        @stats[:pending] = @queued.size
       end
 
-      # 
-      # call-seq:
-      #   LZMA::Utils::CRC64#update(data) -> self
-      #
-      def update(data)
-        self.state = Utils.crc64(data, state)
-        self
+      @workers = Array.new(threads) { Thread.new { work } }
+    end
+
+    #
+    # call-seq:
+    #   ingest(path, data = nil) -> self
+    #   ingest(path) { |encoder| ... } -> self
+    #
+    # data (またはブロックで LZMA::Encoder に書き込んだデータ) を INGEST_PRESET で圧縮して path に書き込み、
+    # 圧縮しなおす対象に加えます。書き込みは一時ファイルと rename によって行われます。
+    #
+    def ingest(path, data = nil)
+      tmp = "#{path}.ingest"
+      File.open(tmp, "wb") do |f|
+        LZMA.encode(f, INGEST_PRESET) do |encoder|
+          encoder << data if data
+          yield(encoder) if block_given?
+        end
+        f.fsync
       end
+      File.rename(tmp, path)
+      enqueue(path)
+    ensure
+      File.unlink(tmp) if tmp && File.exist?(tmp)
+    end
 
-      alias << update
+    #
+    # call-seq:
+    #   enqueue(path) -> self
+    #
+    # 既存の xz ファイルを圧縮しなおす対象に加えます。
+    #
+    def enqueue(path)
+      raise IOError, "recompressor already shut down" if @workers.empty?
+
+      path = path.to_s
+      @lock.synchronize do
+        return self if @queued.key?(path) || @active[path]
+        @stats[:pending] += 1
+        journal("+", path)
+
+        # 処理中のファイルは、終えた後に処理を行うスレッドが待ち行列に戻す
+        if @active.key?(path)
+          @active[path] = true
+          return self
+        end
 
-      def finish
-        self
+        @queued[path] = true
       end
+      @queue << path
 
-      def reset
-        self.state = init
-        self
+      self
+    end
+
+    alias << enqueue
+
+    #
+    # 処理の状況を返します。
+    #
+    # [pending]     処理待ちのファイルの数 (処理中を含みます)
+    # [active]      処理中のファイルの数
+    # [done]        処理し終えたファイルの数
+    # [failed]      失敗したファイルの数 (LZMA::Recompressor#errors で例外を確認できます)
+    # [bytes_in]    処理し終えたファイルの、処理前の合計バイト数
+    # [bytes_out]   処理し終えたファイルの、処理後の合計バイト数
+    #
+    def progress
+      @lock.synchronize { @stats.dup }
+    end
+
+    #
+    # 失敗したファイルのパスと例外の Hash を返します。
+    #
+    def errors
+      @lock.synchronize { @errors.dup }
+    end
+
+    #
+    # 処理待ちのファイルがなくなるまで待ちます。
+    #
+    def wait
+      @lock.synchronize { @idle.wait(@lock) while @stats[:pending] > 0 }
+      self
+    end
+
+    #
+    # call-seq:
+    #   shutdown(wait: true) -> nil
+    #
+    # スレッドを終了します。
+    #
+    # wait に偽を与えると、処理待ちのファイルを残して終了します。残ったファイルはジャーナルに記録されたままとなります。
+    #
+    def shutdown(wait: true)
+      return nil if @workers.empty?
+      self.wait if wait
+      @queue.close
+      @workers.each(&:join)
+      @workers = []
+      nil
+    end
+
+    private
+
+    def work
+      Utils.thread_nice(@nice) if @nice
+
+      while path = @queue.pop
+        @lock.synchronize do
+          @queued.delete(path)
+          @active[path] = false
+          @stats[:active] += 1
+        end
+        error = nil
+        begin
+          sizes = recompress(path)
+        rescue => error
+        end
+
+        requeue = @lock.synchronize do
+          @stats[:active] -= 1
+          @stats[:pending] -= 1
+          requeue = @active.delete(path)
+          if error
+            # 処理中に置き換えられたための失敗は、もう一度処理するため数えない
+            unless requeue
+              @stats[:failed] += 1
+              @errors[path] = error
+            end
+          else
+            @stats[:done] += 1
+            @stats[:bytes_in] += sizes[0]
+            @stats[:bytes_out] += sizes[1]
+          end
+          if requeue
+            @queued[path] = true
+          else
+            journal("-", path)
+          end
+          @idle.broadcast if @stats[:pending] == 0
+          requeue
+        end
+
+        begin
+          @queue << path if requeue
+        rescue ClosedQueueError
+          # shutdown(wait: false) の後はジャーナルに残したままとする
+        end
+
+        begin
+          @on_progress&.(path, progress)
+        rescue => e
+          # ブロックの例外でスレッドが終了すると、wait や shutdown が戻らなくなる
+          warn "extlzma: exception in LZMA::Recompressor callback (#{path}): #{e.class}: #{e.message}"
+        end
       end
+    end
+
+    def recompress(path)
+      tmp = "#{path}#{TEMP_SUFFIX}"
+
+      File.open(path, "rb") do |src|
+        # 置き換えを終えるまで、flock を用いる書き込みを待たせる
+        src.flock(File::LOCK_EX)
+        before = src.stat
+
+        File.open(tmp, "wb") do |dest|
+          LZMA.encode(dest, *@filters) do |encoder|
+            LZMA.decode(src, nil, LZMA::CONCATENATED) do |decoder|
+              buf = "".b
+              inpos = outpos = 0
+              while decoder.read(BLOCKSIZE, buf)
+                encoder << buf
+                throttle(src.pos - inpos + dest.pos - outpos)
+                inpos, outpos = src.pos, dest.pos
+              end
+            end
+          end
+          copy_attributes(dest, before)
+          dest.fsync
+        end
+
+        # flock を用いずに書き換えられたファイルは置き換えない
+        after = File.stat(path)
+        unless after.size == before.size && after.mtime == before.mtime && after.ino == before.ino
+          raise IOError, "file changed during recompression - #{path}"
+        end
+
+        sizes = [before.size, File.size(tmp)]
+        File.rename(tmp, path)
+        fsync_dir(path)
 
-      def digest
-        [state].pack("Q>")
+        sizes
       end
+    ensure
+      File.unlink(tmp) if File.exist?(tmp)
+    end
 
-      def hexdigest
-        "%016x" % state
+    # chown は setuid などのビットを落とすことがあるため、chmod より先に行う
+    def copy_attributes(dest, stat)
+      begin
+        dest.chown(stat.uid, stat.gid)
+      rescue Errno::EPERM
+        # 所有者を変えられない場合は、グループのみでも合わせる
+        dest.chown(nil, stat.gid) rescue nil
       end
+      dest.chmod(stat.mode & 07777)
+    end
 
-      alias to_s hexdigest
+    # 帯域の制限。次に処理してよい時刻を共有し、それより前であれば待つ
+    def throttle(bytes)
+      return unless @rate
 
-      def to_str
-        "CRC64 <#{hexdigest}>"
+      now = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+      delay = @lock.synchronize do
+        @next_time = [@next_time, now].max + bytes.fdiv(@rate)
+        @next_time - now
       end
+      sleep(delay) if delay > 0
+    end
 
-      alias inspect to_str
+    def fsync_dir(path)
+      File.open(File.dirname(path), "r") { |dir| dir.fsync }
+    rescue SystemCallError, IOError
+      # ディレクトリの fsync に対応しない環境では無視する
     end
 
-    def raise_err(lzma_ret, mesg = nil)
-      et = Utils.lookup_error(lzma_ret)
-      raise et, mesg, caller
+    # ジャーナルは "+" (追加) または "-" (終了) に続けてパスを String#dump した行からなる
+    def journal(op, path)
+      return unless @journal_path
+      File.open(@journal_path, "ab") { |f| f << "#{op}#{path.dump}\n" }
     end
-  end
 
-  extend Utils
+    # 終わっていないファイルのみを残してジャーナルを書きなおす
+    def load_journal
+      if File.exist?(@journal_path)
+        File.foreach(@journal_path, mode: "rb") do |line|
+          next unless line.end_with?("\n")
+          op, path = line[0], line[1...-1].undump
+          op == "+" ? @queued[path] = true : @queued.delete(path)
+        end
+      end
+
+      tmp = "#{@journal_path}.tmp"
+      File.binwrite(tmp, @queued.each_key.map { |path| "+#{path.dump}\n" }.join)
+      File.rename(tmp, @journal_path)
+    end
+  end
 
   #
   # extlzma の内部で利用される補助モジュールです。
@@ -493,15 +2547,24 @@ module LZMA
   # extlzma の利用者が直接利用することは想定していません。
   #
   module Aux
-    def self.encode(src, encoder)
+    def self.encode(src, encoder, into: nil)
+      case into
+      when nil
+        dest = "".force_encoding(Encoding::BINARY)
+      when :chunks
+        dest = []
+      else
+        raise ArgumentError, "wrong into - #{into.inspect} (expect nil or :chunks)"
+      end
+
       if src.kind_of?(String)
-        s = Encoder.new(encoder, "".force_encoding(Encoding::BINARY))
+        s = Encoder.new(encoder, dest)
         s << src
         s.close
         return s.outport
       end
 
-      s = Encoder.new(encoder, (src || "".force_encoding(Encoding::BINARY)))
+      s = Encoder.new(encoder, (src || dest))
       return s unless block_given?
 
       begin
@@ -511,6 +2574,207 @@ module LZMA
       end
     end
 
+    #
+    # LZMA::Decoder.resume が用いる、ブロックを順に伸張する伸張器です。
+    #
+    # LZMA::Decoder の context と inport を兼ね、inport としてはブロックヘッダを除いたブロックの本体を
+    # 一度に一つのブロックの範囲までずつ返します。context としては、ブロックの終わりに達するたびに
+    # 次のブロックの LZMA::Stream::BlockDecoder に切り替えます。
+    #
+    class BlockChain
+      #
+      # verify に LZMA::Utils::CheckPipe を与えると、liblzma による整合値の確認の代わりに、
+      # 伸張したデータと格納されている整合値を verify に渡して確認させます。
+      #
+      def initialize(io, blocks, offset, ignore_check: false, verify: nil)
+        @io = io
+        @blocks = blocks
+        @headers = []
+        @ignore_check = ignore_check || !!verify
+        @verify = verify
+        @total_out = offset
+        @readindex = 0
+        @readpos = 0
+        @codeindex = 0
+        @current = nil
+      end
+
+      attr_reader :total_out
+
+      def end
+        @current&.end
+        @current = nil
+        @verify&.close
+      end
+
+      def read(size, buf = "".b)
+        buf.clear
+        while @readindex < @blocks.size
+          block = @blocks[@readindex]
+          header = header(@readindex)
+          bodysize = block[:total_size] - header.bytesize
+          if @readpos < bodysize
+            n = [size, bodysize - @readpos].min
+            buf << Aux.pread(@io, n, block[:compressed_file_offset] + header.bytesize + @readpos)
+            @readpos += n
+            break
+          end
+          @readindex += 1
+          @readpos = 0
+        end
+
+        buf
+      end
+
+      def code(src, dest, maxdest, action)
+        return LZMA::STREAM_END if @codeindex >= @blocks.size
+
+        block = @blocks[@codeindex]
+        unless @current
+          @current = Stream::BlockDecoder.new(header(@codeindex), block[:check], ignore_check: @ignore_check)
+          @verify&.begin_block(block[:check])
+        end
+        s = @current.code(src, dest, maxdest, action)
+        @total_out += dest.bytesize
+        @verify << dest if @verify
+        return s unless s == LZMA::STREAM_END
+
+        @current = nil
+        @headers[@codeindex] = nil
+        @codeindex += 1
+        verify_block(block) if @verify
+        @codeindex < @blocks.size ? LZMA::OK : LZMA::STREAM_END
+      end
+
+      private
+
+      #
+      # 格納されている整合値を渡し、それまでに不一致が見つかっていれば例外を発生させます。
+      # 最後のブロックでは、すべての確認が終わるまで待ちます。
+      #
+      def verify_block(block)
+        size = Utils.check_size(block[:check])
+        stored = (size > 0 ? Aux.pread(@io, size, block[:compressed_file_offset] + block[:total_size] - size) : "".b)
+        @verify.end_block(stored, block[:number])
+        failed = (@codeindex < @blocks.size ? @verify.failure : @verify.wait)
+        if failed
+          Utils.raise_err LZMA::DATA_ERROR, "integrity check failed (block #{failed})"
+        end
+      end
+
+      def header(i)
+        @headers[i] ||= begin
+          pos = @blocks[i][:compressed_file_offset]
+          size = (Aux.pread(@io, 1, pos).getbyte(0) + 1) * 4
+          Aux.pread(@io, size, pos)
+        end
+      end
+    end
+
+    DECODE_STREAMS_BATCH = 64
+
+    #
+    # LZMA.decode_streams の本体です。
+    #
+    # ストリームは伸張後の大きさがインデックスからわかるため、出力に 1 バイトの余裕を与えて一度で伸張させます
+    # (余裕がないと、フッタを読む前に出力が満ちたとして LZMA::OK で止まるためです)。
+    #
+    def self.decode_streams(io, threads, max_buffer, memlimit, flags, &block)
+      batch = []
+      budget = 0
+      flush = -> {
+        decode_streams_batch(io, batch, threads, memlimit, flags, &block) unless batch.empty?
+        batch.clear
+        budget = 0
+      }
+
+      Index.stream_ranges(io).each do |range|
+        cost = range[1] + range[2]
+        if cost > max_buffer
+          flush.()
+          decode_stream_sequential(io, range, Stream::Decoder.new(memlimit, flags), &block)
+          next
+        end
+
+        flush.() if budget + cost > max_buffer || batch.size >= DECODE_STREAMS_BATCH
+        batch << range
+        budget += cost
+      end
+      flush.()
+
+      nil
+    end
+
+    def self.decode_streams_batch(io, ranges, threads, memlimit, flags)
+      entries = ranges.map do |pos, size, usize|
+        [Stream::Decoder.new(memlimit, flags), pread(io, size, pos), "".b, usize + 1, LZMA::RUN]
+      end
+      statuses = Stream.code_all(entries, threads: entries.size > 1 ? threads : 1)
+      entries.zip(statuses) do |e, s|
+        Utils.raise_err s unless s == LZMA::STREAM_END
+        e[0].end
+        yield e[2]
+      end
+    end
+
+    def self.decode_stream_sequential(io, range, context, &block)
+      pos, size, = range
+      buf = "".b
+      s = LZMA::OK
+      off = 0
+      while off < size && s == LZMA::OK
+        n = [size - off, Decoder::BLOCKSIZE].min
+        s = context.feed(pread(io, n, pos + off), buf, Decoder::BLOCKSIZE, LZMA::RUN, &block)
+        off += n
+      end
+      context.end
+
+      case s
+      when LZMA::STREAM_END
+        nil
+      when LZMA::OK
+        Utils.raise_err LZMA::BUF_ERROR, "unexpected end of stream"
+      else
+        Utils.raise_err s
+      end
+    end
+
+    def self.pread(io, size, pos)
+      if io.respond_to?(:pread)
+        buf = io.pread(size, pos)
+      else
+        io.seek(pos)
+        buf = io.read(size)
+      end
+      unless buf && buf.bytesize == size
+        raise EOFError, "unexpected end of file (#{size} bytes at #{pos})"
+      end
+      buf
+    end
+
+    def self.dump_json(obj, encoder)
+      require "json"
+
+      case obj
+      when Array
+        encoder << "["
+        obj.each_with_index do |e, i|
+          encoder << "," if i > 0
+          encoder << JSON.generate(e)
+        end
+        encoder << "]"
+      when Hash
+        encoder << "{"
+        obj.each_with_index do |(k, v), i|
+          encoder << "," if i > 0
+          encoder << JSON.generate(k.to_s) << ":" << JSON.generate(v)
+        end
+        encoder << "}"
+      else
+        encoder << JSON.generate(obj)
+      end
+    end
+
     def self.decode(src, decoder)
       if src.kind_of?(String)
         return decode(StringIO.new(src), decoder) { |s| s.read }
@@ -525,5 +2789,21 @@ module LZMA
         s.close rescue nil
       end
     end
+
+    def self.decode_offload_check(src, &block)
+      if src.kind_of?(String)
+        return decode_offload_check(StringIO.new(src)) { |s| s.read }
+      end
+
+      chain = BlockChain.new(src, Index.scan(src).each_block.to_a, 0, verify: Utils::CheckPipe.new)
+      s = Decoder.new(chain, chain)
+      return s unless block_given?
+
+      begin
+        yield(s)
+      ensure
+        s.close rescue nil
+      end
+    end
   end
 end
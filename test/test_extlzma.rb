@@ -31,6 +31,8 @@
 require "test-unit"
 require "openssl" # for OpenSSL::Random.random_bytes
 require "extlzma"
+require "tmpdir"
+require "open3"
 
 require_relative "sampledata"
 
@@ -42,12 +44,12 @@ class TestStreamAPI < Test::Unit::TestCase
   end
 
   def test_encode_args
-    assert_kind_of(LZMA::Encoder, LZMA.encode)
-    assert_kind_of(LZMA::Encoder, LZMA.encode(StringIO.new("")))
+    assert_kind_of(LZMA::Encoder, (e = LZMA.encode)); e.close
+    assert_kind_of(LZMA::Encoder, (e = LZMA.encode(StringIO.new("")))); e.close
     assert_kind_of(String, LZMA.encode { |e| e.outport })
     io = StringIO.new("")
     assert_same(io, LZMA.encode(io) { |e| io })
-    assert_kind_of(LZMA::Encoder, LZMA.encode(io, 9))
+    assert_kind_of(LZMA::Encoder, (e = LZMA.encode(io, 9))); e.close
   end
 
   def test_decode_args
@@ -56,3 +58,1181 @@ class TestStreamAPI < Test::Unit::TestCase
     assert_raise(LZMA::BufError) { LZMA.decode("") } # read error (or already EOF)
   end
 end
+
+class TestUtils < Test::Unit::TestCase
+  def test_crc_combine
+    a = "0123456789abcdefghijklmnopqrstuvwxyz".b * 37
+    b = OpenSSL::Random.random_bytes(4099)
+    assert_equal(LZMA::Utils.crc32(a + b), LZMA::Utils.crc32_combine(LZMA::Utils.crc32(a), LZMA::Utils.crc32(b), b.bytesize))
+    assert_equal(LZMA::Utils.crc64(a + b), LZMA::Utils.crc64_combine(LZMA::Utils.crc64(a), LZMA::Utils.crc64(b), b.bytesize))
+    assert_equal(LZMA::Utils.crc64(a), LZMA::Utils.crc64_combine(LZMA::Utils.crc64(a), 0, 0))
+  end
+
+  def test_crc_threads
+    data = SAMPLES["random (big size)"]
+    assert_equal(LZMA::Utils.crc32(data), LZMA::Utils.crc32(data, threads: 4))
+    assert_equal(LZMA::Utils.crc64(data, 12345), LZMA::Utils.crc64(data, 12345, threads: 3))
+    assert_equal(LZMA::Utils.crc64(data), LZMA::Utils.crc64(data, threads: 0))
+  end
+
+  def test_crc_mutated_during_calc
+    LZMA::GVL.configure(:crc, threshold: 0, adaptive: false)
+    data = OpenSSL::Random.random_bytes(1 << 20) * 64
+    src = data.dup
+    th = Thread.new { LZMA::Utils.crc64(src, threads: 4) }
+    Thread.pass
+    src.replace("x") # 計算中の crc64 は複写を参照しているため影響を受けない
+    assert_equal(LZMA::Utils.crc64(data), th.value)
+  ensure
+    LZMA::GVL.configure(:crc, threshold: 32 * 1024, adaptive: true)
+  end
+
+  def test_crc_many
+    list = SAMPLES.values.compact.map { |e| e.byteslice(0, 1000) }
+    assert_equal(list.map { |e| LZMA::Utils.crc32(e) }, LZMA::Utils.crc32_many(list))
+    assert_equal(list.map { |e| LZMA::Utils.crc64(e) }, LZMA::Utils.crc64_many(list))
+    assert_equal(list.map { |e| LZMA::Utils.crc64(e) }, LZMA::Utils.crc64_many(list, threads: 2))
+    assert_equal([], LZMA::Utils.crc64_many([]))
+    assert_raise(TypeError) { LZMA::Utils.crc64_many([1]) }
+  end
+end
+
+class TestDigest < Test::Unit::TestCase
+  def test_crc_digest
+    data = "0123456789abcdefghijklmnopqrstuvwxyz".b * 5000
+    crc = LZMA::Utils::CRC32.new
+    data.each_char.each_slice(7777) { |e| crc << e.join }
+    assert_equal(LZMA::Utils.crc32(data), crc.state)
+    assert_equal(LZMA::Utils.crc32_hexdigest(data).downcase, crc.hexdigest)
+    assert_equal(LZMA::Utils.crc32_digest(data), crc.digest)
+    assert_equal(4, crc.digest_length)
+
+    crc = LZMA::Utils::CRC64.new(1234)
+    crc.update(data)
+    assert_equal(LZMA::Utils.crc64(data, 1234), crc.state)
+    assert_equal(LZMA::Utils.crc64_digest(data, 1234), crc.digest)
+    copy = crc.dup
+    copy.reset.update("abc")
+    assert_equal(LZMA::Utils.crc64("abc", 1234), copy.state)
+    assert_equal(LZMA::Utils.crc64(data, 1234), crc.state)
+    assert_kind_of(Digest::Instance, crc)
+  end
+
+  def test_sha256
+    require "digest/sha2"
+    SAMPLES.each_value do |data|
+      next unless data
+      assert_equal(Digest::SHA256.hexdigest(data), LZMA::Utils::SHA256.hexdigest(data))
+    end
+
+    sha = LZMA::Utils::SHA256.new
+    data = OpenSSL::Random.random_bytes(1000)
+    (0...1000).step(13) { |i| sha << data.byteslice(i, 13) }
+    assert_equal(Digest::SHA256.digest(data), sha.digest)
+    assert_equal(Digest::SHA256.digest(data), sha.digest)
+    assert_raise(ArgumentError) { LZMA::Utils::SHA256.new(1) }
+  end
+
+  def test_update_while_busy
+    LZMA::GVL.configure(:crc, threshold: 0, adaptive: false)
+    require "digest/sha2"
+    data = OpenSSL::Random.random_bytes(1 << 20) * 32
+    src = data.dup
+    sha = LZMA::Utils::SHA256.new
+    th = Thread.new { sha.update(src) }
+    busy = false
+    until busy || !th.alive?
+      begin
+        sha.digest
+        Thread.pass
+      rescue RuntimeError
+        busy = true
+      end
+    end
+    if busy
+      src.replace("x") # 作業中の update は複写を参照しているため影響を受けない
+      src << "y" * 4096
+      assert_raise(RuntimeError) { sha.update("abc") }
+      assert_raise(RuntimeError) { sha.reset }
+      assert_raise(RuntimeError) { sha.dup }
+    end
+    th.join
+    assert_equal(Digest::SHA256.digest(data), sha.digest)
+  ensure
+    LZMA::GVL.configure(:crc, threshold: 32 * 1024, adaptive: true)
+  end
+end
+
+class TestGVL < Test::Unit::TestCase
+  def teardown
+    LZMA::GVL.configure(:crc, threshold: 32 * 1024, adaptive: true)
+  end
+
+  def test_policy
+    LZMA::GVL.configure(:crc, threshold: 1000, adaptive: false)
+    assert_equal(1000, LZMA::GVL.threshold(:crc))
+
+    LZMA::GVL.reset_stats
+    LZMA::Utils.crc32("a" * 999)
+    LZMA::Utils.crc64("a" * 1000)
+    stats = LZMA::GVL.stats(:crc)
+    assert_equal([1, 999, 1, 1000],
+                 stats.values_at(:held_calls, :held_bytes, :released_calls, :released_bytes))
+
+    LZMA::GVL.configure(:crc, adaptive: true)
+    100.times { LZMA::Utils.crc32("a" * 8000) }
+    assert_operator(LZMA::GVL.threshold(:crc), :>=, 256)
+
+    assert_kind_of(Hash, LZMA::GVL.stats[:code])
+    assert_raise(ArgumentError) { LZMA::GVL.threshold(:unknown) }
+  end
+
+  def test_held_code_is_bounded_by_output
+    data = "\0".b * (8 << 20)
+    xz = LZMA.encode(data, 6)
+    dec = LZMA::Stream::Decoder.new
+    out = "".b
+    dest = "".b
+    src = xz.dup
+    head = src.slice!(0, 64)
+    dec.code(head, dest, 1000, LZMA::RUN) # 初回の lzma_code は常に GVL を解放する
+    out << dest
+    src = head + src
+
+    LZMA::GVL.configure(:code, threshold: 1 << 30, adaptive: false)
+    LZMA::GVL.reset_stats
+    assert_equal(LZMA::STREAM_END, dec.code(src, dest, data.bytesize * 2, LZMA::RUN))
+    out << dest
+    assert_equal(data, out)
+    stats = LZMA::GVL.stats(:code)
+    assert_equal(0, stats[:released_calls])
+    assert_operator(stats[:held_calls], :>=, (8 << 20) / (128 << 10))
+  ensure
+    LZMA::GVL.configure(:code, threshold: 4 * 1024, adaptive: true)
+  end
+end
+
+class TestInterrupt < Test::Unit::TestCase
+  def test_code_timeout_and_resume
+    require "timeout"
+    data = SAMPLES["random (big size)"].byteslice(0, 3000000)
+    stream = LZMA::Stream::Encoder.new(LZMA::Filter::LZMA2.new(6))
+    src = data.dup
+    dest = "".b
+    out = "".b
+
+    t = Time.now
+    assert_raise(Timeout::Error) do
+      Timeout.timeout(0.05) { stream.code(src, dest, data.bytesize * 2, LZMA::RUN) }
+    end
+    assert_operator(Time.now - t, :<, 0.5)
+    assert_operator(src.bytesize, :<, data.bytesize)
+    out << dest
+
+    until src.empty?
+      assert_equal(LZMA::OK, stream.code(src, dest, data.bytesize * 2, LZMA::RUN))
+      out << dest
+    end
+    until stream.code(nil, dest, data.bytesize * 2, LZMA::FINISH) == LZMA::STREAM_END
+      out << dest
+    end
+    out << dest
+
+    assert_equal(data, LZMA.decode(out))
+  end
+end
+
+class TestCodeAll < Test::Unit::TestCase
+  def test_code_all
+    inputs = (1..6).map { |i| ("record #{i} " * 1000 * i).b }
+    encoders = inputs.map { LZMA::Stream.encoder(1) }
+    outputs = inputs.map { "".b }
+
+    [1, 3].each do |threads|
+      srcs = inputs.map(&:dup)
+      dests = inputs.map { "".b }
+      statuses = LZMA::Stream.code_all(encoders.each_with_index.map { |e, i| [e, srcs[i], dests[i], 1 << 20, LZMA::RUN] }, threads: threads)
+      assert_equal([LZMA::OK] * inputs.size, statuses)
+      assert(srcs.all?(&:empty?))
+      dests.each_with_index { |d, i| outputs[i] << d }
+    end
+
+    loop do
+      dests = inputs.map { "".b }
+      statuses = LZMA::Stream.code_all(encoders.each_with_index.map { |e, i| [e, nil, dests[i], 1 << 20, LZMA::FINISH] }, threads: 2)
+      dests.each_with_index { |d, i| outputs[i] << d }
+      break if statuses.all? { |s| s == LZMA::STREAM_END }
+    end
+
+    outputs.each_with_index { |o, i| assert_equal(inputs[i] * 2, LZMA.decode(o)) }
+  end
+
+  def test_code_all_args
+    e = LZMA::Stream.encoder
+    assert_equal([], LZMA::Stream.code_all([]))
+    assert_raise(ArgumentError) { LZMA::Stream.code_all([[e, nil, "".b, 10, 0], [e, nil, "".b, 10, 0]]) }
+    assert_raise(ArgumentError) { LZMA::Stream.code_all([[e, nil]]) }
+    f = LZMA::Stream.encoder
+    buf = "".b
+    assert_raise(ArgumentError) { LZMA::Stream.code_all([[e, "a".b, buf, 10, 0], [f, nil, buf, 10, 0]]) }
+    assert_raise(ArgumentError) { LZMA::Stream.code_all([[e, buf, "".b, 10, 0], [f, nil, buf, 10, 0]]) }
+    assert_raise(ArgumentError) { LZMA::Stream.code_all([[e, buf, buf, 10, 0]]) }
+    entry = Object.new
+    def entry.to_ary; [LZMA::Stream.encoder, "abc".b, "".b, 1 << 16, LZMA::FINISH]; end
+    assert_equal([LZMA::STREAM_END], LZMA::Stream.code_all([entry]))
+    assert_raise(TypeError) { LZMA::Stream.code_all([[1, nil, "".b, 10, 0]]) }
+  end
+end
+
+class TestPushAPI < Test::Unit::TestCase
+  def test_feed
+    data = ("0123456789abcdefghijklmnopqrstuvwxyz\n" * 20000).b
+
+    enc = LZMA.encode(nil, 1)
+    xz = "".b
+    data.each_char.each_slice(40000) { |e| enc.feed(e.join) { |chunk| xz << chunk } }
+    enc.finish { |chunk| xz << chunk }
+    assert_equal(data, LZMA.decode(xz))
+
+    dec = LZMA.decode(nil)
+    dec.chunksize = 1000
+    out = "".b
+    sizes = []
+    (0...xz.bytesize).step(777) do |i|
+      dec.feed(xz.byteslice(i, 777)) { |chunk| sizes << chunk.bytesize; out << chunk }
+    end
+    dec.finish { |chunk| out << chunk }
+    assert_equal(data, out)
+    assert_operator(sizes.max, :<=, 1000)
+  end
+
+  def test_feed_truncated
+    xz = LZMA.encode("abcdefg" * 100)
+    dec = LZMA.decode(nil)
+    dec.feed(xz.byteslice(0, xz.bytesize - 10)) { }
+    assert_raise(LZMA::BufError) { dec.finish { } }
+  end
+end
+
+class TestDecoderIO < Test::Unit::TestCase
+  LINES = (1..20000).map { |i| "line #{i} #{"x" * (i % 97)}\n" }
+  TEXT = LINES.join.b
+  XZ = LZMA.encode(TEXT, 1)
+
+  def decoder
+    LZMA.decode(StringIO.new(XZ))
+  end
+
+  def test_gets
+    d = decoder
+    assert_equal(LINES[0], d.gets)
+    assert_equal(LINES[1].chomp, d.gets(chomp: true))
+    assert_equal("line", d.gets(4))
+    assert_equal(LINES[2].byteslice(4..-1), d.gets)
+    assert_equal(4, d.lineno)
+    assert_equal(LINES[3..-1], d.each_line.to_a)
+    assert_nil(d.gets)
+    assert(d.eof?)
+    assert_raise(EOFError) { d.readline }
+  end
+
+  def test_gets_separator
+    d = decoder
+    got = []
+    while line = d.gets("\n1")
+      got << line
+    end
+    assert_equal(TEXT, got.join)
+    assert_equal(TEXT.scan(/.*?\n1|.+\z/m), got)
+    assert_equal(TEXT, decoder.gets(nil))
+  end
+
+  def test_readpartial_and_read
+    d = decoder
+    buf = "".b
+    out = "".b
+    while true
+      begin
+        d.readpartial(10000, buf)
+      rescue EOFError
+        break
+      end
+      assert_operator(buf.bytesize, :<=, 10000)
+      out << buf
+    end
+    assert_equal(TEXT, out)
+
+    d = decoder
+    assert_equal(TEXT.byteslice(0, 5), d.read(5))
+    buf = "keep".b
+    assert_same(buf, d.read(300000, buf))
+    assert_equal(TEXT.byteslice(5, 300000), buf)
+    assert_equal(TEXT.byteslice(300005..-1), d.read)
+    assert_nil(d.read(1))
+  end
+
+  def test_copy_stream
+    out = StringIO.new("".b)
+    IO.copy_stream(decoder, out)
+    assert_equal(TEXT, out.string)
+  end
+end
+
+class TestOutputLimit < Test::Unit::TestCase
+  BOMB = LZMA.encode("\0" * (8 << 20))
+
+  def test_max_output
+    e = assert_raise(LZMA::OutputLimitError) { LZMA.decode(BOMB, max_output: 100000) }
+    assert_equal(:max_output, e.limit)
+    assert_equal(100001, e.output_offset)
+    assert_operator(e.input_offset, :<=, BOMB.bytesize)
+
+    assert_equal(8 << 20, LZMA.decode(BOMB, max_output: 8 << 20).bytesize)
+  end
+
+  def test_max_ratio
+    e = assert_raise(LZMA::OutputLimitError) { LZMA.decode(BOMB, max_ratio: 100) }
+    assert_equal(:max_ratio, e.limit)
+    assert_operator(e.output_offset, :<, 8 << 20)
+
+    text = "extlzma " * 100000
+    assert_equal(text, LZMA.decode(LZMA.encode(text), max_ratio: 10000))
+  end
+
+  def test_stream_accessors
+    s = LZMA::Stream.auto_decoder(max_output: 10, max_ratio: 2.5)
+    assert_equal(10, s.max_output)
+    assert_equal(2.5, s.max_ratio)
+    s.max_output = nil
+    assert_nil(s.max_output)
+    assert_equal(0, s.total_out)
+  end
+end
+
+class TestEstimate < Test::Unit::TestCase
+  def test_estimate_ratio
+    random = Random.new(1).bytes(1 << 20)
+    assert_operator(LZMA::Utils.estimate_ratio(random), :>, 0.97)
+    assert_operator(LZMA::Utils.estimate_ratio("\0" * (1 << 20)), :<, 0.1)
+    assert_operator(LZMA::Utils.estimate_ratio("extlzma " * 10000, sample: 4096), :<, 0.5)
+    assert_equal(1.0, LZMA::Utils.estimate_ratio(""))
+  end
+
+  def test_skip_incompressible
+    random = Random.new(2).bytes(1 << 20)
+    packed = LZMA.encode(random, 9, skip_incompressible: true)
+    assert_equal(random, LZMA.decode(packed))
+    assert_operator(packed.bytesize, :<, random.bytesize + 1024)
+
+    text = "extlzma " * 10000
+    assert_equal(LZMA.encode(text, 6), LZMA.encode(text, 6, skip_incompressible: true))
+    assert_equal(LZMA.encode(random, 0), LZMA.encode(random, 6, skip_incompressible: 0.5))
+  end
+end
+
+class TestTuner < Test::Unit::TestCase
+  SAMPLE = (0...20000).map { |i| "#{i % 97} extlzma tuner sample line #{i * 7 % 13}\n" }.join.b
+
+  def test_measure
+    r = LZMA::Tuner.measure(SAMPLE, [LZMA::Filter::LZMA2.new(0), [LZMA::Filter::Delta.new(1), LZMA::Filter::LZMA2.new(1)],
+                                     [LZMA::Filter::LZMA2.new(1), LZMA::Filter::LZMA2.new(1)]])
+    assert_equal(3, r.size)
+    assert_operator(r[0][0], :<, SAMPLE.bytesize)
+    assert_operator(r[0][1], :>, 0)
+    assert_operator(r[1][2], :>, 0)
+    assert_nil(r[2])
+
+    assert_equal([nil], LZMA::Tuner.measure(SAMPLE, [LZMA::Filter::LZMA2.new(9)], max_mem: 1 << 20))
+
+    # 試し圧縮では辞書を標本の大きさまで縮めるが、作業メモリ量は与えた設定のままの値となる
+    big = LZMA::Filter::LZMA2.new(9 | LZMA::PRESET_EXTREME)
+    r = LZMA::Tuner.measure(SAMPLE, [big, LZMA::Filter::LZMA2.new(1)], mem_budget: 1)
+    assert_operator(r[0][2], :>, 600 << 20)
+    assert_operator(r[1][0], :>, 0)
+    assert_equal(64 << 20, big.dictsize)
+  end
+
+  def test_recommend
+    r = LZMA::Tuner.recommend(SAMPLE, max_mem: 64 << 20)
+    assert_kind_of(LZMA::Filter::LZMA2, r.lzma2)
+    assert_operator(r.memusage, :<=, 64 << 20)
+    assert_operator(r.ratio, :<, 0.5)
+    assert_equal(SAMPLE, LZMA.decode(LZMA.encode(SAMPLE, *r.filters)))
+
+    fast = LZMA::Tuner.recommend(SAMPLE, target_mbps: 1e9, prefilters: false)
+    assert_equal(1, fast.filters.size)
+
+    small = LZMA::Tuner.recommend(SAMPLE, size_hint: 100000, prefilters: false, refine: false)
+    assert_equal(128 << 10, small.lzma2.dictsize)
+    assert_operator(small.memusage, :<, 16 << 20)
+
+    pcm = (0...65536).map { |i| [(Math.sin(i / 20.0) * 30000).to_i].pack("s<") }.join
+    assert_kind_of(LZMA::Filter::Delta, LZMA::Tuner.prefilter(pcm)[0])
+  end
+
+  def test_online
+    tuner = LZMA::Tuner::Online.new(interval: 2, max_mem: 64 << 20)
+    3.times { assert_equal(SAMPLE, LZMA.decode(tuner.encode(SAMPLE, :text))) }
+    assert_equal(1, tuner.stats(:text)[:calls])
+    assert_nil(tuner.stats(:image))
+  end
+end
+
+class TestSizeHint < Test::Unit::TestCase
+  def test_encoder_dictsize
+    s = LZMA::Stream.encoder(LZMA::Filter::LZMA2.new(9), size_hint: 2000)
+    assert_equal(4096, s.dictsize)
+    assert_operator(s.memusage, :<, LZMA::Stream.encoder(LZMA::Filter::LZMA2.new(9)).memusage / 10)
+    assert_equal(64 << 20, LZMA::Stream.encoder(LZMA::Filter::LZMA2.new(9)).dictsize)
+    assert_equal(1 << 20, LZMA::Stream.encoder(LZMA::Filter::LZMA2.new(9), size_hint: 1000000).dictsize)
+    assert_nil(LZMA::Stream.auto_decoder.dictsize)
+    assert_equal(64 << 20, LZMA::Stream.encoder(LZMA::Filter::LZMA2.new(9), size_hint: 1 << 63).dictsize)
+    assert_equal(64 << 20, LZMA::Stream.encoder(LZMA::Filter::LZMA2.new(9), size_hint: (1 << 64) - 1).dictsize)
+
+    filter = LZMA::Filter::LZMA2.new(9)
+    LZMA::Stream.raw_encoder(filter, size_hint: 10)
+    assert_equal(64 << 20, filter.dictsize)
+  end
+
+  def test_encode_string
+    text = (0...200).map { |i| "line #{i * 31 % 17}\n" }.join
+    packed = LZMA.encode(text, 9)
+    assert_equal(text, LZMA.decode(packed))
+    assert_equal(LZMA.encode(text, 9, size_hint: 1 << 40).bytesize, packed.bytesize)
+    assert_equal(text, LZMA.raw_decode(LZMA.raw_encode(text, 9), 9))
+  end
+end
+
+class TestDumpLoad < Test::Unit::TestCase
+  OBJ = { "name" => "extlzma", "list" => (0...5000).map { |i| [i, i.to_s * 3] }, "nested" => { "a" => [1.5, nil, true] } }
+
+  def test_marshal
+    xz = LZMA.dump(OBJ)
+    assert_equal(Marshal.dump(OBJ), LZMA.decode(xz))
+    assert_equal(OBJ, LZMA.load(xz))
+
+    io = StringIO.new("".b)
+    assert_same(io, LZMA.dump(OBJ, io, 1))
+    io.rewind
+    assert_equal(OBJ, LZMA.load(io))
+  end
+
+  def test_json
+    xz = LZMA.dump(OBJ, format: :json)
+    assert_equal(OBJ, LZMA.load(xz, format: :json))
+    assert_equal([1, "a"], LZMA.load(LZMA.dump([1, "a"], format: :json), format: :json))
+    assert_equal("x", LZMA.load(LZMA.dump("x", format: :json), format: :json))
+    assert_raise(ArgumentError) { LZMA.dump(1, format: :yaml) }
+  end
+end
+
+class TestAppender < Test::Unit::TestCase
+  def test_append
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, "a.xz")
+      LZMA::Appender.open(path, align: 64) { |app| app << "first\n" }
+      LZMA::Appender.open(path, align: 64) do |app|
+        app.append("second\n")
+        app.append { |enc| enc << "third\n" }
+      end
+
+      data = File.binread(path)
+      assert_equal("first\nsecond\nthird\n", LZMA.decode(data, nil, LZMA::CONCATENATED))
+      index = File.open(path, "rb") { |f| LZMA::Index.scan(f) }
+      assert_equal(3, index.stream_count)
+      assert_equal(19, index.uncompressed_size)
+      assert_equal(data.bytesize, index.file_size)
+      assert_equal(0, index.each_block.map { |b| b[:compressed_file_offset] - 12 }.map { |o| o % 64 }.max)
+
+      File.binwrite(path, data.byteslice(0...-4))
+      assert_raise_kind_of(LZMA::BasicException) { LZMA::Appender.open(path) }
+    end
+  end
+
+  def test_side_index
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, "b.xz")
+      LZMA::Appender.open(path, index: true) { |app| app << "abc" << "defg" }
+      assert_path_exist("#{path}.idx")
+
+      LZMA::Appender.open(path, index: true) do |app|
+        assert_equal(2, app.index.stream_count)
+        app << "hij"
+        assert_equal(3, app.index.stream_count)
+        b = app.index.locate(8)
+        assert_equal(3, b[:stream_number])
+        assert_equal(7, b[:uncompressed_file_offset])
+      end
+
+      File.delete("#{path}.idx")
+      LZMA::Appender.open(path, index: true) { |app| assert_equal(10, app.index.uncompressed_size) }
+
+      idx = File.binread("#{path}.idx")
+      [idx.byteslice(0...-1), idx + "x", Marshal.dump([File.size(path), []]), "".b].each do |broken|
+        File.binwrite("#{path}.idx", broken)
+        LZMA::Appender.open(path, index: true) { |app| assert_equal(3, app.index.stream_count) }
+      end
+    end
+  end
+
+  def test_append_failure
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, "c.xz")
+      LZMA::Appender.open(path, align: 64, index: true) do |app|
+        app << "first\n"
+        size = File.size(path)
+        assert_raise(RuntimeError) do
+          app.append { |enc| enc << "partial" * 1000; raise "abort" }
+        end
+        assert_equal(size, File.size(path))
+        assert_equal(1, app.index.stream_count)
+        app << "second\n"
+        assert_equal(2, app.index.stream_count)
+      end
+
+      assert_equal("first\nsecond\n", LZMA.decode(File.binread(path), nil, LZMA::CONCATENATED))
+      LZMA::Appender.open(path, index: true) { |app| assert_equal(13, app.index.uncompressed_size) }
+    end
+  end
+end
+
+class TestCheckpoint < Test::Unit::TestCase
+  TEXT = (0...60000).map { |i| "record #{i}\n" }.join.b
+
+  def build(dir)
+    path = File.join(dir, "c.xz")
+    # 小さなブロックに分けるため、FULL_FLUSH で区切りながら圧縮する
+    File.open(path, "wb") do |f|
+      s = LZMA::Stream.encoder(LZMA::Filter::LZMA2.new(1))
+      out = "".b
+      TEXT.each_char.each_slice(50000).map(&:join).each do |part|
+        s.code(part.dup, out, 1 << 20, LZMA::FULL_FLUSH)
+        f << out
+      end
+      s.code(nil, out, 1 << 20, LZMA::FINISH)
+      f << out
+    end
+    LZMA::Appender.open(path) { |app| app << "tail\n" }
+    path
+  end
+
+  def test_checkpoint_resume
+    Dir.mktmpdir do |dir|
+      path = build(dir)
+      all = TEXT + "tail\n"
+      File.open(path, "rb") do |f|
+        index = LZMA::Index.scan(f)
+        assert_operator(index.block_count, :>, 5)
+
+        d = LZMA.decode(f, nil, LZMA::CONCATENATED)
+        assert_equal(all.byteslice(0, 123456), d.read(123456))
+        assert_equal(123456, d.tell)
+        cp = d.checkpoint
+        assert_operator(cp.uncompressed_offset, :<=, 123456)
+        assert_operator(cp.compressed_offset, :>, 12)
+
+        r = LZMA::Decoder.resume(f, LZMA::Decoder::Checkpoint.new(**cp.to_h))
+        assert_equal(123456, r.tell)
+        assert_equal(all.byteslice(123456..), r.read)
+        assert_equal(all.bytesize, r.tell)
+
+        cp = index.checkpoint(all.bytesize - 2)
+        assert_equal("l\n", LZMA::Decoder.resume(f, cp, index: index).read)
+        assert_nil(LZMA::Decoder.resume(f, index.checkpoint(all.bytesize), index: index).read)
+        assert_raise(ArgumentError) { LZMA::Decoder.resume(f, LZMA::Decoder::Checkpoint.new(compressed_offset: 13, uncompressed_offset: 0, position: 0)) }
+      end
+    end
+  end
+end
+
+class TestMultiThread < Test::Unit::TestCase
+  TEXT = (0...200000).map { |i| "line #{i} #{i * 7919 % 10007}\n" }.join.b
+
+  def setup
+    omit "liblzma without multi-threading" unless LZMA::Stream.const_defined?(:MTDecoder)
+  end
+
+  def test_pipe_decode
+    xz = LZMA.encode(TEXT, 1, threads: 2, block_size: 256 * 1024)
+    assert_operator(LZMA::Index.scan(StringIO.new(xz)).block_count, :>, 4)
+
+    r, w = IO.pipe
+    th = Thread.new { w << xz; w.close }
+    LZMA.decode(r, threads: 2) do |d|
+      assert_equal(TEXT.byteslice(0, 1000), d.read(1000))
+      assert_equal(TEXT.byteslice(1000..), d.read)
+    end
+    th.join
+    r.close
+  end
+
+  def test_serial_fallback
+    xz = LZMA.encode(TEXT, 1)
+    assert_equal(TEXT, LZMA.decode(StringIO.new(xz), threads: 4).read)
+    assert_equal(TEXT, LZMA.decode(xz, threads: 2))
+    assert_raise(LZMA::DataError) { LZMA.decode(xz.byteslice(0, 100) + "x" * 100, threads: 2) }
+  end
+end
+
+class TestCompressedBuffer < Test::Unit::TestCase
+  def test_byteslice
+    data = (0...50000).map { |i| "#{i},#{i * i}\n" }.join.b
+    buf = LZMA::CompressedBuffer.new(data, chunk_size: 4096, preset: 1, threads: 2, cache: 2)
+    assert_equal(data.bytesize, buf.bytesize)
+    assert_equal((data.bytesize + 4095) / 4096, buf.chunk_count)
+    assert_operator(buf.compressed_size, :<, data.bytesize / 2)
+
+    [[0, 10], [4090, 20], [100000, 50000], [data.bytesize - 5, 100], [data.bytesize, 1], [-10, 3],
+     [data.bytesize + 1, 1], [0, 0], [-1, nil], [data.bytesize, nil], [5, -1]].each do |off, len|
+      assert_equal(data.byteslice(*[off, len].compact), buf.byteslice(*[off, len].compact), [off, len].inspect)
+    end
+    [1000...9000, 5..-2, -20.., ..100, data.bytesize..].each do |r|
+      assert_equal(data.byteslice(r), buf[r], r.inspect)
+    end
+
+    assert_equal(data, buf.to_s)
+    assert_equal(data, buf.each_chunk.to_a.join)
+    assert_equal(data.byteslice(8192, 4096), buf.each_chunk.to_a[2])
+  end
+
+  def test_empty
+    buf = LZMA::CompressedBuffer.new("")
+    assert_equal(0, buf.chunk_count)
+    assert_equal("", buf.to_s)
+    assert_nil(buf.byteslice(0))
+    assert_raise(ArgumentError) { LZMA::CompressedBuffer.new("x", chunk_size: 0) }
+  end
+end
+
+class TestRecordLog < Test::Unit::TestCase
+  def test_append_get
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, "log.xz")
+      records = (0...3000).map { |i| "event #{i} " + "x" * (i % 50) }
+      LZMA::RecordLog.open(path, 1, block_size: 8192, sync_interval: nil) do |log|
+        records.each_with_index { |r, i| assert_equal(i, log.append(r)) }
+        assert_equal(records[2999], log.get(2999))
+        assert_equal(records[10], log[10])
+        assert_nil(log.get(3000))
+      end
+
+      assert_equal(records.join, LZMA.decode(File.binread(path), nil, LZMA::CONCATENATED))
+      assert_operator(File.size(path), :<, records.join.bytesize / 3)
+
+      LZMA::RecordLog.open(path, readonly: true) do |log|
+        assert_equal(3000, log.size)
+        [0, 1, 1234, 2999].each { |i| assert_equal(records[i], log.get(i)) }
+        assert_equal(records.drop(2990), log.each(2990).to_a)
+        assert_raise(IOError) { log << "x" }
+      end
+
+      LZMA::RecordLog.open(path, block_interval: 0) do |log|
+        assert_equal(3000, log.append("more"))
+        assert_equal(3001, log.append("again"))
+        assert_equal("more", log.get(3000))
+      end
+      assert_equal(["more", "again"], LZMA::RecordLog.open(path, readonly: true).each(3000).to_a)
+    end
+  end
+
+  def test_recover
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, "log.xz")
+      LZMA::RecordLog.open(path) { |log| log << "a" << "b" }
+      size = File.size(path)
+
+      # 位置の保存されていないストリームと、書き込み途中の位置の情報
+      LZMA::Appender.open(path) { |app| app << "lost" }
+      File.open("#{path}.rec", "ab") { |f| f << "\x01\x02" }
+
+      LZMA::RecordLog.open(path) do |log|
+        assert_equal(2, log.size)
+        assert_equal(size, File.size(path))
+        log << "c"
+      end
+      assert_equal(%w(a b c), LZMA::RecordLog.open(path, readonly: true).to_a)
+
+      other = File.join(dir, "other.xz")
+      File.binwrite(other, LZMA.encode("data"))
+      assert_raise(LZMA::FormatError) { LZMA::RecordLog.open(other) }
+      assert_equal("data", LZMA.decode(File.binread(other)))
+      assert_false(File.exist?("#{other}.rec"))
+    end
+  end
+end
+
+class TestRsyncable < Test::Unit::TestCase
+  def blocks(xz)
+    LZMA::Index.scan(StringIO.new(xz)).each_block.map { |b| xz.byteslice(b[:compressed_file_offset], b[:total_size]) }
+  end
+
+  def check_rsyncable(**opts)
+    srand(43)
+    data = Array.new(400000) { "%08x\n" % rand(1 << 20) }.join.b
+    changed = data.dup
+    changed[1000000, 5] = "XXXXX"
+
+    a = LZMA.encode(data, 0, rsyncable: 65536, **opts)
+    b = LZMA.encode(changed, 0, rsyncable: 65536, **opts)
+    assert_equal(data, LZMA.decode(a))
+    assert_equal(changed, LZMA.decode(b))
+
+    ba, bb = blocks(a), blocks(b)
+    assert_operator(ba.size, :>, 20)
+    common = (ba & bb).size
+    assert_operator(common, :>=, ba.size - 3)
+    assert_operator(common, :<, ba.size)
+
+    # 書き込みの区切り方によらず同じ出力となる
+    c = StringIO.new("".b)
+    LZMA.encode(c, 0, rsyncable: 65536, **opts) { |e| (0...data.bytesize).step(77777) { |i| e << data.byteslice(i, 77777) } }
+    assert_equal(ba, blocks(c.string))
+  end
+
+  def test_rsyncable
+    check_rsyncable
+    assert_raise(ArgumentError) { LZMA::Stream::Encoder.new(LZMA.lzma2(0), rsyncable: 100) }
+  end
+
+  def test_rsyncable_mt
+    omit "liblzma without multi-threading" unless LZMA::Stream.const_defined?(:MTEncoder)
+    check_rsyncable(threads: 2)
+  end
+end
+
+class TestRecompressor < Test::Unit::TestCase
+  def test_recompress
+    Dir.mktmpdir do |dir|
+      data = (0...20000).map { |i| "entry #{i % 997} #{i % 13}\n" }.join
+      paths = (0...3).map { |i| File.join(dir, "f#{i}.xz") }
+      calls = Queue.new
+      journal = File.join(dir, "journal")
+      rec = LZMA::Recompressor.new(6, threads: 2, nice: 5, bytes_per_sec: 1 << 30, journal: journal) { |path, pr| calls << path }
+      paths.each { |path| rec.ingest(path, data) }
+      rec << File.join(dir, "missing.xz")
+      rec.wait
+      pr = rec.progress
+      assert_equal(0, pr[:pending])
+      assert_equal(3, pr[:done])
+      assert_equal(1, pr[:failed])
+      assert_kind_of(SystemCallError, rec.errors[File.join(dir, "missing.xz")])
+      assert_operator(pr[:bytes_out], :<, pr[:bytes_in])
+      assert_equal(4, calls.size)
+      rec.shutdown
+      assert_raise(IOError) { rec << paths[0] }
+
+      paths.each { |path| assert_equal(data, LZMA.decode(File.binread(path))) }
+      assert_equal([], Dir.children(dir).grep(/\.(recompress|ingest)\z/))
+      assert_equal(0, LZMA::Recompressor.new(journal: journal).tap(&:shutdown).progress[:done])
+    end
+  end
+
+  def test_resume
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, "a.xz")
+      data = "resume me\n" * 10000
+      File.binwrite(path, LZMA.encode(data, 0))
+      journal = File.join(dir, "journal")
+      # 処理の途中で終了したジャーナルと一時ファイル
+      File.binwrite(journal, "+#{path.dump}\n+\"broken")
+      File.binwrite(path + ".recompress", "partial")
+
+      rec = LZMA::Recompressor.new(journal: journal)
+      rec.shutdown
+      assert_equal(1, rec.progress[:done])
+      assert_equal(data, LZMA.decode(File.binread(path)))
+      assert_false(File.exist?(path + ".recompress"))
+
+      assert_equal(0, LZMA::Recompressor.new(journal: journal).tap(&:shutdown).progress[:done])
+    end
+  end
+
+  def test_lock_and_attributes
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, "a.xz")
+      File.binwrite(path, LZMA.encode("first\n" * 1000, 0))
+      File.chmod(0640, path)
+
+      rec = LZMA::Recompressor.new
+      File.open(path, "ab") do |f|
+        f.flock(File::LOCK_EX)
+        rec << path
+        sleep 0.2
+        assert_equal(1, rec.progress[:pending])
+        f << LZMA.encode("second\n", 0)
+      end
+      rec.shutdown
+
+      assert_equal(1, rec.progress[:done])
+      assert_equal("first\n" * 1000 + "second\n", LZMA.decode(File.binread(path)))
+      assert_equal(0640, File.stat(path).mode & 07777)
+    end
+  end
+
+  def test_ingest_during_recompression
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, "a.xz")
+      journal = File.join(dir, "journal")
+      File.binwrite(path, LZMA.encode("old\n" * 1000, 0))
+
+      rec = LZMA::Recompressor.new(journal: journal)
+      File.open(path, "rb") do |f|
+        f.flock(File::LOCK_EX)
+        rec << path
+        sleep 0.2
+        assert_equal(1, rec.progress[:active])
+        rec.ingest(path, "new\n" * 1000)
+        assert_equal(2, rec.progress[:pending]) # 処理中のものと、終えた後にもう一度処理するもの
+      end
+      rec.shutdown
+
+      assert_equal([1, 0], rec.progress.values_at(:done, :failed))
+      assert_equal("new\n" * 1000, LZMA.decode(File.binread(path)))
+      assert_equal(0, LZMA::Recompressor.new(journal: journal).tap(&:shutdown).progress[:done])
+    end
+  end
+
+  def test_appender_follows_replaced_file
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, "a.xz")
+      LZMA::Appender.open(path, index: true) do |app|
+        app << "first\n" << "second\n"
+        LZMA::Recompressor.new.tap { |rec| rec << path }.shutdown
+        app << "third\n"
+        assert_equal(2, app.index.stream_count)
+        assert_equal(19, app.index.uncompressed_size)
+      end
+      assert_equal("first\nsecond\nthird\n", LZMA.decode(File.binread(path), nil, LZMA::CONCATENATED))
+    end
+  end
+
+  def test_callback_error
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, "a.xz")
+      File.binwrite(path, LZMA.encode("abc", 0))
+      stderr, $stderr = $stderr, StringIO.new
+      begin
+        rec = LZMA::Recompressor.new { |*| raise "callback" }
+        rec << path
+        rec.wait
+        rec << path
+        rec.shutdown
+        assert_equal(2, rec.progress[:done])
+        assert_match(/callback/, $stderr.string)
+      ensure
+        $stderr = stderr
+      end
+    end
+  end
+end
+
+class TestStreamEnd < Test::Unit::TestCase
+  def test_end_releases_memory
+    enc = LZMA::Stream.encoder(6)
+    dest = "".b
+    enc.code("abc" * 1000, dest, 65536, LZMA::RUN)
+    assert_operator(enc.memusage, :>, 0)
+    assert_false(enc.closed?)
+    assert_nil(enc.end)
+    assert_true(enc.closed?)
+    assert_equal(0, enc.memusage)
+    assert_nil(enc.close)
+    assert_raise(IOError) { enc.code(nil, dest, 65536, LZMA::FINISH) }
+    assert_raise(IOError) { enc.feed(nil, dest, 65536, LZMA::FINISH) { } }
+    assert_raise(IOError) { LZMA::Stream.code_all([[enc, nil, dest, 65536, LZMA::FINISH]]) }
+  end
+
+  def test_encoder_decoder_close
+    data = "extlzma" * 10000
+    enc = LZMA.encode
+    enc << data
+    enc.close
+    assert_true(enc.context.closed?)
+    assert_equal(data, LZMA.decode(enc.outport))
+
+    dec = LZMA.decode(StringIO.new(enc.outport))
+    assert_equal(data.byteslice(0, 100), dec.read(100))
+    dec.close
+    assert_true(dec.context.closed?)
+  end
+
+  def test_unclosed_encoder_warns_and_truncates
+    script = <<~'RUBY'
+      require "extlzma"
+      $out = StringIO.new("".b)
+      enc = LZMA.encode($out)
+      enc << "abc" * 100000
+      enc = nil
+      GC.start
+      at_exit { $stdout.binmode.write($out.string) }
+    RUBY
+    incs = $LOAD_PATH.map { |dir| "-I#{dir}" }
+    out, err, = Open3.capture3(RbConfig.ruby, *incs, "-rstringio", "-e", script, binmode: true)
+    assert_match(/garbage collected without close/, err)
+    assert_raise(LZMA::BufError) { LZMA.decode(out) }
+  end
+
+  def test_end_while_busy
+    data = OpenSSL::Random.random_bytes(1 << 20)
+    enc = LZMA::Stream::Encoder.new(LZMA::Filter.lzma2(1), rsyncable: 4096)
+    dest = "".b
+    e = assert_raise(IOError) { enc.feed(data, dest, 4096, LZMA::RUN) { enc.end } }
+    assert_match(/in use/, e.message)
+    assert_false(enc.closed?)
+
+    out = "".b
+    enc.feed(data, dest, 65536, LZMA::RUN) { |buf| out << buf }
+    enc.feed(nil, dest, 65536, LZMA::FINISH) { |buf| out << buf }
+    assert_nil(enc.end)
+    assert_true(enc.closed?)
+  end
+end
+
+class TestThreadPool < Test::Unit::TestCase
+  def setup
+    @saved = LZMA::ThreadPool.max_threads
+    LZMA::ThreadPool.max_threads = 4
+    LZMA::ThreadPool.reset_stats
+  end
+
+  def teardown
+    LZMA::ThreadPool.max_threads = @saved
+  end
+
+  def test_shared_pool
+    data = OpenSSL::Random.random_bytes(4 << 20)
+    list = Array.new(16) { |i| data.byteslice(i << 16, 65536) }
+    threads = 3.times.map {
+      Thread.new { 4.times.map { [LZMA::Utils.crc32(data, threads: 8), LZMA::Utils.crc64_many(list, threads: 0)] } }
+    }
+    expect = [LZMA::Utils.crc32(data), list.map { |e| LZMA::Utils.crc64(e) }]
+    threads.each { |th| th.value.each { |e| assert_equal(expect, e) } }
+
+    stats = LZMA::ThreadPool.stats
+    assert_equal(4, stats[:max_threads])
+    assert_operator(stats[:workers], :<=, 3)
+    assert_equal(0, stats[:busy])
+    assert_equal(0, stats[:queue_depth])
+    assert_operator(stats[:jobs], :>=, 24)
+    assert_operator(stats[:tasks], :>=, stats[:stolen_tasks])
+    assert_operator(stats[:busy_ns], :>, 0)
+  end
+
+  def test_max_threads
+    assert_equal(4, LZMA::ThreadPool.max_threads)
+    LZMA::ThreadPool.max_threads = 1
+    data = OpenSSL::Random.random_bytes(1 << 20)
+    assert_equal(LZMA::Utils.crc32(data), LZMA::Utils.crc32(data, threads: 4))
+    assert_equal(0, LZMA::ThreadPool.stats[:stolen_tasks])
+    LZMA::ThreadPool.max_threads = nil
+    assert_operator(LZMA::ThreadPool.max_threads, :>=, 1)
+    assert_raise(ArgumentError) { LZMA::ThreadPool.max_threads = -1 }
+  end
+
+  def test_fork
+    omit "fork is not available" unless Process.respond_to?(:fork)
+
+    data = OpenSSL::Random.random_bytes(1 << 20)
+    expect = LZMA::Utils.crc32(data)
+    assert_equal(expect, LZMA::Utils.crc32(data, threads: 4))
+
+    pid = fork do
+      ok = LZMA::Utils.crc32(data, threads: 4) == expect && LZMA::ThreadPool.stats[:forks] >= 1
+      exit!(ok ? 0 : 1)
+    end
+    Process.wait(pid)
+    assert_true($?.success?)
+  end
+end
+
+class TestDecodeStreams < Test::Unit::TestCase
+  def setup
+    @parts = 30.times.map { |i| "stream #{i}\n" * (i * 97) }
+    @xz = @parts.each_with_index.map { |e, i| LZMA.encode(e, i % 3) + "\0" * (4 * (i % 2)) }.join
+  end
+
+  def test_decode_streams
+    expect = @parts.join
+    assert_equal(expect, LZMA.decode_streams(@xz, threads: 4))
+    assert_equal(expect, LZMA.decode_streams(StringIO.new(@xz), "".b, threads: 1))
+    assert_equal(expect, LZMA.decode_streams(@xz, max_buffer: 2000))
+
+    chunks = []
+    assert_nil(LZMA.decode_streams(@xz, max_buffer: 0) { |data| chunks << data.dup })
+    assert_equal(expect, chunks.join)
+  end
+
+  def test_stream_ranges
+    ranges = LZMA::Index.stream_ranges(StringIO.new(@xz))
+    assert_equal(@parts.size, ranges.size)
+    assert_equal(@parts.map(&:bytesize), ranges.map { |r| r[2] })
+    assert_equal(0, ranges[0][0])
+  end
+
+  def test_decode_streams_broken
+    xz = @xz.dup
+    range = LZMA::Index.stream_ranges(StringIO.new(xz))[10]
+    xz.setbyte(range[0] + range[1] - 20, xz.getbyte(range[0] + range[1] - 20) ^ 0x55)
+    assert_raise(LZMA::Exceptions::DataError) { LZMA.decode_streams(xz) }
+    assert_raise(LZMA::FormatError, LZMA::Exceptions::DataError) { LZMA.decode_streams("abcd" * 10) }
+  end
+end
+
+class TestWritev < Test::Unit::TestCase
+  DATA = (OpenSSL::Random.random_bytes(300_000) + "extlzma " * 200_000).b
+
+  def test_into_chunks
+    chunks = LZMA.encode(DATA, 0, into: :chunks)
+    assert_kind_of(Array, chunks)
+    assert_operator(chunks.size, :>, 1)
+    assert_true(chunks.all?(&:frozen?))
+    assert_true(chunks.all? { |c| c.bytesize > 0 && c.bytesize <= LZMA::Encoder::BLOCKSIZE })
+    assert_equal(DATA, LZMA.decode(chunks.join))
+
+    chunks = LZMA.encode(nil, into: :chunks) { |e| e << "abc" << "def"; e.outport }
+    assert_equal("abcdef", LZMA.decode(chunks.join))
+    assert_raise(ArgumentError) { LZMA.encode("abc", into: :string) }
+  end
+
+  def test_feed_chunks
+    enc = LZMA::Stream.encoder(0)
+    chunks = ["x".b.freeze]
+    assert_equal(LZMA::OK, enc.feed(DATA, chunks, 65536, LZMA::RUN))
+    assert_equal(LZMA::STREAM_END, enc.feed(nil, chunks, 65536, LZMA::FINISH))
+    assert_equal("x", chunks[0])
+    assert_true(chunks.drop(1).all? { |c| c.bytesize <= 65536 })
+    assert_equal(DATA, LZMA.decode(chunks.drop(1).join))
+  end
+
+  def test_writev
+    omit "writev is not available" unless LZMA::Utils.respond_to?(:writev)
+
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, "a")
+      File.open(path, "wb") do |f|
+        f << "head:"
+        chunks = ["abc".b, "".b, "defg".b, "h".freeze]
+        assert_equal(8, LZMA::Utils.writev(f, chunks))
+        assert_equal(["", "", "", "h"], chunks)
+      end
+      assert_equal("head:abcdefgh", File.binread(path))
+
+      File.open(path, "wb") { |f| LZMA.encode(f, 1) { |e| e << DATA << "tail" } }
+      assert_equal(DATA + "tail", LZMA.decode(File.binread(path)))
+    end
+
+    r, w = IO.pipe
+    w.binmode
+    th = Thread.new { r.binmode.read }
+    LZMA.encode(w, 0) { |e| e << DATA }
+    w.close
+    assert_equal(DATA, LZMA.decode(th.value))
+  end
+
+  def test_writev_failure
+    omit "writev is not available" unless LZMA::Utils.respond_to?(:writev)
+
+    r, w = IO.pipe
+    w.binmode
+    chunk = "abc".b
+    assert_raise(ArgumentError) { LZMA::Utils.writev(w, [chunk, chunk]) }
+    r.close
+    chunks = [chunk, "defg".b]
+    assert_raise(Errno::EPIPE) { LZMA::Utils.writev(w, chunks) }
+    assert_equal(["abc", "defg"], chunks)
+    chunk << "h" # ロックが解除されていること
+    w.close
+  end
+end
+
+class TestOffloadCheck < Test::Unit::TestCase
+  DATA = ("offload " * 150_000 + OpenSSL::Random.random_bytes(100_000)).b
+
+  def sample(check)
+    a = LZMA.encode(DATA, 1, check: check, threads: 2, block_size: 256 * 1024)
+    b = LZMA.encode("tail", 0, check: check)
+    a + b
+  end
+
+  def test_decode
+    [LZMA::CHECK_NONE, LZMA::CHECK_CRC32, LZMA::CHECK_CRC64, LZMA::CHECK_SHA256].each do |check|
+      xz = sample(check)
+      assert_equal(DATA + "tail", LZMA.decode(xz, offload_check: true))
+      out = LZMA.decode(StringIO.new(xz), offload_check: true) { |d| d.read(1000) + d.read }
+      assert_equal(DATA + "tail", out)
+    end
+  end
+
+  def test_decode_rejects_other_options
+    xz = sample(LZMA::CHECK_CRC64)
+    e = assert_raise(ArgumentError) { LZMA.decode(xz, offload_check: true, max_output: 100) }
+    assert_match(/:max_output/, e.message)
+    assert_raise(ArgumentError) { LZMA.decode(xz, offload_check: true, max_ratio: 10, threads: 2) }
+    assert_raise(ArgumentError) { LZMA.decode(xz, 1 << 20, offload_check: true) }
+    assert_raise(LZMA::OutputLimitError) { LZMA.decode(xz, offload_check: false, max_output: 100) }
+  end
+
+  def test_mismatch
+    xz = sample(LZMA::CHECK_SHA256)
+    blocks = LZMA::Index.scan(StringIO.new(xz)).each_block.to_a
+    assert_operator(blocks.size, :>, 2)
+    block = blocks[1]
+    pos = block[:compressed_file_offset] + block[:total_size] - 1
+    xz.setbyte(pos, xz.getbyte(pos) ^ 1)
+
+    assert_raise(LZMA::DataError) { LZMA.decode(xz) }
+    e = assert_raise(LZMA::DataError) { LZMA.decode(xz, offload_check: true) }
+    assert_match(/\(block #{block[:number]}\)/, e.message)
+  end
+
+  def test_check_pipe
+    pipe = LZMA::Utils::CheckPipe.new(1024)
+    data = "abc" * 1000
+    sha = LZMA::Utils::SHA256.digest(data)
+    crc = [LZMA::Utils.crc32(data)].pack("V")
+
+    pipe.begin_block(LZMA::CHECK_SHA256)
+    data.each_char.each_slice(500) { |s| pipe << s.join }
+    pipe.end_block(sha, 0)
+    pipe.begin_block(LZMA::CHECK_CRC32)
+    pipe << data
+    pipe.end_block(crc, 1)
+    assert_nil(pipe.wait)
+    assert_equal({ blocks: 2, bytes: data.bytesize * 2, pending: 0 }, pipe.stats)
+
+    pipe.begin_block(LZMA::CHECK_CRC32)
+    pipe << data
+    pipe.end_block(crc.reverse, 7)
+    assert_equal(7, pipe.wait)
+    pipe.close
+    assert_raise(IOError) { pipe << data }
+    assert_equal(4, LZMA::Utils.check_size(LZMA::CHECK_CRC32))
+    assert_equal(32, LZMA::Utils.check_size(LZMA::CHECK_SHA256))
+  end
+
+  def test_check_pipe_fork
+    omit "fork is not available" unless Process.respond_to?(:fork)
+    require "timeout"
+
+    pipe = LZMA::Utils::CheckPipe.new
+    pipe.begin_block(LZMA::CHECK_CRC64)
+    pipe << "abc" * 100000
+    pid = fork do
+      ok = begin
+             pipe << "def"
+             false
+           rescue IOError
+             true
+           end
+      pipe.close
+      pipe = nil
+      GC.start
+      exit!(ok)
+    end
+    Timeout.timeout(10) { Process.wait(pid) }
+    assert_true($?.success?)
+    pipe.end_block([LZMA::Utils.crc64("abc" * 100000)].pack("Q<"), 0)
+    assert_nil(pipe.wait)
+    pipe.close
+  end
+end